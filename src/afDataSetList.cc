@@ -149,6 +149,25 @@ const char *dataSetList::get_default_tree() {
   return NULL;
 }
 
+/** Gets the staging priority of the current dataset, optionally given as a
+ *  "priority=N" token in the title of the file collection: higher values are
+ *  staged first. Returns zero if not set or if no dataset is selected.
+ */
+int dataSetList::get_priority() {
+
+  if (!fi_coll) return 0;
+
+  const char *title = fi_coll->GetTitle();
+  const char *tok = title ? strstr(title, "priority=") : NULL;
+
+  // Must be at the beginning of a word
+  while ((tok) && (tok != title) && (!isspace(*(tok-1))))
+    tok = strstr(tok+1, "priority=");
+  if (!tok) return 0;
+
+  return (int)strtol(tok+9, NULL, 10);
+}
+
 /** Sets the default tree name in datasets list. Returns false if no file
  *  collection is currently selected or if tree name did not change, true if
  *  default name has been changed.
@@ -207,6 +226,15 @@ bool dataSetList::fetch_files(const char *ds_name, const char *filter) {
   fi_inited = true;
   fi_curr = NULL;
 
+  set_filter(filter);
+
+  return true;
+}
+
+/** Sets the criteria of the files returned by next_file(): see fetch_files().
+ */
+void dataSetList::set_filter(const char *filter) {
+
   fi_filter.reset();
 
   if (strchr(filter, 'S')) fi_filter.set(idx_S);
@@ -236,7 +264,6 @@ bool dataSetList::fetch_files(const char *ds_name, const char *filter) {
     fi_filter.test(idx_C), fi_filter.test(idx_c),
     fi_filter.test(idx_E), fi_filter.test(idx_e));
 
-  return true;
 }
 
 /** Frees the resources taken by the dataset list reading. This funcion must be
@@ -15,6 +15,8 @@
 #include "afLog.h"
 
 #include <cerrno>
+#include <cctype>
+#include <cstdlib>
 #include <stdexcept>
 #include <bitset>
 #include <string>
@@ -61,6 +63,7 @@ namespace af {
         const char *new_name = NULL);
       bool remove_dataset(const char *ds_uri);
       const char *get_default_tree();
+      int get_priority();
       const TFileCollection *get_fc() const { return fi_coll; };
       bool set_default_tree(const char *treename);
 
@@ -81,6 +84,8 @@ namespace af {
 
     private:
 
+      void set_filter(const char *filter);
+
       TDataSetManagerFile        *ds_mgr;
       std::vector<std::string *>  ds_list;
       int                         ds_cur_idx;
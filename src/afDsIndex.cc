@@ -0,0 +1,372 @@
+/**
+ * afDsIndex.cc -- by Dario Berzano <dario.berzano@cern.ch>
+ *
+ * This file is part of afdsmgrd -- see http://code.google.com/p/afdsmgrd
+ *
+ * See header file for a description of the class.
+ */
+
+#include "afDsIndex.h"
+
+using namespace af;
+
+/** Constructor. No file is associated to the index at first: updates are
+ *  silently ignored until open() is called.
+ */
+dsIndex::dsIndex() : db(NULL), query_get_ds(NULL), query_seen_ds(NULL),
+  query_set_ds(NULL), query_del_urls(NULL), query_add_url(NULL),
+  in_batch(false), n_in_batch(0) {}
+
+/** Destructor.
+ */
+dsIndex::~dsIndex() {
+  close();
+}
+
+/** Opens (or creates) the index in the given SQLite file, closing the current
+ *  one (if any). An index written by a different version of the daemon is
+ *  emptied. A NULL or empty file name just closes the current index. Returns
+ *  false if the index can't be opened.
+ */
+bool dsIndex::open(const char *_file_name) {
+
+  close();
+
+  if ((!_file_name) || (*_file_name == '\0')) return true;
+
+  if (sqlite3_open(_file_name, &db) != SQLITE_OK) {
+    log::error(log_level_high, "Can't open dataset index %s: %s", _file_name,
+      sqlite3_errmsg(db));
+    sqlite3_close(db);
+    db = NULL;
+    return false;
+  }
+
+  // Readers may lock the file for a while: wait for them instead of failing
+  sqlite3_busy_timeout(db, AF_DSINDEX_BUSY_MSEC);
+
+  // Schema version is kept in the user_version pragma
+  int version = -1;
+  sqlite3_stmt *q_ver;
+  if (prepare(&q_ver, "PRAGMA user_version")) {
+    if (sqlite3_step(q_ver) == SQLITE_ROW)
+      version = sqlite3_column_int(q_ver, 0);
+    sqlite3_finalize(q_ver);
+  }
+
+  char ver_sql[100];
+  snprintf(ver_sql, sizeof(ver_sql), "PRAGMA user_version=%d",
+    AF_DSINDEX_VERSION);
+
+  bool ok = (version >= 0);
+
+  if ((ok) && (version != AF_DSINDEX_VERSION)) {
+    if (version != 0) {
+      log::warning(log_level_normal, "Dataset index %s has version %d: "
+        "it will be rebuilt", _file_name, version);
+    }
+    ok = exec("DROP TABLE IF EXISTS urls;"
+      "DROP TABLE IF EXISTS datasets") && exec(ver_sql);
+  }
+
+  ok = ok && exec(
+    "CREATE TABLE IF NOT EXISTS datasets ("
+    "  ds_name VARCHAR( 200 ) PRIMARY KEY NOT NULL,"
+    "  mtime INTEGER NOT NULL DEFAULT 0,"  // of the dataset file
+    "  mtime_nsec INTEGER NOT NULL DEFAULT 0,"
+    "  file_size INTEGER NOT NULL DEFAULT 0,"
+    "  inode INTEGER NOT NULL DEFAULT 0,"
+    "  n_files INTEGER NOT NULL DEFAULT 0,"
+    "  n_staged INTEGER NOT NULL DEFAULT 0,"
+    "  n_corrupted INTEGER NOT NULL DEFAULT 0,"
+    "  tree_name VARCHAR( 50 ) NOT NULL DEFAULT '',"
+    "  n_events INTEGER NOT NULL DEFAULT 0,"
+    "  total_size_bytes INTEGER NOT NULL DEFAULT 0"
+    ");"
+    "CREATE TABLE IF NOT EXISTS urls ("
+    "  url VARCHAR( 200 ) NOT NULL,"
+    "  ds_name VARCHAR( 200 ) NOT NULL"
+    ");"
+    "CREATE INDEX IF NOT EXISTS urls_by_url ON urls (url);"
+    "CREATE INDEX IF NOT EXISTS urls_by_ds ON urls (ds_name);"
+    "CREATE TEMPORARY TABLE IF NOT EXISTS seen ("  // during the current pass
+    "  ds_name VARCHAR( 200 ) PRIMARY KEY NOT NULL"
+    ")");
+
+  ok = ok &&
+    prepare(&query_get_ds,
+      "SELECT mtime,mtime_nsec,file_size,inode FROM datasets "
+      "  WHERE ds_name=?") &&
+    prepare(&query_seen_ds,
+      "INSERT OR IGNORE INTO temp.seen (ds_name) VALUES (?)") &&
+    prepare(&query_set_ds,
+      "INSERT OR REPLACE INTO datasets (ds_name,mtime,mtime_nsec,file_size,"
+      "  inode,n_files,n_staged,n_corrupted,tree_name,n_events,"
+      "  total_size_bytes) VALUES (?,?,?,?,?,?,?,?,?,?,?)") &&
+    prepare(&query_del_urls,
+      "DELETE FROM urls WHERE ds_name=?") &&
+    prepare(&query_add_url,
+      "INSERT INTO urls (url,ds_name) VALUES (?,?)");
+
+  if (!ok) {
+    log::error(log_level_high, "Can't initialize dataset index %s",
+      _file_name);
+    close();
+    return false;
+  }
+
+  file_name = _file_name;
+  return true;
+}
+
+/** Closes the index, committing pending updates.
+ */
+void dsIndex::close() {
+  if (!db) return;
+  commit_batch();
+  finalize();
+  sqlite3_close(db);
+  db = NULL;
+  file_name.clear();
+}
+
+/** Frees the prepared statements.
+ */
+void dsIndex::finalize() {
+  sqlite3_stmt **stmts[] = { &query_get_ds, &query_seen_ds, &query_set_ds,
+    &query_del_urls, &query_add_url };
+  for (unsigned int i=0; i<sizeof(stmts)/sizeof(sqlite3_stmt **); i++) {
+    if (*stmts[i]) {
+      sqlite3_finalize(*stmts[i]);
+      *stmts[i] = NULL;
+    }
+  }
+}
+
+/** Executes the given SQL statements, logging errors. Returns true on success.
+ */
+bool dsIndex::exec(const char *sql) {
+  char *sql_err;
+  if (sqlite3_exec(db, sql, NULL, NULL, &sql_err) != SQLITE_OK) {
+    log::error(log_level_high, "Error in dataset index query: %s", sql_err);
+    sqlite3_free(sql_err);
+    return false;
+  }
+  return true;
+}
+
+/** Prepares the given SQL statement, logging errors. Returns true on success.
+ */
+bool dsIndex::prepare(sqlite3_stmt **stmt, const char *sql) {
+  if (sqlite3_prepare_v2(db, sql, -1, stmt, NULL) != SQLITE_OK) {
+    log::error(log_level_high, "Error while preparing dataset index query: "
+      "%s", sqlite3_errmsg(db));
+    *stmt = NULL;
+    return false;
+  }
+  return true;
+}
+
+/** Opens the transaction of a batch of updates, if not open yet. Returns true
+ *  on success.
+ */
+bool dsIndex::begin_batch() {
+  if (in_batch) return true;
+  if (!exec("BEGIN TRANSACTION")) return false;
+  in_batch = true;
+  n_in_batch = 0;
+  return true;
+}
+
+/** Commits the current batch of updates, if any: readers see them from now on.
+ *  Returns true on success.
+ */
+bool dsIndex::commit_batch() {
+  if (!in_batch) return true;
+  in_batch = false;
+  if (!exec("COMMIT")) {
+    exec("ROLLBACK");
+    return false;
+  }
+  return true;
+}
+
+/** Records that the given dataset has been seen during the current pass: the
+ *  record is kept in memory only. Returns true on success.
+ */
+bool dsIndex::set_seen(const char *ds_name) {
+  sqlite3_reset(query_seen_ds);
+  sqlite3_bind_text(query_seen_ds, 1, ds_name, -1, SQLITE_STATIC);
+  bool ok = (sqlite3_step(query_seen_ds) == SQLITE_DONE);
+  sqlite3_reset(query_seen_ds);
+  return ok;
+}
+
+/** Gets modification time, size and inode of the given dataset file. Returns
+ *  false if the file can't be accessed. This function is declared as static.
+ */
+bool dsIndex::stat_file(const char *ds_file, struct stat *st) {
+  return ((ds_file) && (stat(ds_file, st) == 0));
+}
+
+/** Starts a pass over the whole repository: datasets not updated before the
+ *  next call to end_pass() are considered removed.
+ */
+void dsIndex::begin_pass() {
+  if (!db) return;
+  commit_batch();
+  exec("DELETE FROM temp.seen");
+}
+
+/** Ends a pass over the repository started with begin_pass(), removing from
+ *  the index datasets not updated meanwhile. Returns the number of removed
+ *  datasets.
+ */
+unsigned int dsIndex::end_pass() {
+
+  if (!db) return 0;
+
+  commit_batch();
+  if (!exec("BEGIN TRANSACTION")) return 0;
+
+  unsigned int n_removed = 0;
+  bool ok = exec("DELETE FROM urls WHERE ds_name NOT IN "
+    "(SELECT ds_name FROM temp.seen)");
+  if (ok) {
+    ok = exec("DELETE FROM datasets WHERE ds_name NOT IN "
+      "(SELECT ds_name FROM temp.seen)");
+    n_removed = sqlite3_changes(db);
+  }
+
+  if ((!ok) || (!exec("COMMIT"))) {
+    exec("ROLLBACK");
+    return 0;
+  }
+
+  return n_removed;
+}
+
+/** Updates the index of the given dataset, whose content is in fc (summarized
+ *  in summary, see get_summary()) and whose file is ds_file. The dataset is
+ *  indexed again only if the file has changed since the last time. The st
+ *  parameter, if given, holds the modification time (with nanoseconds), size
+ *  and inode of the file as they were when fc was read: files replaced by a
+ *  rename or rewritten within the same second are told apart. If the file
+ *  changes afterwards, the index is left stale instead of wrong. Changes are
+ *  committed every AF_DSINDEX_BATCH_SIZE indexed datasets, or at the end of
+ *  the pass. Returns true on success.
+ */
+bool dsIndex::update(const char *ds_name, const char *ds_file,
+  const TFileCollection *fc, const ds_summary_t &summary,
+  const struct stat *st) {
+
+  if (!db) return true;
+  if ((!ds_name) || (!fc)) return false;
+
+  struct stat st_now;
+  if (!st) {
+    if (!stat_file(ds_file, &st_now)) return false;
+    st = &st_now;
+  }
+
+  // Is the current index of this dataset up to date?
+  sqlite3_reset(query_get_ds);
+  sqlite3_bind_text(query_get_ds, 1, ds_name, -1, SQLITE_STATIC);
+
+  bool current = ((sqlite3_step(query_get_ds) == SQLITE_ROW) &&
+    (sqlite3_column_int64(query_get_ds, 0) == (sqlite3_int64)st->st_mtime) &&
+    (sqlite3_column_int64(query_get_ds, 1) ==
+      (sqlite3_int64)st->st_mtim.tv_nsec) &&
+    (sqlite3_column_int64(query_get_ds, 2) == (sqlite3_int64)st->st_size) &&
+    (sqlite3_column_int64(query_get_ds, 3) == (sqlite3_int64)st->st_ino));
+  sqlite3_reset(query_get_ds);
+
+  if (current) return set_seen(ds_name);
+
+  // Index all the URLs of the dataset within the batch: on errors, only the
+  // changes to this dataset are undone
+  if ((!begin_batch()) || (!exec("SAVEPOINT ds_update"))) return false;
+
+  sqlite3_reset(query_del_urls);
+  sqlite3_bind_text(query_del_urls, 1, ds_name, -1, SQLITE_STATIC);
+  bool ok = (sqlite3_step(query_del_urls) == SQLITE_DONE);
+  sqlite3_reset(query_del_urls);
+
+  TIter i(fc->GetList());
+  TFileInfo *fi;
+
+  while ((ok) && (fi = dynamic_cast<TFileInfo *>(i.Next()))) {
+
+    TUrl *url;
+    fi->ResetUrl();
+
+    while ((ok) && (url = fi->NextUrl())) {
+      sqlite3_reset(query_add_url);
+      sqlite3_bind_text(query_add_url, 1, url->GetUrl(), -1,
+        SQLITE_TRANSIENT);
+      sqlite3_bind_text(query_add_url, 2, ds_name, -1, SQLITE_STATIC);
+      ok = (sqlite3_step(query_add_url) == SQLITE_DONE);
+    }
+
+    fi->ResetUrl();
+  }
+
+  sqlite3_reset(query_add_url);
+
+  if (ok) {
+    sqlite3_reset(query_set_ds);
+    sqlite3_bind_text(query_set_ds, 1, ds_name, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(query_set_ds, 2, (sqlite3_int64)st->st_mtime);
+    sqlite3_bind_int64(query_set_ds, 3, (sqlite3_int64)st->st_mtim.tv_nsec);
+    sqlite3_bind_int64(query_set_ds, 4, (sqlite3_int64)st->st_size);
+    sqlite3_bind_int64(query_set_ds, 5, (sqlite3_int64)st->st_ino);
+    sqlite3_bind_int(query_set_ds, 6, summary.n_files);
+    sqlite3_bind_int(query_set_ds, 7, summary.n_staged);
+    sqlite3_bind_int(query_set_ds, 8, summary.n_corrupted);
+    sqlite3_bind_text(query_set_ds, 9, summary.tree_name.c_str(), -1,
+      SQLITE_STATIC);
+    sqlite3_bind_int64(query_set_ds, 10, (sqlite3_int64)summary.n_events);
+    sqlite3_bind_int64(query_set_ds, 11,
+      (sqlite3_int64)summary.total_size_bytes);
+    ok = (sqlite3_step(query_set_ds) == SQLITE_DONE);
+    sqlite3_reset(query_set_ds);
+  }
+
+  ok = ok && set_seen(ds_name);
+
+  if ((!ok) || (!exec("RELEASE ds_update"))) {
+    log::error(log_level_normal, "Can't update dataset index of %s: %s",
+      ds_name, sqlite3_errmsg(db));
+    exec("ROLLBACK TO ds_update");
+    exec("RELEASE ds_update");
+    return false;
+  }
+
+  if (++n_in_batch >= AF_DSINDEX_BATCH_SIZE) return commit_batch();
+  return true;
+}
+
+/** Fills the summary of the given dataset, whose default tree is tree_name
+ *  (may be NULL). This function is declared as static.
+ */
+void dsIndex::get_summary(const TFileCollection *fc, const char *tree_name,
+  ds_summary_t &summary) {
+
+  long long total_size = fc->GetTotalSize();
+  if (total_size < 0LL) total_size = 0LL;
+
+  summary.n_files = (int)fc->GetNFiles();
+  summary.n_staged = (int)fc->GetNStagedFiles();
+  summary.n_corrupted = (int)fc->GetNCorruptFiles();
+  summary.total_size_bytes = (unsigned long long)total_size;
+
+  if (tree_name) {
+    summary.tree_name = tree_name;
+    summary.n_events = fc->GetTotalEntries(tree_name);
+    if (summary.n_events < 0) summary.n_events = 0;
+  }
+  else {
+    summary.tree_name.clear();
+    summary.n_events = 0;
+  }
+}
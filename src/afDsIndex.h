@@ -0,0 +1,98 @@
+/**
+ * afDsIndex.h -- by Dario Berzano <dario.berzano@cern.ch>
+ *
+ * This file is part of afdsmgrd -- see http://code.google.com/p/afdsmgrd
+ *
+ * Persistent index of the dataset repository, kept in a SQLite file that can
+ * be read by other programs (e.g. afdsutil) while the daemon writes it. For
+ * each dataset the index holds the modification time and size of its file, a
+ * summary of its content (the same sent to the notification plugin) and every
+ * URL of its entries. A dataset is reindexed only when its file has
+ * changed since the last time: readers compare the same values to tell if the
+ * index of a dataset is still current, and fall back on reading the dataset
+ * if it is not. Updates are committed in batches of datasets, and datasets
+ * seen during a pass are tracked in memory, so that unchanged datasets cost no
+ * write to the file.
+ */
+
+#ifndef AFDSINDEX_H
+#define AFDSINDEX_H
+
+#define AF_DSINDEX_VERSION 4
+#define AF_DSINDEX_BUSY_MSEC 5000
+#define AF_DSINDEX_BATCH_SIZE 50
+
+#include <string>
+
+#include <string.h>
+#include <sys/stat.h>
+
+#include "sqlite3.h"
+
+#include <TFileCollection.h>
+#include <TFileInfo.h>
+#include <TUrl.h>
+
+#include "afLog.h"
+
+namespace af {
+
+  /** Summary of the content of a dataset.
+   */
+  typedef struct {
+    int                n_files;
+    int                n_staged;
+    int                n_corrupted;
+    std::string        tree_name;  // empty if none
+    long long          n_events;   // in the default tree
+    unsigned long long total_size_bytes;
+  } ds_summary_t;
+
+  /** The main class of this file.
+   */
+  class dsIndex {
+
+    public:
+
+      dsIndex();
+      virtual ~dsIndex();
+
+      bool open(const char *file_name);
+      void close();
+      inline bool is_open() const { return (db != NULL); };
+      inline const char *get_file_name() const { return file_name.c_str(); };
+
+      void begin_pass();
+      bool update(const char *ds_name, const char *ds_file,
+        const TFileCollection *fc, const ds_summary_t &summary,
+        const struct stat *st = NULL);
+      unsigned int end_pass();
+
+      static bool stat_file(const char *ds_file, struct stat *st);
+      static void get_summary(const TFileCollection *fc,
+        const char *tree_name, ds_summary_t &summary);
+
+    private:
+
+      bool exec(const char *sql);
+      bool prepare(sqlite3_stmt **stmt, const char *sql);
+      void finalize();
+      bool begin_batch();
+      bool commit_batch();
+      bool set_seen(const char *ds_name);
+
+      sqlite3      *db;
+      std::string   file_name;
+      sqlite3_stmt *query_get_ds;
+      sqlite3_stmt *query_seen_ds;
+      sqlite3_stmt *query_set_ds;
+      sqlite3_stmt *query_del_urls;
+      sqlite3_stmt *query_add_url;
+      bool          in_batch;     // a transaction is open
+      unsigned int  n_in_batch;   // datasets updated in the transaction
+
+  };
+
+};
+
+#endif // AFDSINDEX_H
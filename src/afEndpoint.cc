@@ -0,0 +1,309 @@
+/**
+ * afEndpoint.cc -- by Dario Berzano <dario.berzano@cern.ch>
+ *
+ * This file is part of afdsmgrd -- see http://code.google.com/p/afdsmgrd
+ *
+ * See header file for a description of the class.
+ */
+
+#include "afEndpoint.h"
+
+using namespace af;
+
+////////////////////////////////////////////////////////////////////////////////
+// Member functions for the af::rollingHist class
+////////////////////////////////////////////////////////////////////////////////
+
+/** Accounts for a value. When the current window is over, the previous one is
+ *  discarded and a new one begins.
+ */
+void rollingHist::fill(double val, double now_sec) {
+
+  if (window_start < 0.) window_start = now_sec;
+  else if (now_sec - window_start >= AF_ENDPOINT_WINDOW_SECS) {
+    cur = 1 - cur;
+    hists[cur].reset();
+    window_start = now_sec;
+  }
+
+  hists[cur].fill(val);
+}
+
+/** Copies the content of both windows into the given histogram.
+ */
+void rollingHist::get(phaseHist &dest) const {
+  dest.reset();
+  dest.add(hists[0]);
+  dest.add(hists[1]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Member functions for the af::endpoint class
+////////////////////////////////////////////////////////////////////////////////
+
+/** Constructor: no transfers, circuit breaker off.
+ */
+endpoint::endpoint() : n_running(0), cap(0), weight(1), n_ok(0), n_fail(0),
+  breaker(breaker_closed), breaker_threshold(0), breaker_probe_secs(0.),
+  breaker_opened_at(0.), n_consec_fail(0), n_trips(0) {}
+
+/** Returns how many more transfers can be started now: a large number if the
+ *  endpoint has no limits, none if the circuit breaker is open and at most one
+ *  (the probe) if it is half-open.
+ */
+unsigned int endpoint::get_free_slots() const {
+  if (breaker == breaker_open) return 0;
+  if (breaker == breaker_half_open) return (n_running == 0) ? 1 : 0;
+  if (cap == 0) return std::numeric_limits<unsigned int>::max();
+  return (n_running < cap) ? cap - n_running : 0;
+}
+
+/** Sets the number of consecutive failures opening the circuit breaker (zero
+ *  turns it off, closing it) and the seconds before probing the endpoint.
+ */
+void endpoint::set_breaker(unsigned int _threshold, double _probe_secs) {
+  breaker_threshold = _threshold;
+  breaker_probe_secs = _probe_secs;
+  if (breaker_threshold == 0) breaker = breaker_closed;
+}
+
+/** Lets the circuit breaker go from open to half-open when it is time to probe
+ *  the endpoint. Returns true if the state changed.
+ */
+bool endpoint::check_breaker(double now_sec) {
+  if ((breaker != breaker_open) ||
+    (now_sec - breaker_opened_at < breaker_probe_secs)) return false;
+  breaker = breaker_half_open;
+  return true;
+}
+
+/** Accounts for a finished transfer: time spent waiting in queue, time spent
+ *  staging and, for successful transfers of known size, throughput. Returns
+ *  true if the state of the circuit breaker changed.
+ */
+bool endpoint::done(bool ok, double wait_sec, double stage_sec,
+  unsigned long long size_bytes, double now_sec) {
+
+  breaker_state_t prev_breaker = breaker;
+
+  if (n_running > 0) n_running--;
+
+  if (ok) {
+    n_ok++;
+    n_consec_fail = 0;
+    breaker = breaker_closed;
+  }
+  else {
+    n_fail++;
+    n_consec_fail++;
+    if ((breaker_threshold > 0) && ((breaker == breaker_half_open) ||
+      ((breaker == breaker_closed) && (n_consec_fail >= breaker_threshold)))) {
+      breaker = breaker_open;
+      breaker_opened_at = now_sec;
+      n_trips++;
+    }
+  }
+
+  if (wait_sec >= 0.) wait_hist.fill(wait_sec, now_sec);
+
+  if (stage_sec >= 0.) {
+    stage_hist.fill(stage_sec, now_sec);
+    if ((ok) && (size_bytes > 0) && (stage_sec > 0.))
+      mbps_hist.fill((double)size_bytes / stage_sec * 1e-6, now_sec);
+  }
+
+  return (breaker != prev_breaker);
+}
+
+/** Returns how long transferring the given amount of bytes is expected to
+ *  take at the slowest recent throughput of the endpoint (5th percentile), or
+ *  a negative value if too few transfers are known.
+ */
+double endpoint::get_expected_secs(unsigned long long size_bytes) const {
+
+  phaseHist mbps;
+  mbps_hist.get(mbps);
+  if (mbps.get_count() < AF_ENDPOINT_MIN_MBPS_SAMPLES) return -1.;
+
+  double mbps_low = mbps.get_quantile(.05);
+  if (mbps_low <= 0.) return -1.;
+
+  return (double)size_bytes * 1e-6 / mbps_low;
+}
+
+/** Returns a string describing the given state of a circuit breaker. This
+ *  function is declared as static.
+ */
+const char *endpoint::breaker_str(breaker_state_t state) {
+  switch (state) {
+    case breaker_closed:    return "closed";
+    case breaker_half_open: return "half-open";
+    case breaker_open:      return "open";
+  }
+  return "unknown";
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Member functions for the af::endpointList class
+////////////////////////////////////////////////////////////////////////////////
+
+/** Constructor: endpoints have no limits and no circuit breaker.
+ */
+endpointList::endpointList() : breaker_threshold(0), breaker_probe_secs(0.) {
+  default_limits.cap = 0;
+  default_limits.weight = 1;
+}
+
+/** Returns the statistics of the given endpoint, creating them with their
+ *  configured limits if needed.
+ */
+endpoint &endpointList::get_by_host(const std::string &host) {
+
+  endpoint_map_t::iterator it = endpoints.find(host);
+  if (it != endpoints.end()) return it->second;
+
+  endpoint &ep = endpoints[host];
+  const endpoint_limits_t &l = find_limits(host);
+  ep.set_limits(l.cap, l.weight);
+  ep.set_breaker(breaker_threshold, breaker_probe_secs);
+  return ep;
+}
+
+/** Sets the circuit breaker of all the endpoints: see endpoint::set_breaker().
+ */
+void endpointList::set_breaker(unsigned int threshold, double probe_secs) {
+  breaker_threshold = threshold;
+  breaker_probe_secs = probe_secs;
+  for (endpoint_map_t::iterator it=endpoints.begin(); it!=endpoints.end();
+    it++) {
+    it->second.set_breaker(threshold, probe_secs);
+  }
+}
+
+/** Returns the limits configured for the given host: host and port must match
+ *  exactly, then the host alone is tried, then the defaults are used.
+ */
+const endpoint_limits_t &endpointList::find_limits(
+  const std::string &host) const {
+
+  endpoint_limits_map_t::const_iterator it = limits.find(host);
+  if (it != limits.end()) return it->second;
+
+  size_t colon = host.rfind(':');
+  if (colon != std::string::npos) {
+    it = limits.find( host.substr(0, colon) );
+    if (it != limits.end()) return it->second;
+  }
+
+  return default_limits;
+}
+
+/** Sets the limits of the endpoints from a space-separated list of items in
+ *  the form host[:port]=cap[/weight], where host can be "*" for all other
+ *  endpoints and a cap of zero means no limit. Limits are applied to already
+ *  known endpoints too. Malformed items are skipped and false is returned.
+ */
+bool endpointList::set_limits(const char *spec) {
+
+  bool ok = true;
+
+  limits.clear();
+  default_limits.cap = 0;
+  default_limits.weight = 1;
+
+  std::istringstream iss(spec ? spec : "");
+  std::string item;
+
+  while (iss >> item) {
+
+    size_t eq = item.find('=');
+    if ((eq == std::string::npos) || (eq == 0)) {
+      log::error(log_level_high, "Invalid endpoint limits: %s", item.c_str());
+      ok = false;
+      continue;
+    }
+
+    const char *val = item.c_str() + eq + 1;
+    char *endp;
+    endpoint_limits_t l;
+
+    l.cap = strtoul(val, &endp, 10);
+    l.weight = 1;
+    if (*endp == '/') l.weight = strtoul(endp+1, &endp, 10);
+
+    if ((endp == val) || (*endp != '\0') || (l.weight == 0)) {
+      log::error(log_level_high, "Invalid endpoint limits: %s", item.c_str());
+      ok = false;
+      continue;
+    }
+
+    std::string host = item.substr(0, eq);
+    if (host == "*") default_limits = l;
+    else limits[host] = l;
+  }
+
+  for (endpoint_map_t::iterator it=endpoints.begin(); it!=endpoints.end();
+    it++) {
+    const endpoint_limits_t &l = find_limits(it->first);
+    it->second.set_limits(l.cap, l.weight);
+  }
+
+  return ok;
+}
+
+/** Returns the host (and port, if any) of the given URL, without the user.
+ *  URLs without a protocol are considered local.
+ */
+std::string endpointList::get_host(const char *url) {
+
+  if (!url) return "local";
+
+  const char *beg = strstr(url, "://");
+  if (!beg) return "local";
+  beg += 3;
+
+  const char *end = strchr(beg, '/');
+  if (!end) end = beg + strlen(beg);
+
+  const char *at = (const char *)memchr(beg, '@', end-beg);
+  if (at) beg = at+1;
+
+  if (beg == end) return "local";
+  return std::string(beg, end-beg);
+}
+
+/** Writes one line on the log for every endpoint, with the statistics of the
+ *  last one or two windows.
+ */
+void endpointList::log_dump(log_level_t level) const {
+
+  if (!log::enabled(level)) return;
+
+  if (endpoints.empty()) {
+    log::info(level, "No transfers to any storage endpoint so far");
+    return;
+  }
+
+  phaseHist wait, stage, mbps;
+
+  for (endpoint_map_t::const_iterator it=endpoints.begin();
+    it!=endpoints.end(); it++) {
+
+    const endpoint &ep = it->second;
+    ep.get_wait(wait);
+    ep.get_stage(stage);
+    ep.get_mbps(mbps);
+
+    log::info(level, "Endpoint %s: %u running (max %u, weight %u), "
+      "%lu OK, %lu failed, breaker %s (%u in a row, %lu trips) || "
+      "Wait p50/p95: %.1lf/%.1lf s | "
+      "Stage p50/p95: %.1lf/%.1lf s | MB/s p50/p5: %.2lf/%.2lf",
+      it->first.c_str(), ep.get_n_running(), ep.get_cap(), ep.get_weight(),
+      ep.get_n_ok(), ep.get_n_fail(), ep.get_breaker_str(),
+      ep.get_n_consec_fail(), ep.get_n_trips(),
+      wait.get_quantile(.5), wait.get_quantile(.95),
+      stage.get_quantile(.5), stage.get_quantile(.95),
+      mbps.get_quantile(.5), mbps.get_quantile(.05));
+  }
+
+}
@@ -0,0 +1,157 @@
+/**
+ * afEndpoint.h -- by Dario Berzano <dario.berzano@cern.ch>
+ *
+ * This file is part of afdsmgrd -- see http://code.google.com/p/afdsmgrd
+ *
+ * Statistics of the transfers per storage endpoint, identified by the host
+ * (and port) of the URLs. Queue wait, stage duration and throughput are kept
+ * in rolling histograms covering the last one or two windows. Each endpoint
+ * has a maximum number of concurrent transfers and a weight, used to share
+ * the staging slots amongst endpoints.
+ *
+ * Each endpoint has a circuit breaker too: after a number of consecutive
+ * failures it opens and no more transfers are started, then after some time
+ * it lets a single transfer through (half-open) to probe the endpoint, and it
+ * closes again as soon as a transfer succeeds.
+ */
+
+#ifndef AFENDPOINT_H
+#define AFENDPOINT_H
+
+#define AF_ENDPOINT_WINDOW_SECS 1800.
+#define AF_ENDPOINT_MIN_MBPS_SAMPLES 5
+
+#include <string>
+#include <map>
+#include <sstream>
+#include <limits>
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "afLog.h"
+#include "afResMon.h"
+
+namespace af {
+
+  /** Rolling histogram: the current and the previous window are kept, and
+   *  quantiles are estimated on both.
+   */
+  class rollingHist {
+
+    public:
+      rollingHist() : cur(0), window_start(-1.) {};
+      void fill(double val, double now_sec);
+      void get(phaseHist &dest) const;
+
+    private:
+      phaseHist hists[2];
+      int       cur;
+      double    window_start;
+
+  };
+
+  /** States of the circuit breaker of an endpoint.
+   */
+  typedef enum { breaker_closed, breaker_half_open, breaker_open }
+    breaker_state_t;
+
+  /** Statistics of a single storage endpoint.
+   */
+  class endpoint {
+
+    public:
+      endpoint();
+      inline void started() { n_running++; };
+      bool done(bool ok, double wait_sec, double stage_sec,
+        unsigned long long size_bytes, double now_sec);
+      inline unsigned int get_n_running() const { return n_running; };
+      inline unsigned int get_cap() const { return cap; };
+      inline unsigned int get_weight() const { return weight; };
+      inline void set_limits(unsigned int _cap, unsigned int _weight) {
+        cap = _cap;
+        weight = (_weight > 0) ? _weight : 1;
+      };
+      unsigned int get_free_slots() const;
+      void set_breaker(unsigned int _threshold, double _probe_secs);
+      bool check_breaker(double now_sec);
+      inline breaker_state_t get_breaker() const { return breaker; };
+      inline const char *get_breaker_str() const {
+        return breaker_str(breaker);
+      };
+      inline unsigned int get_n_consec_fail() const { return n_consec_fail; };
+      inline unsigned long get_n_trips() const { return n_trips; };
+      inline unsigned long get_n_ok() const { return n_ok; };
+      inline unsigned long get_n_fail() const { return n_fail; };
+      inline void get_wait(phaseHist &dest) const { wait_hist.get(dest); };
+      inline void get_stage(phaseHist &dest) const { stage_hist.get(dest); };
+      inline void get_mbps(phaseHist &dest) const { mbps_hist.get(dest); };
+      double get_expected_secs(unsigned long long size_bytes) const;
+
+      static const char *breaker_str(breaker_state_t state);
+
+    private:
+      unsigned int  n_running;
+      unsigned int  cap;     // max concurrent transfers, 0 means no limit
+      unsigned int  weight;  // transfers started per round-robin turn
+      unsigned long n_ok;
+      unsigned long n_fail;
+      rollingHist   wait_hist;   // seconds
+      rollingHist   stage_hist;  // seconds
+      rollingHist   mbps_hist;   // MB/s (1 MB = 10^6 bytes)
+      breaker_state_t breaker;
+      unsigned int  breaker_threshold;  // consecutive failures, 0 means off
+      double        breaker_probe_secs;
+      double        breaker_opened_at;
+      unsigned int  n_consec_fail;
+      unsigned long n_trips;
+
+  };
+
+  typedef std::map<std::string, endpoint> endpoint_map_t;
+
+  /** Limits of an endpoint, as configured.
+   */
+  typedef struct {
+    unsigned int cap;
+    unsigned int weight;
+  } endpoint_limits_t;
+
+  typedef std::map<std::string, endpoint_limits_t> endpoint_limits_map_t;
+
+  /** All the endpoints seen so far, by host.
+   */
+  class endpointList {
+
+    public:
+      endpointList();
+      inline endpoint &get(const char *url) {
+        return get_by_host( get_host(url) );
+      };
+      endpoint &get_by_host(const std::string &host);
+      bool set_limits(const char *spec);
+      void set_breaker(unsigned int threshold, double probe_secs);
+      void log_dump(log_level_t level) const;
+      inline endpoint_map_t::const_iterator begin() const {
+        return endpoints.begin();
+      };
+      inline endpoint_map_t::const_iterator end() const {
+        return endpoints.end();
+      };
+
+      static std::string get_host(const char *url);
+
+    private:
+      const endpoint_limits_t &find_limits(const std::string &host) const;
+
+      endpoint_map_t        endpoints;
+      endpoint_limits_map_t limits;
+      endpoint_limits_t     default_limits;
+      unsigned int          breaker_threshold;
+      double                breaker_probe_secs;
+
+  };
+
+};
+
+#endif // AFENDPOINT_H
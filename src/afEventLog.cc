@@ -0,0 +1,196 @@
+/**
+ * afEventLog.cc -- by Dario Berzano <dario.berzano@cern.ch>
+ *
+ * This file is part of afdsmgrd -- see http://code.google.com/p/afdsmgrd
+ *
+ * See header file for a description of the class.
+ */
+
+#include "afEventLog.h"
+
+using namespace af;
+
+/** Constructor. No file is associated to the event log at first: records are
+ *  silently discarded until open() is called.
+ */
+eventLog::eventLog() : fd(-1), buf_len(0) {
+  buf = new char[AF_EVENTLOG_BUFSIZE];
+}
+
+/** Destructor. Pending records are written before closing the file.
+ */
+eventLog::~eventLog() {
+  close();
+  delete[] buf;
+}
+
+/** Opens the given file for appending records, closing the current one (if
+ *  any) after writing pending records. A NULL or empty file name just closes
+ *  the current file. Returns false if the file can't be opened.
+ */
+bool eventLog::open(const char *_file_name) {
+
+  close();
+
+  if ((!_file_name) || (*_file_name == '\0')) return true;
+
+  fd = ::open(_file_name, O_WRONLY|O_APPEND|O_CREAT, 0644);
+  if (fd < 0) {
+    log::error(log_level_high, "Can't open event log %s: %s", _file_name,
+      strerror(errno));
+    return false;
+  }
+
+  file_name = _file_name;
+  return true;
+}
+
+/** Writes pending records and closes the file.
+ */
+void eventLog::close() {
+  if (fd < 0) return;
+  flush();
+  ::close(fd);
+  fd = -1;
+  file_name.clear();
+}
+
+/** Appends pending records to the file with as few system calls as possible.
+ *  Returns false on write errors: in that case, pending records are lost.
+ */
+bool eventLog::flush() {
+
+  if ((fd < 0) || (buf_len == 0)) return true;
+
+  size_t off = 0;
+  while (off < buf_len) {
+    ssize_t w = write(fd, &buf[off], buf_len-off);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      log::error(log_level_high, "Can't write on event log %s: %s",
+        file_name.c_str(), strerror(errno));
+      buf_len = 0;
+      return false;
+    }
+    off += w;
+  }
+
+  buf_len = 0;
+  return true;
+}
+
+/** Records a state transition of a queue entry. URL is not written in clear,
+ *  but as a hash: size of records is kept small and constant. The reason is
+ *  written only if non-NULL, while the staged and final flags are written
+ *  only if zero (false) or positive (true). Timestamp of the transition is
+ *  taken here, with millisecond precision.
+ */
+void eventLog::transition(const char *event, const char *url,
+  unsigned int uiid, unsigned int attempt, unsigned long long size_bytes,
+  unsigned long n_events, const char *reason, int staged, int final) {
+
+  if (fd < 0) return;
+
+  gettimeofday(&now_tv, 0);
+
+  int len = snprintf(recbuf, AF_EVENTLOG_RECSIZE,
+    "{\"ts\":%ld.%03ld,\"ev\":\"%s\",\"url\":\"%08x\",\"uiid\":%u",
+    (long)now_tv.tv_sec, (long)(now_tv.tv_usec/1000), event,
+    hash(url ? url : ""), uiid);
+
+  if (attempt > 0) {
+    len += snprintf(&recbuf[len], AF_EVENTLOG_RECSIZE-len,
+      ",\"attempt\":%u", attempt);
+  }
+
+  if ((size_bytes > 0) || (n_events > 0)) {
+    len += snprintf(&recbuf[len], AF_EVENTLOG_RECSIZE-len,
+      ",\"size\":%llu,\"events\":%lu", size_bytes, n_events);
+  }
+
+  if (reason) {
+    escape(escbuf, AF_EVENTLOG_RECSIZE/2, reason);
+    len += snprintf(&recbuf[len], AF_EVENTLOG_RECSIZE-len,
+      ",\"reason\":\"%s\"", escbuf);
+  }
+
+  if (staged >= 0) {
+    len += snprintf(&recbuf[len], AF_EVENTLOG_RECSIZE-len,
+      ",\"staged\":%s", (staged ? "true" : "false"));
+  }
+
+  if (final >= 0) {
+    len += snprintf(&recbuf[len], AF_EVENTLOG_RECSIZE-len,
+      ",\"final\":%s", (final ? "true" : "false"));
+  }
+
+  len += snprintf(&recbuf[len], AF_EVENTLOG_RECSIZE-len, "}\n");
+
+  if (len >= AF_EVENTLOG_RECSIZE) {
+    // Truncated: should never happen, given the limit on escaped strings
+    log::warning(log_level_low, "Event log record truncated");
+    return;
+  }
+
+  append(recbuf, len);
+}
+
+/** Appends a record to the memory buffer, flushing it first if there is no
+ *  room left.
+ */
+void eventLog::append(const char *rec, size_t len) {
+  if (buf_len + len > AF_EVENTLOG_BUFSIZE) flush();
+  memcpy(&buf[buf_len], rec, len);
+  buf_len += len;
+}
+
+/** Copies src to dest escaping it as a JSON string. Output is truncated to
+ *  dest_size-1 characters, but never in the middle of an escape sequence.
+ *  Returns the length of the escaped string.
+ */
+size_t eventLog::escape(char *dest, size_t dest_size, const char *src) {
+
+  size_t len = 0;
+
+  for (const char *c=src; *c; c++) {
+
+    char esc[7];
+    size_t esc_len;
+
+    switch (*c) {
+      case '"':  strcpy(esc, "\\\""); break;
+      case '\\': strcpy(esc, "\\\\"); break;
+      case '\n': strcpy(esc, "\\n");  break;
+      case '\t': strcpy(esc, "\\t");  break;
+      default:
+        if ((unsigned char)*c < 0x20)
+          snprintf(esc, 7, "\\u%04x", (unsigned int)*c);
+        else {
+          esc[0] = *c;
+          esc[1] = '\0';
+        }
+      break;
+    }
+
+    esc_len = strlen(esc);
+    if (len + esc_len >= dest_size) break;
+    memcpy(&dest[len], esc, esc_len);
+    len += esc_len;
+
+  }
+
+  dest[len] = '\0';
+  return len;
+}
+
+/** Hashes the given string (32-bit FNV-1a) to identify a URL across records
+ *  without writing it. This function is declared as static.
+ */
+unsigned int eventLog::hash(const char *str) {
+  unsigned int hv = 2166136261U;
+  for (const unsigned char *c=(const unsigned char *)str; *c; c++) {
+    hv ^= *c;
+    hv *= 16777619U;
+  }
+  return hv;
+}
@@ -0,0 +1,69 @@
+/**
+ * afEventLog.h -- by Dario Berzano <dario.berzano@cern.ch>
+ *
+ * This file is part of afdsmgrd -- see http://code.google.com/p/afdsmgrd
+ *
+ * Machine-readable log of the state transitions of the entries of the queue,
+ * written as one compact JSON object per line (JSON Lines). Records are
+ * accumulated in memory and appended to the file in large blocks.
+ */
+
+#ifndef AFEVENTLOG_H
+#define AFEVENTLOG_H
+
+#define AF_EVENTLOG_BUFSIZE 65536
+#define AF_EVENTLOG_RECSIZE 1000
+
+#include <string>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "afLog.h"
+
+namespace af {
+
+  /** The main class of this file.
+   */
+  class eventLog {
+
+    public:
+
+      eventLog();
+      virtual ~eventLog();
+
+      bool open(const char *file_name);
+      void close();
+      inline bool is_open() const { return (fd >= 0); };
+      inline const char *get_file_name() const { return file_name.c_str(); };
+      bool flush();
+
+      void transition(const char *event, const char *url, unsigned int uiid,
+        unsigned int attempt = 0, unsigned long long size_bytes = 0,
+        unsigned long n_events = 0, const char *reason = NULL,
+        int staged = -1, int final = -1);
+
+      static unsigned int hash(const char *str);
+
+    private:
+
+      void append(const char *rec, size_t len);
+      size_t escape(char *dest, size_t dest_size, const char *src);
+
+      int            fd;
+      std::string    file_name;
+      char          *buf;
+      size_t         buf_len;
+      char           recbuf[AF_EVENTLOG_RECSIZE];
+      char           escbuf[AF_EVENTLOG_RECSIZE];
+      struct timeval now_tv;
+
+  };
+
+};
+
+#endif // AFEVENTLOG_H
@@ -17,6 +17,7 @@ std::string extCmd::temp_path;
 const char *extCmd::errf_pref = "err";
 const char *extCmd::outf_pref = "out";
 const char *extCmd::pidf_pref = "pid";
+const char *extCmd::resf_pref = "res";
 
 /** Constructor. The instance_id is chosen automatically if not given or if
  *  equal to zero. An exception is thrown if helper path or temporary path are
@@ -24,8 +25,8 @@ const char *extCmd::pidf_pref = "pid";
  *  not caught.
  */
 extCmd::extCmd(const char *exec_cmd, unsigned int instance_id) :
-  cmd(exec_cmd), id(instance_id), ok(false), already_started(false), pid(-1),
-  timeout_secs(0) {
+  cmd(exec_cmd), id(instance_id), ok(false), timed_out(false),
+  already_started(false), pid(-1), timeout_secs(0) {
 
   if ((helper_path.empty()) || (temp_path.empty()))
     throw std::runtime_error("Helper path and temp path must be defined");
@@ -52,6 +53,9 @@ extCmd::extCmd(const char *exec_cmd, unsigned int instance_id) :
 
   // Grace time between a SIGHUP and a SIGKILL
   set_stop_grace_secs(1);
+
+  memset(&res, 0, sizeof(res));
+  memset(&res_wait_tv, 0, sizeof(res_wait_tv));
 }
 
 /** Destructor. Its sole purpose is to remove leftovers through cleanup().
@@ -74,11 +78,13 @@ int extCmd::run() {
 
   // Assembles the command line
   snprintf(strbuf, AF_EXTCMD_BUFSIZE,
-    "\"%s\" -p \"%s/%s-%u\" -o \"%s/%s-%u\" -e \"%s/%s-%u\" %s",
+    "\"%s\" -p \"%s/%s-%u\" -o \"%s/%s-%u\" -e \"%s/%s-%u\" "
+    "-r \"%s/%s-%u\" %s",
     helper_path.c_str(),
     temp_path.c_str(), pidf_pref, id,
     temp_path.c_str(), outf_pref, id,
     temp_path.c_str(), errf_pref, id,
+    temp_path.c_str(), resf_pref, id,
     cmd.c_str());
 
   // Create temp path each time: it might have been deleted by tmpwatch...
@@ -107,7 +113,9 @@ int extCmd::run() {
 }
 
 /** Checks if the spawned program is still running using the trick of sending
- *  the signal 0 (noop) to the process.
+ *  the signal 0 (noop) to the process. Each command has its own timeout (see
+ *  set_timeout_secs()): commands running for longer are stopped, and
+ *  is_timed_out() tells so.
  */
 bool extCmd::is_running() {
 
@@ -128,8 +136,9 @@ bool extCmd::is_running() {
 
       if ((long)running_time > timeout_secs) {
         if (stop()) {
+          timed_out = true;
           log::warning(log_level_debug, "Stopped due to timeout: "
-            "pid=%d (id=%d)", pid, id);
+            "pid=%d (id=%d, timeout=%lu s)", pid, id, timeout_secs);
           return false; // stopped with success
         }
         else {
@@ -164,6 +173,9 @@ bool extCmd::cleanup() {
   snprintf(strbuf, AF_EXTCMD_BUFSIZE, fmt, temp_path.c_str(), errf_pref, id);
   if ((unlink(strbuf) != 0) && (errno != ENOENT)) nerr++;
 
+  snprintf(strbuf, AF_EXTCMD_BUFSIZE, fmt, temp_path.c_str(), resf_pref, id);
+  if ((unlink(strbuf) != 0) && (errno != ENOENT)) nerr++;
+
   if (nerr) return false;
   return true;
 }
@@ -228,31 +240,10 @@ void extCmd::get_output() {
 
     if (( strcmp(tok, "OK") == 0 ) || ( strcmp(tok, "FAIL") == 0 )) {
 
-      bool expect_key = false;
-      std::string key;
-      std::string val;
-
       if (*tok == 'O') ok = true;
       else ok = false;
 
-      while ((tok = strtok(NULL, delims))) {
-        //printf("  tok={%s}\n", tok);
-        if (expect_key) {
-          size_t len = strlen(tok);
-          if (tok[len-1] == ':') {
-            tok[len-1] = '\0';
-            key = tok;
-            expect_key = false;
-          }
-        }
-        else {
-          val = tok;
-          //printf("    pair={%s},{%s}\n", key.c_str(), val.c_str());
-          // See http://www.cplusplus.com/reference/stl/map/insert/
-          fields_map.insert( key_val_t(key, val) );
-          expect_key = true;
-        }
-      }
+      parse_fields(fields_map);
 
       found = true;
       break;
@@ -266,6 +257,212 @@ void extCmd::get_output() {
 
 }
 
+/** Same as get_output(), for programs working on many URLs at once: every line
+ *  beginning with FAIL or OK is parsed, and kept by the URL that follows. The
+ *  status and fields of each URL are selected with select_output().
+ */
+void extCmd::get_outputs() {
+
+  const char *delims = " \t";
+
+  outputs_map.clear();
+  fields_map.clear();
+  ok = false;
+
+  snprintf(strbuf, AF_EXTCMD_BUFSIZE, "%s/%s-%u",
+    temp_path.c_str(), outf_pref, id);
+
+  std::ifstream outfile(strbuf);
+
+  while ( outfile.getline(strbuf, AF_EXTCMD_BUFSIZE) ) {
+    char *tok = strtok(strbuf, delims);
+    if (!tok) continue;
+
+    if (( strcmp(tok, "OK") == 0 ) || ( strcmp(tok, "FAIL") == 0 )) {
+
+      ext_output_t out;
+      out.ok = (*tok == 'O');
+      parse_fields(out.fields);
+
+      // The URL is the first value, without a key: see parse_fields()
+      fields_iter_t url = out.fields.find("");
+      if (url != out.fields.end()) outputs_map[url->second] = out;
+
+    }
+  }
+
+  outfile.close();
+
+}
+
+/** Makes the status and the fields of the given URL, as read by get_outputs(),
+ *  available through is_ok() and get_field_*(). URLs reported without their
+ *  anchor are found as well. Returns false, and a FAIL status, if the program
+ *  did not report on the given URL.
+ */
+bool extCmd::select_output(const char *url) {
+
+  fields_map.clear();
+  ok = false;
+
+  if (!url) return false;
+
+  outputs_t::const_iterator it = outputs_map.find(url);
+
+  if (it == outputs_map.end()) {
+    const char *anchor = strchr(url, '#');
+    if (!anchor) return false;
+    it = outputs_map.find( std::string(url, anchor-url) );
+    if (it == outputs_map.end()) return false;
+  }
+
+  ok = it->second.ok;
+  fields_map = it->second.fields;
+  return true;
+}
+
+/** Parses the fields of the line being tokenized with strtok() (i.e., after
+ *  the first token), in the form "key1: value1 key2: value2...", and puts them
+ *  in the given map.
+ */
+void extCmd::parse_fields(fields_t &fmap) {
+
+  const char *delims = " \t";
+  bool expect_key = false;
+  std::string key;
+  std::string val;
+  char *tok;
+
+  while ((tok = strtok(NULL, delims))) {
+    //printf("  tok={%s}\n", tok);
+    if (expect_key) {
+      size_t len = strlen(tok);
+      if (tok[len-1] == ':') {
+        tok[len-1] = '\0';
+        key = tok;
+        expect_key = false;
+      }
+    }
+    else {
+      val = tok;
+      //printf("    pair={%s},{%s}\n", key.c_str(), val.c_str());
+      // See http://www.cplusplus.com/reference/stl/map/insert/
+      fmap.insert( key_val_t(key, val) );
+      expect_key = true;
+    }
+  }
+
+}
+
+/** Tells whether the resources used by the terminated program can be read.
+ *  The helper writes them right after the end of the program: if they are not
+ *  there yet, false is returned and the caller should ask again later (e.g. on
+ *  the next loop). Gives up (returning true) AF_EXTCMD_RES_WAIT_MSEC after the
+ *  first call, since some helpers never write them. It never waits.
+ */
+bool extCmd::resources_ready() {
+
+  if ((res.valid) || (!already_started)) return true;
+
+  snprintf(strbuf, AF_EXTCMD_BUFSIZE, "%s/%s-%u",
+    temp_path.c_str(), resf_pref, id);
+  if (stat(strbuf, &buf_stat) == 0) return true;
+
+  gettimeofday(&now_tv, NULL);
+  if (res_wait_tv.tv_sec == 0) {
+    res_wait_tv = now_tv;
+    return false;
+  }
+
+  long waited_msec = (now_tv.tv_sec - res_wait_tv.tv_sec) * 1000L +
+    (now_tv.tv_usec - res_wait_tv.tv_usec) / 1000L;
+  return (waited_msec >= AF_EXTCMD_RES_WAIT_MSEC);
+}
+
+/** Returns the resources used by the program, as written by the helper when
+ *  the program terminated. It does not wait for them: see resources_ready().
+ *  If they are not available, the valid member of the returned struct is
+ *  false. Resources are read only once.
+ */
+const ext_res_t &extCmd::get_resources() {
+
+  if ((res.valid) || (!already_started)) return res;
+
+  snprintf(strbuf, AF_EXTCMD_BUFSIZE, "%s/%s-%u",
+    temp_path.c_str(), resf_pref, id);
+
+  std::ifstream resfile(strbuf);
+  if (!resfile) return res;
+
+  fields_t res_map;
+  if (resfile.getline(strbuf, AF_EXTCMD_BUFSIZE)) {
+    char *tok = strtok(strbuf, " \t");
+    if ((tok) && (strcmp(tok, "RES") == 0)) {
+      parse_fields(res_map);
+      res.valid = true;
+    }
+  }
+  resfile.close();
+
+  fields_iter_t it;
+  #define AF_EXTCMD_RES_FIELD(KEY, DEST, CONV) \
+    if ((it = res_map.find(KEY)) != res_map.end()) \
+      DEST = CONV(it->second.c_str(), NULL, 0)
+
+  AF_EXTCMD_RES_FIELD("ExitCode", res.exit_code, strtol);
+  AF_EXTCMD_RES_FIELD("MaxRssKiB", res.max_rss_kib, strtoul);
+  AF_EXTCMD_RES_FIELD("ReadChars", res.read_chars, strtoull);
+  AF_EXTCMD_RES_FIELD("WriteChars", res.write_chars, strtoull);
+  AF_EXTCMD_RES_FIELD("ReadBytes", res.read_bytes, strtoull);
+
+  #undef AF_EXTCMD_RES_FIELD
+
+  if ((it = res_map.find("CpuUserSec")) != res_map.end())
+    res.cpu_user_sec = strtod(it->second.c_str(), NULL);
+  if ((it = res_map.find("CpuSysSec")) != res_map.end())
+    res.cpu_sys_sec = strtod(it->second.c_str(), NULL);
+
+  return res;
+}
+
+/** Adds the resources used by the program to the given sum, if available, and
+ *  returns them. See get_resources().
+ */
+const ext_res_t &extCmd::add_resources(ext_res_sum_t &sum) {
+  const ext_res_t &r = get_resources();
+  if (r.valid) {
+    sum.n_cmds++;
+    sum.cpu_sec += r.cpu_user_sec + r.cpu_sys_sec;
+    if (r.max_rss_kib > sum.max_rss_kib) sum.max_rss_kib = r.max_rss_kib;
+    sum.read_chars += r.read_chars;
+  }
+  return r;
+}
+
+/** Reads from /proc/<pid>/io the number of bytes read so far by the running
+ *  program (and by the descendants it has already waited for). Returns false
+ *  if they can't be read, e.g. because the program is not running.
+ */
+bool extCmd::get_live_read_chars(unsigned long long &read_chars) {
+
+  if (pid <= 0) return false;
+
+  snprintf(strbuf, AF_EXTCMD_BUFSIZE, "/proc/%d/io", (int)pid);
+  FILE *fp = fopen(strbuf, "r");
+  if (!fp) return false;
+
+  bool found = false;
+  while (fgets(strbuf, AF_EXTCMD_BUFSIZE, fp)) {
+    if (sscanf(strbuf, "rchar: %llu", &read_chars) == 1) {
+      found = true;
+      break;
+    }
+  }
+
+  fclose(fp);
+  return found;
+}
+
 /** Gets a field from output formatted as an unsigned integer. 0 is returned if
  *  field does not exist or it is not a number. The base is guessed from the
  *  number prefix (i.e., 0 means octal and 0x means hex): for more information
@@ -277,6 +474,15 @@ unsigned long extCmd::get_field_uint(const char *key) {
   return strtoul(strval, NULL, 0);
 }
 
+/** Gets a field from output formatted as a 64-bit unsigned integer, e.g. a size
+ *  in bytes: see get_field_uint().
+ */
+unsigned long long extCmd::get_field_ull(const char *key) {
+  const char *strval = get_field_text(key);
+  if (!strval) return 0LL;
+  return strtoull(strval, NULL, 0);
+}
+
 /** Gets a field from output formatted as a signed integer. 0 is returned if
  *  field does not exist or it is not a number. The base is guessed from the
  *  number prefix (i.e., 0 means octal and 0x means hex): for more information
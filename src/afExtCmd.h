@@ -5,10 +5,12 @@
  *
  * An instance of this class represents and manages an external program that
  * independently runs in background and returns its status on stdout on a single
- * line with separated fields.
+ * line with separated fields. Programs working on many URLs at once return one
+ * such line per URL.
  *
  * The class is capable of checking if the program is still running and parses
- * the output, made of fields and values, in memory.
+ * the output, made of fields and values, in memory. The resources used by the
+ * program (CPU, memory, I/O) are collected by the helper when it terminates.
  */
 
 #ifndef AFEXTCMD_H
@@ -16,6 +18,7 @@
 
 #define AF_EXTCMD_BUFSIZE 1000
 #define AF_EXTCMD_USLEEP 20000
+#define AF_EXTCMD_RES_WAIT_MSEC 1000
 
 #include "afLog.h"
 
@@ -39,6 +42,37 @@ namespace af {
   typedef std::pair<std::string,std::string> key_val_t;
   typedef fields_t::const_iterator fields_iter_t;
 
+  /** Status and fields of a single line of output.
+   */
+  typedef struct {
+    bool     ok;
+    fields_t fields;
+  } ext_output_t;
+
+  typedef std::map<std::string,ext_output_t> outputs_t;  // by URL
+
+  /** Resources used by the external program and by its descendants.
+   */
+  typedef struct {
+    bool               valid;
+    int                exit_code;
+    double             cpu_user_sec;
+    double             cpu_sys_sec;
+    unsigned long      max_rss_kib;
+    unsigned long long read_chars;   // read through syscalls (also network)
+    unsigned long long write_chars;  // written through syscalls
+    unsigned long long read_bytes;   // read from storage
+  } ext_res_t;
+
+  /** Resources used by a set of external programs.
+   */
+  typedef struct {
+    unsigned int       n_cmds;
+    double             cpu_sec;      // user plus system
+    unsigned long      max_rss_kib;  // maximum amongst programs
+    unsigned long long read_chars;
+  } ext_res_sum_t;
+
   class extCmd {
 
     public:
@@ -49,12 +83,20 @@ namespace af {
       bool is_running();
       pid_t get_pid() { return pid; };
       void get_output();
+      void get_outputs();
+      bool select_output(const char *url);
       void print_fields(bool log = false);
       bool is_ok() { return ok; };
+      bool is_timed_out() { return timed_out; };
       unsigned int get_id() { return id; };
       bool stop();
+      bool resources_ready();
+      const ext_res_t &get_resources();
+      const ext_res_t &add_resources(ext_res_sum_t &sum);
+      bool get_live_read_chars(unsigned long long &read_chars);
 
       unsigned long get_field_uint(const char *key);
+      unsigned long long get_field_ull(const char *key);
       long get_field_int(const char *key);
       double get_field_real(const char *key);
       const char *get_field_text(const char *key);
@@ -75,17 +117,22 @@ namespace af {
     private:
 
       bool cleanup();
+      void parse_fields(fields_t &fmap);
 
       char strbuf[AF_EXTCMD_BUFSIZE];
       pid_t pid;
       unsigned int id;
       std::string cmd;
       fields_t fields_map;
+      outputs_t outputs_map;
+      ext_res_t res;
       bool ok;
+      bool timed_out;
       bool already_started;
 
       struct timeval start_tv;
       struct timeval now_tv;
+      struct timeval res_wait_tv;  // first time resources were not ready
       struct stat    buf_stat;
 
       unsigned long timeout_secs;
@@ -97,6 +144,7 @@ namespace af {
       static const char *errf_pref;
       static const char *outf_pref;
       static const char *pidf_pref;
+      static const char *resf_pref;
 
       static bool make_temp_path();
 
@@ -0,0 +1,161 @@
+/**
+ * afFairShare.cc -- by Dario Berzano <dario.berzano@cern.ch>
+ *
+ * This file is part of afdsmgrd -- see http://code.google.com/p/afdsmgrd
+ *
+ * See header file for a description of the class.
+ */
+
+#include "afFairShare.h"
+
+using namespace af;
+
+/** Constructor: all shares have the same weight.
+ */
+fairShare::fairShare() : default_weight(1), vtime(0.) {}
+
+/** Sets the weights of the shares from a space-separated list of items in the
+ *  form prefix=weight, where prefix is matched against the beginning of the
+ *  share name ("/group" matches "/group/user", the longest prefix wins) and
+ *  can be "*" for all other shares. Malformed items are skipped and false is
+ *  returned.
+ */
+bool fairShare::set_weights(const char *spec) {
+
+  bool ok = true;
+
+  weights.clear();
+  default_weight = 1;
+
+  std::istringstream iss(spec ? spec : "");
+  std::string item;
+
+  while (iss >> item) {
+
+    size_t eq = item.find('=');
+    const char *val = item.c_str() + eq + 1;
+    char *endp = NULL;
+    unsigned long w = 0;
+
+    if ((eq != std::string::npos) && (eq != 0)) w = strtoul(val, &endp, 10);
+
+    if ((w == 0) || (endp == val) || (*endp != '\0')) {
+      log::error(log_level_high, "Invalid share weight: %s", item.c_str());
+      ok = false;
+      continue;
+    }
+
+    std::string prefix = item.substr(0, eq);
+    if (prefix == "*") default_weight = w;
+    else weights[prefix] = w;
+  }
+
+  return ok;
+}
+
+/** Returns the weight of the given share: the one of the longest configured
+ *  prefix matching it at a path boundary, or the default one.
+ */
+unsigned int fairShare::get_weight(const std::string &share) const {
+
+  std::string prefix = share;
+
+  while (!prefix.empty()) {
+    share_weight_map_t::const_iterator it = weights.find(prefix);
+    if (it != weights.end()) return it->second;
+    size_t slash = prefix.rfind('/');
+    if ((slash == std::string::npos) || (slash == 0)) break;
+    prefix.erase(slash);
+  }
+
+  return default_weight;
+}
+
+/** Returns the scheduling state of the given share: new shares start from the
+ *  current virtual time.
+ */
+share_state_t &fairShare::get_state(const std::string &share) {
+
+  share_state_map_t::iterator it = states.find(share);
+  if (it != states.end()) return it->second;
+
+  share_state_t &st = states[share];
+  st.pass = vtime;
+  st.n_started = 0;
+  return st;
+}
+
+/** Chooses the share that goes next amongst the given ones, each one with the
+ *  priority of its first waiting entry: the highest priority wins, then the
+ *  lowest pass. Returns the index of the chosen share, or -1 if the list is
+ *  empty. Shares are not charged: see charge().
+ */
+int fairShare::pick(const std::vector<std::string> &shares,
+  const std::vector<int> &priorities) {
+
+  int best = -1;
+  double best_pass = 0.;
+
+  for (size_t i=0; i<shares.size(); i++) {
+
+    double pass = get_state(shares[i]).pass;
+
+    if ((best < 0) || (priorities[i] > priorities[best]) ||
+      ((priorities[i] == priorities[best]) && (pass < best_pass))) {
+      best = (int)i;
+      best_pass = pass;
+    }
+
+  }
+
+  return best;
+}
+
+/** Accounts for a transfer started for the given share.
+ */
+void fairShare::charge(const std::string &share) {
+
+  share_state_t &st = get_state(share);
+
+  // Shares left behind are not allowed to catch up with a burst
+  if (st.pass < vtime) st.pass = vtime;
+  else vtime = st.pass;
+
+  st.pass += 1. / get_weight(share);
+  st.n_started++;
+}
+
+/** Writes one line on the log for every share seen so far.
+ */
+void fairShare::log_dump(log_level_t level) const {
+
+  if (!log::enabled(level)) return;
+
+  if (states.empty()) {
+    log::info(level, "No transfers started for any share so far");
+    return;
+  }
+
+  for (share_state_map_t::const_iterator it=states.begin();
+    it!=states.end(); it++) {
+    log::info(level, "Share %s: weight %u, %lu transfers started, "
+      "pass %.2lf (virtual time %.2lf)",
+      it->first.empty() ? "(none)" : it->first.c_str(),
+      get_weight(it->first), it->second.n_started, it->second.pass, vtime);
+  }
+
+}
+
+/** Returns the share of the given dataset: its "/group/user" part, or an empty
+ *  string if the name is not in the form "/group/user/dataset".
+ */
+std::string fairShare::get_share(const char *ds_name) {
+
+  if ((!ds_name) || (*ds_name != '/')) return "";
+
+  const char *slash = strchr(ds_name+1, '/');
+  if (slash) slash = strchr(slash+1, '/');
+  if (!slash) return "";
+
+  return std::string(ds_name, slash-ds_name);
+}
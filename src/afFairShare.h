@@ -0,0 +1,71 @@
+/**
+ * afFairShare.h -- by Dario Berzano <dario.berzano@cern.ch>
+ *
+ * This file is part of afdsmgrd -- see http://code.google.com/p/afdsmgrd
+ *
+ * Weighted fair share of the staging slots amongst groups of datasets, by
+ * default the "/group/user" part of the dataset name. Shares are scheduled by
+ * stride scheduling: each one has a "pass" advanced by the inverse of its
+ * weight for every transfer started, and the share with the lowest pass goes
+ * next. Shares appearing later start from the current virtual time, so they
+ * can not claim the slots they did not use. Priority overrides the shares.
+ */
+
+#ifndef AFFAIRSHARE_H
+#define AFFAIRSHARE_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <sstream>
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "afLog.h"
+
+namespace af {
+
+  /** Scheduling state of a single share.
+   */
+  typedef struct {
+    double        pass;
+    unsigned long n_started;
+  } share_state_t;
+
+  typedef std::map<std::string, share_state_t> share_state_map_t;
+  typedef std::map<std::string, unsigned int> share_weight_map_t;
+
+  /** The main class of this file.
+   */
+  class fairShare {
+
+    public:
+
+      fairShare();
+
+      bool set_weights(const char *spec);
+      unsigned int get_weight(const std::string &share) const;
+
+      int pick(const std::vector<std::string> &shares,
+        const std::vector<int> &priorities);
+      void charge(const std::string &share);
+
+      void log_dump(log_level_t level) const;
+
+      static std::string get_share(const char *ds_name);
+
+    private:
+
+      share_state_t &get_state(const std::string &share);
+
+      share_state_map_t  states;
+      share_weight_map_t weights;
+      unsigned int       default_weight;
+      double             vtime;  // pass of the last share picked
+
+  };
+
+};
+
+#endif // AFFAIRSHARE_H
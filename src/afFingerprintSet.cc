@@ -0,0 +1,98 @@
+/**
+ * afFingerprintSet.cc -- by Dario Berzano <dario.berzano@cern.ch>
+ *
+ * This file is part of afdsmgrd -- see http://code.google.com/p/afdsmgrd
+ *
+ * See header file for a description of the class.
+ */
+
+#include "afFingerprintSet.h"
+
+using namespace af;
+
+/** Constructor: the set is empty.
+ */
+fingerprintSet::fingerprintSet() : slots(NULL), bits(0), n_used(0) {
+  alloc(AF_FINGERPRINTSET_MIN_BITS);
+}
+
+/** Destructor.
+ */
+fingerprintSet::~fingerprintSet() {
+  delete[] slots;
+}
+
+/** Allocates an empty table of 2^_bits slots, freeing the current one.
+ */
+void fingerprintSet::alloc(unsigned int _bits) {
+  delete[] slots;
+  bits = _bits;
+  slots = new unsigned long long[1UL << bits];
+  memset(slots, 0, sizeof(unsigned long long) << bits);
+  n_used = 0;
+}
+
+/** Empties the set, shrinking the table to its initial size.
+ */
+void fingerprintSet::clear() {
+  alloc(AF_FINGERPRINTSET_MIN_BITS);
+}
+
+/** Adds the given string to the set. Returns true if it was not in the set
+ *  already, false if it was (or if it is NULL).
+ */
+bool fingerprintSet::insert(const char *str) {
+
+  if (!str) return false;
+
+  // The table is doubled when half full, to keep probe sequences short
+  if ((n_used + 1) << 1 > (1UL << bits)) {
+
+    unsigned long long *old_slots = slots;
+    unsigned long old_n_slots = 1UL << bits;
+
+    slots = NULL;
+    alloc(bits + 1);
+
+    for (unsigned long i=0; i<old_n_slots; i++)
+      if (old_slots[i] != 0) insert_fp(old_slots[i]);
+
+    delete[] old_slots;
+  }
+
+  return insert_fp( fingerprint(str) );
+}
+
+/** Adds the given fingerprint to the table, by linear probing from the slot
+ *  given by its top bits (after multiplicative hashing). Returns true if it
+ *  was not in the table already.
+ */
+bool fingerprintSet::insert_fp(unsigned long long fp) {
+
+  unsigned long mask = (1UL << bits) - 1;
+  unsigned long i = (unsigned long)((fp * 0x9e3779b97f4a7c15ULL) >> (64-bits));
+
+  while (slots[i] != 0) {
+    if (slots[i] == fp) return false;
+    i = (i + 1) & mask;
+  }
+
+  slots[i] = fp;
+  n_used++;
+  return true;
+}
+
+/** Returns the 64-bit FNV-1a hash of the given string, which is never zero.
+ *  This function is declared as static.
+ */
+unsigned long long fingerprintSet::fingerprint(const char *str) {
+
+  unsigned long long fp = 0xcbf29ce484222325ULL;
+
+  for (const unsigned char *p=(const unsigned char *)str; *p!='\0'; p++) {
+    fp ^= *p;
+    fp *= 0x100000001b3ULL;
+  }
+
+  return (fp != 0) ? fp : 1;
+}
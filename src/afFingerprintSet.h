@@ -0,0 +1,50 @@
+/**
+ * afFingerprintSet.h -- by Dario Berzano <dario.berzano@cern.ch>
+ *
+ * This file is part of afdsmgrd -- see http://code.google.com/p/afdsmgrd
+ *
+ * Set of strings (e.g. URLs) stored as 64-bit fingerprints in an open
+ * addressing hash table: only eight bytes are used per string, and insertion
+ * takes constant time on average. Different strings with the same fingerprint
+ * are considered equal: with FNV-1a this is very unlikely below billions of
+ * strings.
+ */
+
+#ifndef AFFINGERPRINTSET_H
+#define AFFINGERPRINTSET_H
+
+#define AF_FINGERPRINTSET_MIN_BITS 10
+
+#include <string.h>
+
+namespace af {
+
+  /** The main class of this file.
+   */
+  class fingerprintSet {
+
+    public:
+
+      fingerprintSet();
+      virtual ~fingerprintSet();
+
+      bool insert(const char *str);
+      void clear();
+      inline unsigned long get_size() const { return n_used; };
+
+      static unsigned long long fingerprint(const char *str);
+
+    private:
+
+      void alloc(unsigned int _bits);
+      bool insert_fp(unsigned long long fp);
+
+      unsigned long long *slots;  // zero means empty
+      unsigned int        bits;   // the table has 2^bits slots
+      unsigned long       n_used;
+
+  };
+
+};
+
+#endif // AFFINGERPRINTSET_H
@@ -14,6 +14,11 @@ using namespace af;
  */
 log *log::stdlog = NULL;
 
+/** Minimum level of the default log facility, cached for a quick check. When
+ *  there is no default facility, nothing is enabled.
+ */
+int log::std_level = log_level_urgent + 1;
+
 /** Constructor. It takes an ostream (NOT ofstream!) as the only argument. Log
  *  rotation is obviously not supported by a generic ostream, only by files. The
  *  given banner, if non-empty, is printed on initialization.
@@ -21,8 +26,16 @@ log *log::stdlog = NULL;
 log::log(std::ostream &out_stream, log_level_t min_level,
   std::string &banner_msg) :
   out(&out_stream), out_file(NULL), min_log_level(min_level), rotated_time(0),
-  secs_rotate(0.), banner(banner_msg) {
-  if (!stdlog) stdlog = this;
+  secs_rotate(0.), bytes_rotate(0), bytes_written(0), banner(banner_msg),
+  ring(NULL), writer_ring(NULL), ring_mask(0), ring_head(0), ring_tail(0),
+  overflow(log_overflow_drop), n_pushing(0), n_dropped(0),
+  n_dropped_reported(0), n_lost(0), n_lost_reported(0), writer_quit(false) {
+  pthread_mutex_init(&write_mutex, NULL);
+  pthread_mutex_init(&async_mutex, NULL);
+  if (!stdlog) {
+    stdlog = this;
+    std_level = min_log_level;
+  }
   say_banner();
 }
 
@@ -31,33 +44,110 @@ log::log(std::ostream &out_stream, log_level_t min_level,
  *  full or no permissions on output file or whatever). A banner (if non-empty)
  *  is printed on initialization.
  *
- *  By default, the log file is rotated every 12 hours.
+ *  By default, the log file is rotated every 12 hours, and never because of its
+ *  size (see set_rotate_bytes()).
  *
  *  See http://www.cplusplus.com/reference/iostream/ios/exceptions/
  */
 log::log(const char *log_file, log_level_t min_level, std::string &banner_msg) :
   file_name(log_file), min_log_level(min_level), rotated_time(time(NULL)),
-  secs_rotate(43200.), banner(banner_msg) {
+  secs_rotate(43200.), bytes_rotate(0), bytes_written(0), banner(banner_msg),
+  ring(NULL), writer_ring(NULL), ring_mask(0), ring_head(0), ring_tail(0),
+  overflow(log_overflow_drop), n_pushing(0), n_dropped(0),
+  n_dropped_reported(0), n_lost(0), n_lost_reported(0), writer_quit(false) {
 
   out_file = new std::ofstream();
   out_file->exceptions(std::ios::failbit);
   out_file->open(log_file, std::ios::app);
   out = out_file;
 
-  if (!stdlog) stdlog = this;
+  // Size-based rotation takes into account what is already in the file
+  struct stat log_stat;
+  if (stat(log_file, &log_stat) == 0) bytes_written = log_stat.st_size;
+
+  pthread_mutex_init(&write_mutex, NULL);
+  pthread_mutex_init(&async_mutex, NULL);
+
+  if (!stdlog) {
+    stdlog = this;
+    std_level = min_log_level;
+  }
 
   say_banner();
 }
 
 /** Destructor. Sets to NULL the default facility if it equals to the current
- *  one.
+ *  one. Pending asynchronous messages are written before closing.
  */
 log::~log() {
+  set_async(0);
   if (out_file) {
     out_file->close();
     delete out_file;
   }
-  if (this == stdlog) stdlog = NULL;
+  if (this == stdlog) {
+    stdlog = NULL;
+    std_level = log_level_urgent + 1;
+  }
+  pthread_mutex_destroy(&async_mutex);
+  pthread_mutex_destroy(&write_mutex);
+}
+
+/** Sets the minimum level of messages to say. Messages below it are discarded
+ *  before being formatted.
+ */
+void log::set_level(log_level_t min_level) {
+  min_log_level = min_level;
+  if (this == stdlog) std_level = min_level;
+}
+
+/** Sets the seconds after which the log file is rotated. Safe to call while
+ *  the writer thread is running.
+ */
+void log::set_rotate_secs(double secs) {
+  pthread_mutex_lock(&write_mutex);
+  secs_rotate = secs;
+  pthread_mutex_unlock(&write_mutex);
+}
+
+/** Sets the size in bytes beyond which the log file is rotated (zero means no
+ *  limit). Safe to call while the writer thread is running.
+ */
+void log::set_rotate_bytes(unsigned long bytes) {
+  pthread_mutex_lock(&write_mutex);
+  bytes_rotate = bytes;
+  pthread_mutex_unlock(&write_mutex);
+}
+
+/** Tells whether a message from a rate-limited call site can be said. At most
+ *  max_per_sec messages are allowed per second: when a new second begins, the
+ *  number of messages suppressed during the previous one (if any) is reported
+ *  with the given level. The format string identifies the call site in the
+ *  summary. This function is declared as static.
+ */
+bool log::rate_ok(log_ratelimit_t &rl, unsigned int max_per_sec,
+  log_level_t level, const char *fmt) {
+
+  time_t now = time(NULL);
+
+  if (now != rl.window) {
+    if (rl.suppressed) {
+      unsigned long suppressed = rl.suppressed;
+      rl.suppressed = 0;
+      warning(level, "%lu similar message(s) suppressed: \"%s\"", suppressed,
+        fmt);
+    }
+    rl.window = now;
+    rl.count = 0;
+  }
+
+  if (rl.count < max_per_sec) {
+    rl.count++;
+    return true;
+  }
+
+  rl.suppressed++;
+  return false;
 }
 
 /** Prints out the banner, if non-empty. Varargs are for compatibility and are
@@ -86,74 +176,218 @@ void log::say(log_type_t type, log_level_t level, const char *fmt, ...) {
 /** Rotates the logfile and returns a value of type rotate_err_t. Keep in mind
  *  that if file open fails an exception is thrown and must be caught, elsewhere
  *  the program aborts. See the constructor (for files, not generic ostreams)
- *  for more information.
+ *  for more information. The rotated file is compressed in background: this
+ *  function does not wait for compression to finish.
  */
 rotate_err_t log::rotate() {
 
-  struct tm *rotated_tm = localtime(&rotated_time);
+  struct tm rotated_tm;
+  localtime_r(&rotated_time, &rotated_tm);
 
   // Formatted date/time
-  static char datetime_fmt[20];
-  strftime(datetime_fmt, 19, "%Y%m%d-%H%M%S", rotated_tm);
+  char datetime_fmt[20];
+  strftime(datetime_fmt, 20, "%Y%m%d-%H%M%S", &rotated_tm);
 
-  // Compose archive log file name (the uncompressed one) on strbuf
+  // Compose archive log file name (the uncompressed one) on strbuf. With
+  // size-based rotation more than one rotation per second is possible: avoid
+  // overwriting archives (or files still being compressed) by adding a suffix
+  struct stat arch_stat;
   snprintf(strbuf, AF_LOG_BUFSIZE, "%s-%s", file_name.c_str(), datetime_fmt);
+  for (unsigned int i=1; i<1000; i++) {
+    std::string arch_bz2 = strbuf;
+    arch_bz2 += ".bz2";
+    if ((stat(strbuf, &arch_stat) != 0) &&
+      (stat(arch_bz2.c_str(), &arch_stat) != 0)) break;
+    snprintf(strbuf, AF_LOG_BUFSIZE, "%s-%s.%u", file_name.c_str(),
+      datetime_fmt, i);
+  }
 
   out_file->close();
 
   rotate_err_t ret = rotate_err_ok;
 
   if (rename(file_name.c_str(), strbuf)) ret = rotate_err_rename;
-  else {
+  else if (!compress_detached(strbuf)) ret = rotate_err_compress;
+
+  out_file->open(file_name.c_str(), std::ios::app);  // might throw an exception
+  bytes_written = 0;
+
+  return ret;
+}
 
-    // Compose compress command
-    snprintf(strbuf, AF_LOG_BUFSIZE, "bzip2 -9 \"%s-%s\" > /dev/null 2>&1",
-      file_name.c_str(), datetime_fmt);
+/** Looks for the given executable in the PATH (or in the default one if unset)
+ *  and puts its full path in path. Names containing a slash are not looked
+ *  for. Returns false if no executable is found. This function is declared as
+ *  static.
+ */
+bool log::find_exec(const char *name, std::string &path) {
 
-    if (system(strbuf)) ret = rotate_err_compress;
+  if (strchr(name, '/')) {
+    path = name;
+    return (access(name, X_OK) == 0);
   }
 
-  out_file->open(file_name.c_str(), std::ios::app);  // might throw an exception
+  const char *env_path = getenv("PATH");
+  std::string dirs = ((env_path) && (*env_path)) ? env_path : "/usr/bin:/bin";
+  size_t beg = 0;
+
+  while (beg <= dirs.length()) {
+    size_t end = dirs.find(':', beg);
+    if (end == std::string::npos) end = dirs.length();
+    path = (end > beg) ? dirs.substr(beg, end-beg) : ".";
+    path += '/';
+    path += name;
+    if (access(path.c_str(), X_OK) == 0) return true;
+    beg = end + 1;
+  }
 
-  return ret;
+  path.clear();
+  return false;
+}
+
+/** Compresses the given file with bzip2 in a detached, low priority process,
+ *  and returns immediately. The compressor is a grandchild of the current
+ *  process: its parent exits right away and it is reaped by init, so that no
+ *  zombie is left behind and no SIGCHLD handling is needed. This function may
+ *  run in the log writer thread: the executable is looked for before forking,
+ *  and only functions safe to be called between fork() and exec() are used in
+ *  children. The compressor reports through a pipe, closed on exec, whether it
+ *  could be started. Returns false if the compressor could not be started.
+ *  This function is declared as static.
+ */
+bool log::compress_detached(const char *file_name) {
+
+  std::string bzip2_path;
+  if (!find_exec("bzip2", bzip2_path)) return false;
+
+  char *const argv[] = { (char *)"bzip2", (char *)"-9", (char *)file_name,
+    NULL };
+
+  int exec_pipe[2];
+  if (pipe2(exec_pipe, O_CLOEXEC) != 0) return false;
+
+  pid_t pid = fork();
+
+  if (pid < 0) {
+    close(exec_pipe[0]);
+    close(exec_pipe[1]);
+    return false;
+  }
+
+  if (pid == 0) {
+
+    // Intermediate child: spawns the compressor and exits as soon as it knows
+    // whether it started (nothing is read from the pipe in such a case)
+    pid_t cpid = fork();
+
+    if (cpid == 0) {
+      close(exec_pipe[0]);
+      int err = 0;
+      int devnull = open("/dev/null", O_RDWR);
+      if ((devnull < 0) || (dup2(devnull, STDIN_FILENO) < 0) ||
+        (dup2(devnull, STDOUT_FILENO) < 0) ||
+        (dup2(devnull, STDERR_FILENO) < 0)) err = errno;
+      if ((!err) && (setsid() < 0)) err = errno;
+      errno = 0;
+      if ((!err) && (nice(19) == -1) && (errno != 0)) err = errno;
+      if (!err) {
+        execv(bzip2_path.c_str(), argv);
+        err = errno;
+      }
+      while ((write(exec_pipe[1], &err, sizeof(err)) < 0) && (errno == EINTR));
+      _exit(127);
+    }
+
+    close(exec_pipe[1]);
+    if (cpid < 0) _exit(1);
+
+    int err;
+    ssize_t r;
+    while (((r = read(exec_pipe[0], &err, sizeof(err))) < 0) &&
+      (errno == EINTR));
+    _exit((r == 0) ? 0 : 1);
+
+  }
+
+  // Parent: reap the intermediate child, which is very short-lived
+  close(exec_pipe[0]);
+  close(exec_pipe[1]);
+
+  int status;
+  pid_t r;
+  while (((r = waitpid(pid, &status, 0)) < 0) && (errno == EINTR));
+
+  return ((r == pid) && (WIFEXITED(status)) && (WEXITSTATUS(status) == 0));
 }
 
 /** Private function that checks if the current stream is rotateable and should
  *  be rotated, rotates it in such a case, then says the message to the logfile
- *  with the appropriate level and type.
+ *  with the appropriate level and type. In asynchronous mode the message is
+ *  only formatted and pushed to the ring buffer: rotation is checked by the
+ *  writer thread. In synchronous mode the write mutex is held, so that many
+ *  threads can log at the same time.
  */
 void log::rotate_say(log_type_t type, log_level_t level, const char *fmt,
   va_list vargs) {
 
-  if (out_file) {
+  if (level < min_log_level) return;
 
-    time_t cur_time = time(NULL);
+  // Producers are counted before looking at the ring (the atomic increment is
+  // a full barrier): set_async() frees a ring only when none of them is left
+  __sync_fetch_and_add(&n_pushing, 1);
+  log_record_t *cur_ring = ring;
+  if (cur_ring) {
+    push(cur_ring, type, fmt, vargs);
+    __sync_fetch_and_sub(&n_pushing, 1);
+    return;
+  }
+  __sync_fetch_and_sub(&n_pushing, 1);
+
+  // Synchronous mode: threads other than the main one (e.g. the notification
+  // dispatcher) may be logging at the same time
+  pthread_mutex_lock(&write_mutex);
+  try {
+    check_rotate();
+    vsay(type, level, fmt, vargs);
+  }
+  catch (...) {
+    pthread_mutex_unlock(&write_mutex);
+    throw;
+  }
+  pthread_mutex_unlock(&write_mutex);
+}
 
-    if (difftime(cur_time, rotated_time) >= secs_rotate) {
+/** Rotates the log file if it is rotateable and either enough time has passed
+ *  since the last rotation, or the file has grown beyond the maximum size (if
+ *  set). Outcome of the rotation is reported on the new file.
+ */
+void log::check_rotate() {
+
+  if (!out_file) return;
 
-      switch (rotate()) {
-        case rotate_err_rename:
-          vsay(log_type_error, log_level_urgent,
-            "Can't rename logfile: rotation failed", vargs);
-        break;
+  time_t cur_time = time(NULL);
 
-        case rotate_err_compress:
-          vsay(log_type_warning, log_level_urgent,
-            "Can't compress rotated logfile", vargs);
-        break;
+  if ((difftime(cur_time, rotated_time) >= secs_rotate) ||
+    ((bytes_rotate > 0) && (bytes_written >= bytes_rotate))) {
 
-        case rotate_err_ok:
-          say_banner();
-          vsay(log_type_ok, log_level_urgent, "Logfile rotated", vargs);
-        break;
-      }
+    switch (rotate()) {
+      case rotate_err_rename:
+        emit(log_type_error, cur_time, "Can't rename logfile: rotation failed");
+      break;
 
-      rotated_time = cur_time;
+      case rotate_err_compress:
+        emit(log_type_warning, cur_time, "Can't compress rotated logfile");
+      break;
 
+      case rotate_err_ok:
+        say_banner();
+        emit(log_type_ok, cur_time, "Logfile rotated");
+      break;
     }
-  }
 
-  vsay(type, level, fmt, vargs);
+    rotated_time = cur_time;
+
+  }
 }
 
 /** Says a log message, varargs version. This function is private and used
@@ -164,31 +398,253 @@ void log::vsay(log_type_t type, log_level_t level, const char *fmt,
 
   if (level < min_log_level) return;
 
-  char pref;
-  static char color[8] = "";
+  vsnprintf(strbuf, AF_LOG_BUFSIZE, fmt, vargs);
+  emit(type, time(NULL), strbuf);
+  out->flush();
+}
+
+/** Writes an already formatted message on the output stream, prefixed with its
+ *  type and timestamp. The stream is not flushed.
+ */
+void log::emit(log_type_t type, time_t when, const char *msg) {
+
+  char pref = 'I';
+  const char *color = "";
+  char datetime_fmt[20];
 
   switch (type) {
-    case log_type_ok:      pref = 'O'; strcpy(color, "\033[1;32m"); break;
-    case log_type_info:    pref = 'I'; strcpy(color, "\033[1;36m"); break;
-    case log_type_warning: pref = 'W'; strcpy(color, "\033[1;33m"); break;
-    case log_type_error:   pref = 'E'; strcpy(color, "\033[1;31m"); break;
-    case log_type_fatal:   pref = 'F'; strcpy(color, "\033[1;35m"); break;
+    case log_type_ok:      pref = 'O'; color = "\033[1;32m"; break;
+    case log_type_info:    pref = 'I'; color = "\033[1;36m"; break;
+    case log_type_warning: pref = 'W'; color = "\033[1;33m"; break;
+    case log_type_error:   pref = 'E'; color = "\033[1;31m"; break;
+    case log_type_fatal:   pref = 'F'; color = "\033[1;35m"; break;
   }
 
-  time_t cur_time = time(NULL);
-  struct tm *cur_tm = localtime(&cur_time);
-  strftime(strbuf, AF_LOG_BUFSIZE, "-[%Y%m%d-%H%M%S]", cur_tm);
-  if (!out_file) *out << color << pref << strbuf << " \033[m";
-  else *out << pref << strbuf << " ";
+  struct tm cur_tm;
+  localtime_r(&when, &cur_tm);
+  strftime(datetime_fmt, 20, "%Y%m%d-%H%M%S", &cur_tm);
+  if (!out_file) *out << color << pref << "-[" << datetime_fmt << "] \033[m";
+  else {
+    *out << pref << "-[" << datetime_fmt << "] ";
+    bytes_written += strlen(msg) + 21;  // prefix, timestamp and newline
+  }
 
-  vsnprintf(strbuf, AF_LOG_BUFSIZE, fmt, vargs);
-  *out << strbuf << std::endl;
+  *out << msg << '\n';
+}
+
+/** Turns asynchronous logging on or off. A ring_size greater than zero enables
+ *  it with a ring buffer of at least that many messages (rounded up to a power
+ *  of two, and at most AF_LOG_MAX_RING_SIZE); zero writes out pending messages,
+ *  stops the writer thread and goes back to synchronous logging. It is safe to
+ *  call this function while other threads are logging: while the ring buffer
+ *  is being replaced they log synchronously, hence messages of that moment may
+ *  be written out of order. When the ring buffer is full new messages are
+ *  either dropped (and counted, see get_n_dropped()) or the caller waits for a
+ *  free slot, according to policy. Returns false if the writer thread can't be
+ *  started: logging stays synchronous in that case.
+ */
+bool log::set_async(unsigned int ring_size, log_overflow_t policy) {
+
+  if (ring_size > AF_LOG_MAX_RING_SIZE) ring_size = AF_LOG_MAX_RING_SIZE;
+
+  unsigned long sz = 1;
+  while (sz < ring_size) sz <<= 1;
+
+  pthread_mutex_lock(&async_mutex);
+
+  // Nothing to do if ring buffer is already of the requested size
+  if (((writer_ring) && (ring_size > 0) && (sz == ring_mask+1)) ||
+    ((!writer_ring) && (ring_size == 0))) {
+    overflow = policy;
+    pthread_mutex_unlock(&async_mutex);
+    return true;
+  }
+
+  // Stop current writer (if any): the ring is unpublished first, and the
+  // writer is stopped once no producer may still be pushing to it. The writer
+  // writes everything before quitting
+  if (writer_ring) {
+    ring = NULL;
+    __sync_synchronize();
+    while (__sync_fetch_and_add(&n_pushing, 0) > 0) sched_yield();
+    writer_quit = true;
+    pthread_join(writer, NULL);
+    delete[] writer_ring;
+    writer_ring = NULL;
+  }
+
+  // Producers still pushing to the old ring used the old policy
+  overflow = policy;
+
+  if (ring_size == 0) {
+    pthread_mutex_unlock(&async_mutex);
+    return true;
+  }
+
+  log_record_t *new_ring = new log_record_t[sz];
+  for (unsigned long i=0; i<sz; i++) new_ring[i].seq = i;
+
+  ring_mask = sz - 1;
+  ring_head = 0;
+  ring_tail = 0;
+  writer_quit = false;
+  writer_ring = new_ring;
+
+  if (pthread_create(&writer, NULL, writer_thread, this) != 0) {
+    writer_ring = NULL;
+    delete[] new_ring;
+    pthread_mutex_lock(&write_mutex);
+    emit(log_type_error, time(NULL),
+      "Can't start log writer thread: logging synchronously");
+    out->flush();
+    pthread_mutex_unlock(&write_mutex);
+    pthread_mutex_unlock(&async_mutex);
+    return false;
+  }
+
+  // Published to producers only when fully set up
+  __sync_synchronize();
+  ring = new_ring;
+
+  pthread_mutex_unlock(&async_mutex);
+  return true;
+}
+
+/** Formats a message in a free slot of the given ring buffer, as read by
+ *  rotate_say(), and publishes it to the writer thread. Slots are claimed with
+ *  an atomic compare-and-swap on the head counter, so that any number of
+ *  threads can log concurrently without locks. Returns false if the message
+ *  was dropped because the ring is full.
+ */
+bool log::push(log_record_t *rec_ring, log_type_t type, const char *fmt,
+  va_list vargs) {
+
+  log_record_t *rec;
+  unsigned long pos = ring_head;
+
+  while (true) {
+    rec = &rec_ring[pos & ring_mask];
+    unsigned long seq = rec->seq;
+    __sync_synchronize();
+    long diff = (long)seq - (long)pos;
+
+    if (diff == 0) {
+      if (__sync_bool_compare_and_swap(&ring_head, pos, pos+1)) break;
+    }
+    else if (diff < 0) {
+      // Slot still owned by the writer thread: ring is full
+      if (overflow == log_overflow_drop) {
+        __sync_fetch_and_add(&n_dropped, 1);
+        return false;
+      }
+      usleep(AF_LOG_ASYNC_USLEEP);
+    }
+
+    pos = ring_head;
+  }
+
+  rec->when = time(NULL);
+  rec->type = type;
+  vsnprintf(rec->msg, AF_LOG_BUFSIZE, fmt, vargs);
+
+  __sync_synchronize();
+  rec->seq = pos + 1;  // ready to be consumed
+
+  return true;
+}
+
+/** Writes out all the messages currently published in the ring buffer, then
+ *  flushes the stream once. Only the writer thread calls this function, which
+ *  holds the write mutex while writing. Messages which can't be written (the
+ *  stream throws on errors, also while rotating) are counted and freed anyway,
+ *  so that producers are not stuck on a full ring, and the count is reported
+ *  once writing works again. Returns the number of messages handled.
+ */
+unsigned int log::drain() {
+
+  unsigned int count = 0;
+
+  pthread_mutex_lock(&write_mutex);
+
+  while (true) {
+    log_record_t *rec = &writer_ring[ring_tail & ring_mask];
+    unsigned long seq = rec->seq;
+    __sync_synchronize();
+    if ((long)seq - (long)(ring_tail+1) < 0) break;  // not yet published
+
+    try {
+      if (count == 0) check_rotate();
+      emit(rec->type, rec->when, rec->msg);
+    }
+    catch (...) {
+      out->clear();
+      n_lost++;
+    }
+    count++;
+
+    __sync_synchronize();
+    rec->seq = ring_tail + ring_mask + 1;  // free for producers again
+    ring_tail++;
+  }
+
+  try {
+
+    unsigned long dropped = n_dropped;
+    if (dropped != n_dropped_reported) {
+      snprintf(strbuf, AF_LOG_BUFSIZE,
+        "Log ring buffer full: %lu message(s) dropped (%lu since start)",
+        dropped - n_dropped_reported, dropped);
+      emit(log_type_warning, time(NULL), strbuf);
+      n_dropped_reported = dropped;
+      count++;
+    }
+
+    if (n_lost != n_lost_reported) {
+      snprintf(strbuf, AF_LOG_BUFSIZE,
+        "Log not writable: %lu message(s) lost (%lu since start)",
+        n_lost - n_lost_reported, n_lost);
+      emit(log_type_error, time(NULL), strbuf);
+      n_lost_reported = n_lost;
+      count++;
+    }
+
+    if (count) out->flush();
+
+  }
+  catch (...) {
+    out->clear();
+  }
+
+  pthread_mutex_unlock(&write_mutex);
+
+  return count;
+}
+
+/** Body of the writer thread: drains the ring buffer, sleeping for a while when
+ *  it is empty. Remaining messages are written when quitting. It is declared as
+ *  static.
+ */
+void *log::writer_thread(void *args) {
+
+  log *self = (log *)args;
+
+  // Signals are handled by the main thread only
+  sigset_t all_sigs;
+  sigfillset(&all_sigs);
+  pthread_sigmask(SIG_BLOCK, &all_sigs, NULL);
+
+  while (!self->writer_quit) {
+    if (self->drain() == 0) usleep(AF_LOG_ASYNC_USLEEP);
+  }
+  self->drain();
+
+  return NULL;
 }
 
 /** Success message of the specified log level on the default log facility.
  */
 void log::ok(log_level_t level, const char *fmt, ...) {
-  if (!stdlog) return;
+  if (!enabled(level)) return;
   va_list vargs;
   va_start(vargs, fmt);
   stdlog->rotate_say(log_type_ok, level, fmt, vargs);
@@ -198,7 +654,7 @@ void log::ok(log_level_t level, const char *fmt, ...) {
 /** Info message of the specified log level on the default log facility.
  */
 void log::info(log_level_t level, const char *fmt, ...) {
-  if (!stdlog) return;
+  if (!enabled(level)) return;
   va_list vargs;
   va_start(vargs, fmt);
   stdlog->rotate_say(log_type_info, level, fmt, vargs);
@@ -208,7 +664,7 @@ void log::info(log_level_t level, const char *fmt, ...) {
 /** Warning message of the specified log level on the default log facility.
  */
 void log::warning(log_level_t level, const char *fmt, ...) {
-  if (!stdlog) return;
+  if (!enabled(level)) return;
   va_list vargs;
   va_start(vargs, fmt);
   stdlog->rotate_say(log_type_warning, level, fmt, vargs);
@@ -218,7 +674,7 @@ void log::warning(log_level_t level, const char *fmt, ...) {
 /** Error message of the specified log level on the default log facility.
  */
 void log::error(log_level_t level, const char *fmt, ...) {
-  if (!stdlog) return;
+  if (!enabled(level)) return;
   va_list vargs;
   va_start(vargs, fmt);
   stdlog->rotate_say(log_type_error, level, fmt, vargs);
@@ -228,7 +684,7 @@ void log::error(log_level_t level, const char *fmt, ...) {
 /** Fatal error message of the specified log level on the default log facility.
  */
 void log::fatal(log_level_t level, const char *fmt, ...) {
-  if (!stdlog) return;
+  if (!enabled(level)) return;
   va_list vargs;
   va_start(vargs, fmt);
   stdlog->rotate_say(log_type_fatal, level, fmt, vargs);
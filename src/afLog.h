@@ -6,12 +6,56 @@
  * Log facility with different error types and error levels. Log file rotation
  * and compression is supported. Every string function used therein is memory
  * safe.
+ *
+ * Messages can optionally be handed over to a writer thread through a
+ * lock-free ring buffer (multiple producers, single consumer): in this case
+ * the calling thread only formats the message, while timestamps, file I/O,
+ * flushes and rotation are performed asynchronously in batches. The ring is
+ * published through an atomic pointer, and it is freed only once no producer
+ * may still be using it: logging threads never wait for a lock.
  */
 
 #ifndef AFLOG_H
 #define AFLOG_H
 
 #define AF_LOG_BUFSIZE 2000
+#define AF_LOG_ASYNC_USLEEP 10000
+
+/** Maximum number of slots of the asynchronous ring buffer: each slot holds a
+ *  whole message (about 2 KiB), hence the ring takes 128 MiB at most.
+ */
+#define AF_LOG_MAX_RING_SIZE 65536
+
+/** Messages with a level below this one are removed at compile time when using
+ *  the AF_LOG* macros: e.g., build with -DAF_LOG_MIN_LEVEL=1 to strip debug
+ *  messages completely.
+ */
+#ifndef AF_LOG_MIN_LEVEL
+#define AF_LOG_MIN_LEVEL 0
+#endif
+
+/** Says a message on the default log facility only if its level is enabled.
+ *  Unlike calling the static functions directly, arguments are not even
+ *  evaluated when the level is disabled. FUNC is one of ok, info, warning,
+ *  error, fatal.
+ */
+#define AF_LOG(FUNC, LEVEL, ...) \
+  do { \
+    if (af::log::enabled(LEVEL)) af::log::FUNC((LEVEL), __VA_ARGS__); \
+  } while (0)
+
+/** Like AF_LOG, but the message from this very call site is said at most
+ *  MAX_PER_SEC times per second. The number of suppressed messages is reported
+ *  in a summary at the first call of the next second. Call sites are not
+ *  thread-safe with respect to each other.
+ */
+#define AF_LOG_RATE(FUNC, LEVEL, MAX_PER_SEC, FMT, ...) \
+  do { \
+    static af::log_ratelimit_t af_log_rl_ = { 0, 0, 0 }; \
+    if ((af::log::enabled(LEVEL)) && \
+      (af::log::rate_ok(af_log_rl_, (MAX_PER_SEC), (LEVEL), (FMT)))) \
+      af::log::FUNC((LEVEL), (FMT), ##__VA_ARGS__); \
+  } while (0)
 
 #include <iostream>
 #include <fstream>
@@ -20,7 +64,15 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <errno.h>
 #include <libgen.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 namespace af {
 
@@ -52,6 +104,31 @@ namespace af {
     rotate_err_compress
   } rotate_err_t;
 
+  /** What to do with a new message when the asynchronous ring buffer is full.
+   */
+  typedef enum {
+    log_overflow_drop,
+    log_overflow_block
+  } log_overflow_t;
+
+  /** Status of a rate-limited call site (see AF_LOG_RATE).
+   */
+  typedef struct {
+    time_t        window;
+    unsigned int  count;
+    unsigned long suppressed;
+  } log_ratelimit_t;
+
+  /** A slot of the asynchronous ring buffer. The sequence number tells whether
+   *  the slot is free for producers or ready for the writer thread.
+   */
+  typedef struct {
+    volatile unsigned long seq;
+    time_t                 when;
+    log_type_t             type;
+    char                   msg[AF_LOG_BUFSIZE];
+  } log_record_t;
+
   /** Logging facility. Multiple instances are allowed. The forward declaration
    *  is needed because of the static pointer to an instance of the class
    *  itself.
@@ -64,7 +141,9 @@ namespace af {
       log(std::ostream &out_stream, log_level_t min_level,
         std::string &banner_msg);
       log(const char *log_file, log_level_t min_level, std::string &banner_msg);
-      void set_level(log_level_t min_level) { min_log_level = min_level; };
+      void set_level(log_level_t min_level);
+      void set_rotate_secs(double secs);
+      void set_rotate_bytes(unsigned long bytes);
       virtual ~log();
       void say(log_type_t type, log_level_t level, const char *fmt, ...);
       static void ok(log_level_t level, const char *fmt, ...);
@@ -73,6 +152,21 @@ namespace af {
       static void error(log_level_t level, const char *fmt, ...);
       static void fatal(log_level_t level, const char *fmt, ...);
 
+      /** Tells whether messages of the given level are said by the default log
+       *  facility: one comparison, and none at all for levels stripped at
+       *  compile time.
+       */
+      static inline bool enabled(log_level_t level) {
+        return (((int)level >= AF_LOG_MIN_LEVEL) && ((int)level >= std_level));
+      };
+      static bool rate_ok(log_ratelimit_t &rl, unsigned int max_per_sec,
+        log_level_t level, const char *fmt);
+
+      bool set_async(unsigned int ring_size,
+        log_overflow_t policy = log_overflow_drop);
+      inline bool is_async() const { return (ring != NULL); };
+      inline unsigned long get_n_dropped() const { return n_dropped; };
+
     private:
 
       std::ostream *out;
@@ -80,8 +174,12 @@ namespace af {
       std::string file_name;
       time_t rotated_time;
       double secs_rotate;
+      unsigned long bytes_rotate;
+      unsigned long bytes_written;
+      pthread_mutex_t write_mutex;  // output stream, rotation and its settings
       char strbuf[AF_LOG_BUFSIZE];
       static log *stdlog;
+      static int std_level;
       log_level_t min_log_level;
       std::string banner;
 
@@ -91,7 +189,31 @@ namespace af {
         va_list vargs);
       void rotate_say(log_type_t type, log_level_t level,
         const char *fmt, va_list vargs);
+      void check_rotate();
       rotate_err_t rotate();
+      static bool compress_detached(const char *file_name);
+      static bool find_exec(const char *name, std::string &path);
+      void emit(log_type_t type, time_t when, const char *msg);
+
+      bool push(log_record_t *rec_ring, log_type_t type, const char *fmt,
+        va_list vargs);
+      unsigned int drain();
+      static void *writer_thread(void *args);
+
+      log_record_t *volatile  ring;         // as seen by producers
+      log_record_t           *writer_ring;  // as seen by the writer thread
+      unsigned long           ring_mask;
+      volatile unsigned long  ring_head;
+      unsigned long           ring_tail;
+      log_overflow_t          overflow;
+      volatile unsigned long  n_pushing;    // producers maybe using the ring
+      pthread_mutex_t         async_mutex;  // serializes set_async()
+      volatile unsigned long  n_dropped;
+      unsigned long           n_dropped_reported;
+      unsigned long           n_lost;       // not written because of errors
+      unsigned long           n_lost_reported;
+      volatile bool           writer_quit;
+      pthread_t               writer;
 
   };
 
@@ -41,6 +41,23 @@ namespace af {
       virtual void commit() = 0;
       virtual const char *whoami() const = 0;
 
+      /** Optional functions: subclasses that are not interested in them do not
+       *  need to implement them.
+       */
+      virtual void phase(const char *phase_name, double real_sec) {};
+      virtual void phase_stats(const char *phase_name, unsigned long count,
+        double sum_sec, double p50_sec, double p95_sec, double max_sec) {};
+      virtual void commands(unsigned int n_cmds, float cpu_sec,
+        unsigned long max_rss_kib, unsigned long long read_bytes) {};
+      virtual void endpoint_stats(const char *host, unsigned long n_ok,
+        unsigned long n_fail, float wait_p50_sec, float wait_p95_sec,
+        float stage_p50_sec, float stage_p95_sec, float mbps_p50,
+        float mbps_p5) {};
+      virtual void endpoint_breaker(const char *host, const char *state,
+        unsigned int n_consec_fail, unsigned long n_trips) {};
+      virtual void slots(unsigned int n_slots, unsigned int n_min,
+        unsigned int n_max, const char *reason) {};
+
       /** Plugin creation and destruction.
        */
       notify(config &_cfg) : cfg(_cfg) {};
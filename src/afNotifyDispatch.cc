@@ -0,0 +1,489 @@
+/**
+ * afNotifyDispatch.cc -- by Dario Berzano <dario.berzano@cern.ch>
+ *
+ * This file is part of afdsmgrd -- see http://code.google.com/p/afdsmgrd
+ *
+ * See header file for a description of the class.
+ */
+
+#include "afNotifyDispatch.h"
+
+using namespace af;
+
+/** Constructor: starts the dispatcher thread, which idles until a plugin is
+ *  set. Pacing is off until set_rate() is called.
+ */
+notifyDispatch::notifyDispatch(config &_cfg) : notify(_cfg), plugin(NULL),
+  quit(false), suspended(false), sending(false), msgs_per_sec(0.), burst(1.),
+  tokens(1.), status_is_pending(false), ds_before_status(0), status_since(0.),
+  n_coalesced(0) {
+
+  memset(&status_draft, 0, sizeof(status_draft));
+  memset(&status_pending, 0, sizeof(status_pending));
+  last_refill = now_sec();
+
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&work_cond, NULL);
+  pthread_cond_init(&idle_cond, NULL);
+
+  if (pthread_create(&dispatcher, NULL, dispatch_thread, this) != 0)
+    throw std::runtime_error("Can't create the notification dispatcher");
+
+}
+
+/** Destructor: stops the dispatcher thread. Pending notifications are lost,
+ *  and the plugin is not unloaded, since it is not owned by this class.
+ */
+notifyDispatch::~notifyDispatch() {
+
+  pthread_mutex_lock(&mutex);
+  quit = true;
+  pthread_cond_signal(&work_cond);
+  pthread_mutex_unlock(&mutex);
+
+  pthread_join(dispatcher, NULL);
+
+  pthread_cond_destroy(&idle_cond);
+  pthread_cond_destroy(&work_cond);
+  pthread_mutex_destroy(&mutex);
+
+}
+
+/** Returns the identifier of the wrapped plugin.
+ */
+const char *notifyDispatch::whoami() const {
+  if (plugin) return plugin->whoami();
+  return "Notification dispatcher (no plugin)";
+}
+
+/** Replaces the plugin notifications are sent to, waiting for the current
+ *  notification (if any) to be sent: pending notifications are discarded.
+ *  Returns the former plugin, which can now be safely unloaded by the caller.
+ *  A NULL plugin is accepted.
+ */
+notify *notifyDispatch::set_plugin(notify *_plugin) {
+
+  pthread_mutex_lock(&mutex);
+
+  wait_idle();
+
+  notify *prev_plugin = plugin;
+  plugin = _plugin;
+  ds_pending.clear();
+  ds_order.clear();
+  status_is_pending = false;
+  ds_before_status = 0;
+
+  pthread_cond_signal(&work_cond);
+  pthread_mutex_unlock(&mutex);
+
+  return prev_plugin;
+}
+
+/** Sets the maximum pace of notifications sent to the plugin: up to _burst of
+ *  them can be sent in a row, then they are sent at _msgs_per_sec on average.
+ *  A zero rate means no pacing.
+ */
+void notifyDispatch::set_rate(double _msgs_per_sec, unsigned int _burst) {
+  pthread_mutex_lock(&mutex);
+  msgs_per_sec = (_msgs_per_sec > 0.) ? _msgs_per_sec : 0.;
+  burst = (_burst > 0) ? (double)_burst : 1.;
+  if (tokens > burst) tokens = burst;
+  pthread_cond_signal(&work_cond);
+  pthread_mutex_unlock(&mutex);
+}
+
+/** Stops sending notifications, and waits for the one being sent (if any).
+ *  This must be called before touching the configuration, as plugins react to
+ *  it from the caller's thread through callbacks.
+ */
+void notifyDispatch::suspend() {
+  pthread_mutex_lock(&mutex);
+  suspended = true;
+  wait_idle();
+  pthread_mutex_unlock(&mutex);
+}
+
+/** Resumes sending notifications after suspend().
+ */
+void notifyDispatch::resume() {
+  pthread_mutex_lock(&mutex);
+  suspended = false;
+  pthread_cond_signal(&work_cond);
+  pthread_mutex_unlock(&mutex);
+}
+
+/** Returns the number of dataset notifications replaced by newer ones before
+ *  being sent, since the last call of this function.
+ */
+unsigned long notifyDispatch::get_n_coalesced() {
+  pthread_mutex_lock(&mutex);
+  unsigned long n = n_coalesced;
+  n_coalesced = 0;
+  pthread_mutex_unlock(&mutex);
+  return n;
+}
+
+/** Queues a dataset notification. If a notification for the same dataset is
+ *  still waiting, it is replaced in place (it keeps its turn).
+ */
+void notifyDispatch::dataset(const char *ds_name, int n_files, int n_staged,
+  int n_corrupted, const char *tree_name, int n_events,
+  unsigned long long total_size_bytes) {
+
+  pthread_mutex_lock(&mutex);
+
+  if (plugin) {
+
+    std::pair<notify_ds_map_t::iterator, bool> ins =
+      ds_pending.insert( std::make_pair(std::string(ds_name), notify_ds_t()) );
+
+    if (ins.second) ds_order.push_back(ds_name);
+    else n_coalesced++;
+
+    notify_ds_t &nd = ins.first->second;
+    nd.n_files = n_files;
+    nd.n_staged = n_staged;
+    nd.n_corrupted = n_corrupted;
+    nd.tree_name = tree_name ? tree_name : "";
+    nd.n_events = n_events;
+    nd.total_size_bytes = total_size_bytes;
+
+    pthread_cond_signal(&work_cond);
+
+  }
+
+  pthread_mutex_unlock(&mutex);
+
+}
+
+/** Collects resources usage: sent on commit().
+ */
+void notifyDispatch::resources(unsigned long rss_kib, unsigned long virt_kib,
+  float real_sec, float user_sec, float sys_sec,
+  float real_delta_sec, float user_delta_sec, float sys_delta_sec) {
+  status_draft.has_resources  = true;
+  status_draft.rss_kib        = rss_kib;
+  status_draft.virt_kib       = virt_kib;
+  status_draft.real_sec       = real_sec;
+  status_draft.user_sec       = user_sec;
+  status_draft.sys_sec        = sys_sec;
+  status_draft.real_delta_sec = real_delta_sec;
+  status_draft.user_delta_sec = user_delta_sec;
+  status_draft.sys_delta_sec  = sys_delta_sec;
+}
+
+/** Collects queue status: sent on commit().
+ */
+void notifyDispatch::queue(unsigned int n_queued, unsigned int n_runn,
+  unsigned int n_success, unsigned int n_fail, unsigned int n_total) {
+  status_draft.has_queue = true;
+  status_draft.n_queued  = n_queued;
+  status_draft.n_runn    = n_runn;
+  status_draft.n_success = n_success;
+  status_draft.n_fail    = n_fail;
+  status_draft.n_total   = n_total;
+}
+
+/** Collects resources used by external commands: sent on commit().
+ */
+void notifyDispatch::commands(unsigned int n_cmds, float cpu_sec,
+  unsigned long max_rss_kib, unsigned long long read_bytes) {
+  status_draft.has_commands     = true;
+  status_draft.n_cmds           = n_cmds;
+  status_draft.cmds_cpu_sec     = cpu_sec;
+  status_draft.cmds_max_rss_kib = max_rss_kib;
+  status_draft.cmds_read_bytes  = read_bytes;
+}
+
+/** Collects the number of staging slots: sent on commit().
+ */
+void notifyDispatch::slots(unsigned int n_slots, unsigned int n_min,
+  unsigned int n_max, const char *reason) {
+  status_draft.has_slots   = true;
+  status_draft.n_slots     = n_slots;
+  status_draft.n_slots_min = n_min;
+  status_draft.n_slots_max = n_max;
+  strncpy(status_draft.slots_reason, reason ? reason : "",
+    sizeof(status_draft.slots_reason)-1);
+  status_draft.slots_reason[sizeof(status_draft.slots_reason)-1] = '\0';
+}
+
+/** Collects statistics of a storage endpoint: sent on commit(). Endpoints in
+ *  excess are dropped.
+ */
+void notifyDispatch::endpoint_stats(const char *host, unsigned long n_ok,
+  unsigned long n_fail, float wait_p50_sec, float wait_p95_sec,
+  float stage_p50_sec, float stage_p95_sec, float mbps_p50, float mbps_p5) {
+
+  if (status_draft.n_endpoints == AF_NOTIFYDISPATCH_MAXENDPOINTS) return;
+
+  unsigned int i = status_draft.n_endpoints++;
+  status_draft.endpoints[i].has_breaker = false;
+  strncpy(status_draft.endpoints[i].host, host,
+    sizeof(status_draft.endpoints[i].host)-1);
+  status_draft.endpoints[i].host[sizeof(status_draft.endpoints[i].host)-1] =
+    '\0';
+  status_draft.endpoints[i].n_ok = n_ok;
+  status_draft.endpoints[i].n_fail = n_fail;
+  status_draft.endpoints[i].wait_p50_sec = wait_p50_sec;
+  status_draft.endpoints[i].wait_p95_sec = wait_p95_sec;
+  status_draft.endpoints[i].stage_p50_sec = stage_p50_sec;
+  status_draft.endpoints[i].stage_p95_sec = stage_p95_sec;
+  status_draft.endpoints[i].mbps_p50 = mbps_p50;
+  status_draft.endpoints[i].mbps_p5 = mbps_p5;
+}
+
+/** Collects the state of the circuit breaker of a storage endpoint, whose
+ *  statistics must have been collected first: sent on commit().
+ */
+void notifyDispatch::endpoint_breaker(const char *host, const char *state,
+  unsigned int n_consec_fail, unsigned long n_trips) {
+
+  for (unsigned int i=0; i<status_draft.n_endpoints; i++) {
+    if (strcmp(status_draft.endpoints[i].host, host) != 0) continue;
+    status_draft.endpoints[i].has_breaker = true;
+    strncpy(status_draft.endpoints[i].breaker_state, state,
+      sizeof(status_draft.endpoints[i].breaker_state)-1);
+    status_draft.endpoints[i].breaker_state[
+      sizeof(status_draft.endpoints[i].breaker_state)-1] = '\0';
+    status_draft.endpoints[i].n_consec_fail = n_consec_fail;
+    status_draft.endpoints[i].n_trips = n_trips;
+    return;
+  }
+
+}
+
+/** Returns the index of the given phase in the status being collected, adding
+ *  it if needed, or -1 if there is no room left.
+ */
+int notifyDispatch::find_phase(const char *phase_name) {
+
+  unsigned int i;
+  for (i=0; i<status_draft.n_phases; i++)
+    if (strcmp(status_draft.phases[i].name, phase_name) == 0) return i;
+
+  if (i == AF_NOTIFYDISPATCH_MAXPHASES) return -1;
+
+  memset(&status_draft.phases[i], 0, sizeof(status_draft.phases[i]));
+  strncpy(status_draft.phases[i].name, phase_name,
+    sizeof(status_draft.phases[i].name)-1);
+  status_draft.n_phases++;
+
+  return i;
+}
+
+/** Collects phase timings: sent on commit().
+ */
+void notifyDispatch::phase(const char *phase_name, double real_sec) {
+  int i = find_phase(phase_name);
+  if (i >= 0) status_draft.phases[i].real_sec = real_sec;
+}
+
+/** Collects phase statistics: sent on commit().
+ */
+void notifyDispatch::phase_stats(const char *phase_name, unsigned long count,
+  double sum_sec, double p50_sec, double p95_sec, double max_sec) {
+  int i = find_phase(phase_name);
+  if (i < 0) return;
+  status_draft.phases[i].has_stats = true;
+  status_draft.phases[i].count = count;
+  status_draft.phases[i].sum_sec = sum_sec;
+  status_draft.phases[i].p50_sec = p50_sec;
+  status_draft.phases[i].p95_sec = p95_sec;
+  status_draft.phases[i].max_sec = max_sec;
+}
+
+/** Queues what has been collected through queue(), resources() and phase() as
+ *  a single status notification. It replaces the previous one if not sent yet,
+ *  and it is sent right after the datasets queued so far: plugins see the
+ *  datasets of a loop before its status (e.g. to publish totals). A status
+ *  replacing another one keeps its place, and a status never waits for more
+ *  than AF_NOTIFYDISPATCH_STATUS_MAX_DS datasets or
+ *  AF_NOTIFYDISPATCH_STATUS_MAX_WAIT_SEC seconds: it is sent even if datasets
+ *  come faster than they are sent.
+ */
+void notifyDispatch::commit() {
+
+  pthread_mutex_lock(&mutex);
+  if (plugin) {
+    // Commands are counted, thus the ones not sent yet must not be lost
+    if ((status_is_pending) && (status_pending.has_commands)) {
+      status_draft.has_commands = true;
+      status_draft.n_cmds += status_pending.n_cmds;
+      status_draft.cmds_cpu_sec += status_pending.cmds_cpu_sec;
+      status_draft.cmds_read_bytes += status_pending.cmds_read_bytes;
+      if (status_pending.cmds_max_rss_kib > status_draft.cmds_max_rss_kib)
+        status_draft.cmds_max_rss_kib = status_pending.cmds_max_rss_kib;
+    }
+    memcpy(&status_pending, &status_draft, sizeof(status_draft));
+    if (!status_is_pending) {
+      ds_before_status = ds_order.size();
+      if (ds_before_status > AF_NOTIFYDISPATCH_STATUS_MAX_DS)
+        ds_before_status = AF_NOTIFYDISPATCH_STATUS_MAX_DS;
+      status_since = now_sec();
+    }
+    status_is_pending = true;
+    pthread_cond_signal(&work_cond);
+  }
+  pthread_mutex_unlock(&mutex);
+
+  memset(&status_draft, 0, sizeof(status_draft));
+
+}
+
+/** Takes a token from the bucket, refilling it first. Returns false if there
+ *  are no tokens left. Must be called with the mutex held.
+ */
+bool notifyDispatch::take_token() {
+
+  if (msgs_per_sec <= 0.) return true;
+
+  double now = now_sec();
+  tokens += (now - last_refill) * msgs_per_sec;
+  if (tokens > burst) tokens = burst;
+  last_refill = now;
+
+  if (tokens < 1.) return false;
+  tokens -= 1.;
+  return true;
+}
+
+/** Waits until no notification is being sent. Must be called with the mutex
+ *  held.
+ */
+void notifyDispatch::wait_idle() {
+  while (sending) pthread_cond_wait(&idle_cond, &mutex);
+}
+
+/** Body of the dispatcher thread. Notifications are copied out of the queue
+ *  and sent without holding the mutex, so that callers never wait for the
+ *  plugin. This function is declared as static.
+ */
+void *notifyDispatch::dispatch_thread(void *args) {
+
+  notifyDispatch *self = (notifyDispatch *)args;
+
+  // Signals are handled by the main thread only
+  sigset_t all_sigs;
+  sigfillset(&all_sigs);
+  pthread_sigmask(SIG_BLOCK, &all_sigs, NULL);
+
+  notify_status_t status;
+  notify_ds_t nd;
+  std::string ds_name;
+
+  pthread_mutex_lock(&self->mutex);
+
+  while (!self->quit) {
+
+    if ((self->suspended) || (!self->plugin) ||
+      ((!self->status_is_pending) && (self->ds_order.empty()))) {
+      pthread_cond_wait(&self->work_cond, &self->mutex);
+      continue;
+    }
+
+    if (!self->take_token()) {
+
+      // Sleep until next token, or until something changes
+      double wait_sec = (1. - self->tokens) / self->msgs_per_sec;
+      struct timeval tv;
+      struct timespec ts;
+      gettimeofday(&tv, NULL);
+      long nsec = tv.tv_usec * 1000L + (long)(wait_sec * 1e9);
+      ts.tv_sec = tv.tv_sec + nsec / 1000000000L;
+      ts.tv_nsec = nsec % 1000000000L;
+      pthread_cond_timedwait(&self->work_cond, &self->mutex, &ts);
+      continue;
+
+    }
+
+    // Take a notification out of the queue: status goes right after the
+    // datasets queued before it
+    notify *target = self->plugin;
+    bool is_status = ((self->status_is_pending) &&
+      ((self->ds_before_status == 0) || (now_sec() - self->status_since >=
+      AF_NOTIFYDISPATCH_STATUS_MAX_WAIT_SEC)));
+
+    if (is_status) {
+      memcpy(&status, &self->status_pending, sizeof(status));
+      self->status_is_pending = false;
+      self->ds_before_status = 0;
+    }
+    else {
+      ds_name = self->ds_order.front();
+      self->ds_order.pop_front();
+      notify_ds_map_t::iterator it = self->ds_pending.find(ds_name);
+      nd = it->second;
+      self->ds_pending.erase(it);
+      if (self->ds_before_status > 0) self->ds_before_status--;
+    }
+
+    self->sending = true;
+    pthread_mutex_unlock(&self->mutex);
+
+    if (is_status) {
+      if (status.has_queue) {
+        target->queue(status.n_queued, status.n_runn, status.n_success,
+          status.n_fail, status.n_total);
+      }
+      if (status.has_commands) {
+        target->commands(status.n_cmds, status.cmds_cpu_sec,
+          status.cmds_max_rss_kib, status.cmds_read_bytes);
+      }
+      if (status.has_slots) {
+        target->slots(status.n_slots, status.n_slots_min, status.n_slots_max,
+          status.slots_reason);
+      }
+      for (unsigned int i=0; i<status.n_endpoints; i++) {
+        target->endpoint_stats(status.endpoints[i].host,
+          status.endpoints[i].n_ok, status.endpoints[i].n_fail,
+          status.endpoints[i].wait_p50_sec, status.endpoints[i].wait_p95_sec,
+          status.endpoints[i].stage_p50_sec, status.endpoints[i].stage_p95_sec,
+          status.endpoints[i].mbps_p50, status.endpoints[i].mbps_p5);
+        if (status.endpoints[i].has_breaker) {
+          target->endpoint_breaker(status.endpoints[i].host,
+            status.endpoints[i].breaker_state,
+            status.endpoints[i].n_consec_fail, status.endpoints[i].n_trips);
+        }
+      }
+      for (unsigned int i=0; i<status.n_phases; i++) {
+        target->phase(status.phases[i].name, status.phases[i].real_sec);
+        if (status.phases[i].has_stats) {
+          target->phase_stats(status.phases[i].name, status.phases[i].count,
+            status.phases[i].sum_sec, status.phases[i].p50_sec,
+            status.phases[i].p95_sec, status.phases[i].max_sec);
+        }
+      }
+      if (status.has_resources) {
+        target->resources(status.rss_kib, status.virt_kib,
+          status.real_sec, status.user_sec, status.sys_sec,
+          status.real_delta_sec, status.user_delta_sec, status.sys_delta_sec);
+      }
+      target->commit();
+    }
+    else {
+      target->dataset(ds_name.c_str(), nd.n_files, nd.n_staged,
+        nd.n_corrupted, nd.tree_name.c_str(), nd.n_events,
+        nd.total_size_bytes);
+    }
+
+    pthread_mutex_lock(&self->mutex);
+    self->sending = false;
+    pthread_cond_broadcast(&self->idle_cond);
+
+  }
+
+  pthread_mutex_unlock(&self->mutex);
+
+  return NULL;
+}
+
+/** Current time in seconds, used by the token bucket. This function is
+ *  declared as static.
+ */
+double notifyDispatch::now_sec() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (double)tv.tv_sec + (double)tv.tv_usec / 1000000.;
+}
@@ -0,0 +1,183 @@
+/**
+ * afNotifyDispatch.h -- by Dario Berzano <dario.berzano@cern.ch>
+ *
+ * This file is part of afdsmgrd -- see http://code.google.com/p/afdsmgrd
+ *
+ * Asynchronous dispatcher of notifications. It looks like a notification
+ * plugin to the daemon, but calls only queue data: a separate thread forwards
+ * them to the actual plugin, pacing them with a token bucket. Repeated updates
+ * of the same dataset are coalesced while waiting, so that the queue never
+ * grows beyond the number of datasets. Order is kept: datasets queued before
+ * a status notification are sent before it, unless they are too many to wait
+ * for (see AF_NOTIFYDISPATCH_STATUS_MAX_DS and _MAX_WAIT_SEC).
+ */
+
+#ifndef AFNOTIFYDISPATCH_H
+#define AFNOTIFYDISPATCH_H
+
+#define AF_NOTIFYDISPATCH_MAXPHASES 20
+#define AF_NOTIFYDISPATCH_MAXENDPOINTS 50
+#define AF_NOTIFYDISPATCH_STATUS_MAX_DS 1000
+#define AF_NOTIFYDISPATCH_STATUS_MAX_WAIT_SEC 60.
+
+#include <string>
+#include <list>
+#include <map>
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#include "afNotify.h"
+
+namespace af {
+
+  /** A dataset notification waiting to be sent.
+   */
+  typedef struct {
+    int                n_files;
+    int                n_staged;
+    int                n_corrupted;
+    std::string        tree_name;
+    int                n_events;
+    unsigned long long total_size_bytes;
+  } notify_ds_t;
+
+  /** Status notification (queue, resources and phases) waiting to be sent.
+   */
+  typedef struct {
+    bool               has_queue;
+    unsigned int       n_queued;
+    unsigned int       n_runn;
+    unsigned int       n_success;
+    unsigned int       n_fail;
+    unsigned int       n_total;
+    bool               has_resources;
+    unsigned long      rss_kib;
+    unsigned long      virt_kib;
+    float              real_sec;
+    float              user_sec;
+    float              sys_sec;
+    float              real_delta_sec;
+    float              user_delta_sec;
+    float              sys_delta_sec;
+    bool               has_commands;
+    unsigned int       n_cmds;
+    float              cmds_cpu_sec;
+    unsigned long      cmds_max_rss_kib;
+    unsigned long long cmds_read_bytes;
+    bool               has_slots;
+    unsigned int       n_slots;
+    unsigned int       n_slots_min;
+    unsigned int       n_slots_max;
+    char               slots_reason[200];
+    unsigned int       n_endpoints;
+    struct {
+      char          host[100];
+      unsigned long n_ok;
+      unsigned long n_fail;
+      float         wait_p50_sec;
+      float         wait_p95_sec;
+      float         stage_p50_sec;
+      float         stage_p95_sec;
+      float         mbps_p50;
+      float         mbps_p5;
+      bool          has_breaker;
+      char          breaker_state[20];
+      unsigned int  n_consec_fail;
+      unsigned long n_trips;
+    } endpoints[AF_NOTIFYDISPATCH_MAXENDPOINTS];
+    unsigned int       n_phases;
+    struct {
+      char          name[50];
+      double        real_sec;
+      bool          has_stats;
+      unsigned long count;
+      double        sum_sec;
+      double        p50_sec;
+      double        p95_sec;
+      double        max_sec;
+    } phases[AF_NOTIFYDISPATCH_MAXPHASES];
+  } notify_status_t;
+
+  typedef std::map<std::string, notify_ds_t> notify_ds_map_t;
+  typedef std::list<std::string> notify_ds_order_t;
+
+  /** The main class of this file.
+   */
+  class notifyDispatch : public notify {
+
+    public:
+
+      notifyDispatch(config &_cfg);
+      virtual ~notifyDispatch();
+
+      virtual void dataset(const char *ds_name, int n_files, int n_staged,
+        int n_corrupted, const char *tree_name, int n_events,
+        unsigned long long total_size_bytes);
+      virtual void resources(unsigned long rss_kib, unsigned long virt_kib,
+        float real_sec, float user_sec, float sys_sec,
+        float real_delta_sec, float user_delta_sec, float sys_delta_sec);
+      virtual void queue(unsigned int n_queued, unsigned int n_runn,
+        unsigned int n_success, unsigned int n_fail, unsigned int n_total);
+      virtual void phase(const char *phase_name, double real_sec);
+      virtual void phase_stats(const char *phase_name, unsigned long count,
+        double sum_sec, double p50_sec, double p95_sec, double max_sec);
+      virtual void commands(unsigned int n_cmds, float cpu_sec,
+        unsigned long max_rss_kib, unsigned long long read_bytes);
+      virtual void endpoint_stats(const char *host, unsigned long n_ok,
+        unsigned long n_fail, float wait_p50_sec, float wait_p95_sec,
+        float stage_p50_sec, float stage_p95_sec, float mbps_p50,
+        float mbps_p5);
+      virtual void endpoint_breaker(const char *host, const char *state,
+        unsigned int n_consec_fail, unsigned long n_trips);
+      virtual void slots(unsigned int n_slots, unsigned int n_min,
+        unsigned int n_max, const char *reason);
+      virtual void commit();
+      virtual const char *whoami() const;
+
+      notify *set_plugin(notify *_plugin);
+      inline notify *get_plugin() const { return plugin; };
+      void set_rate(double _msgs_per_sec, unsigned int _burst);
+      void suspend();
+      void resume();
+      unsigned long get_n_coalesced();
+
+    private:
+
+      int find_phase(const char *phase_name);
+      bool take_token();
+      void wait_idle();
+      static void *dispatch_thread(void *args);
+      static double now_sec();
+
+      notify            *plugin;
+      pthread_t          dispatcher;
+      pthread_mutex_t    mutex;
+      pthread_cond_t     work_cond;  // there is something to do
+      pthread_cond_t     idle_cond;  // nothing is being sent
+      bool               quit;
+      bool               suspended;
+      bool               sending;
+
+      // Token bucket
+      double             msgs_per_sec;  // zero means no pacing
+      double             burst;
+      double             tokens;
+      double             last_refill;
+
+      // Pending notifications
+      notify_ds_map_t    ds_pending;
+      notify_ds_order_t  ds_order;
+      notify_status_t    status_draft;  // only used by the caller
+      notify_status_t    status_pending;
+      bool               status_is_pending;
+      size_t             ds_before_status;  // to be sent before the status
+      double             status_since;      // when it started to wait
+      unsigned long      n_coalesced;
+
+  };
+
+}
+
+#endif // AFNOTIFYDISPATCH_H
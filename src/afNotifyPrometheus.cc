@@ -0,0 +1,599 @@
+/**
+ * afNotifyPrometheus.cc -- by Dario Berzano <dario.berzano@cern.ch>
+ *
+ * This file is part of afdsmgrd -- see http://code.google.com/p/afdsmgrd
+ *
+ * See header file for a description of the class.
+ */
+
+#include "afNotifyPrometheus.h"
+
+using namespace af;
+
+/** Non-member function with C-style name binding (i.e., no mangling) to
+ *  allow for classes in libraries through polymorphism.
+ */
+extern "C" notify *create(config &_cfg) {
+  return new notifyPrometheus(_cfg);
+}
+
+/** Non-member destructor with C-style name binding: see afNotifyApMon.cc for
+ *  the reason why it is needed.
+ */
+extern "C" void destroy(notify *notif) {
+  delete notif;
+}
+
+/** Returns a string identifier for this plugin.
+ */
+const char *notifyPrometheus::whoami() const {
+  return "Prometheus metrics notification plugin";
+}
+
+/** Default constructor. The listener is not started here: the directive bound
+ *  here is assigned (or defaulted) while the configuration file that loaded
+ *  the plugin is still being read, and the callback starts the listener on
+ *  the configured address then. Nothing is bound to an address which is not
+ *  wanted.
+ */
+notifyPrometheus::notifyPrometheus(config &_cfg) : notify(_cfg),
+  listen_fd(-1), listener_quit(false), n_scrapes(0), n_phases(0),
+  n_endpoints(0) {
+
+  memset(&stat_vals, 0, sizeof(stat_vals));
+  memset(&ds_vals, 0, sizeof(ds_vals));
+  memset(&ds_last, 0, sizeof(ds_last));
+  memset(&cmds_vals, 0, sizeof(cmds_vals));
+
+  pthread_mutex_init(&page_mutex, NULL);
+
+  cfg.bind_callback("dsmgrd.metricslisten",
+    notifyPrometheus::config_listen_callback, this);
+
+}
+
+/** Destructor: stops the listener thread and unbinds directives.
+ */
+notifyPrometheus::~notifyPrometheus() {
+  stop_listener();
+  cfg.unbind("dsmgrd.metricslisten");
+  pthread_mutex_destroy(&page_mutex);
+}
+
+/** Accumulates dataset information. Datasets are not exposed one by one to
+ *  keep the number of series constant: only totals are.
+ */
+void notifyPrometheus::dataset(const char *ds_name, int n_files,
+  int n_staged, int n_corrupted, const char *tree_name, int n_events,
+  unsigned long long total_size_bytes) {
+  ds_vals.n_datasets++;
+  ds_vals.n_files += n_files;
+  ds_vals.n_staged += n_staged;
+  ds_vals.n_corrupted += n_corrupted;
+  ds_vals.n_events += n_events;
+  ds_vals.total_size_bytes += total_size_bytes;
+}
+
+/** Report resources usage. Note: a call to commit() is required to publish.
+ */
+void notifyPrometheus::resources(unsigned long rss_kib,
+  unsigned long virt_kib, float real_sec, float user_sec, float sys_sec,
+  float real_delta_sec, float user_delta_sec, float sys_delta_sec) {
+  stat_vals.rss_kib       = rss_kib;
+  stat_vals.virt_kib      = virt_kib;
+  stat_vals.uptime_sec    = real_sec;
+  stat_vals.user_sec      = user_sec;
+  stat_vals.sys_sec       = sys_sec;
+  stat_vals.pcpu_delta    = 100. * user_delta_sec / real_delta_sec;
+  stat_vals.has_resources = true;
+}
+
+/** Report queue status. Note: a call to commit() is required to publish.
+ */
+void notifyPrometheus::queue(unsigned int n_queued, unsigned int n_runn,
+  unsigned int n_success, unsigned int n_fail, unsigned int n_total) {
+  stat_vals.n_queued  = n_queued;
+  stat_vals.n_runn    = n_runn;
+  stat_vals.n_success = n_success;
+  stat_vals.n_fail    = n_fail;
+  stat_vals.n_total   = n_total;
+  stat_vals.has_queue = true;
+}
+
+/** Report resources used by external commands finished during the last loop.
+ *  Note: a call to commit() is required to publish.
+ */
+void notifyPrometheus::commands(unsigned int n_cmds, float cpu_sec,
+  unsigned long max_rss_kib, unsigned long long read_bytes) {
+  cmds_vals.n_cmds += n_cmds;
+  cmds_vals.cpu_sec += cpu_sec;
+  cmds_vals.read_bytes += read_bytes;
+  cmds_vals.max_rss_kib = max_rss_kib;
+}
+
+/** Returns the index of the given phase, adding it if needed, or -1 if there
+ *  is no room left.
+ */
+int notifyPrometheus::find_phase(const char *phase_name) {
+
+  unsigned int i;
+  for (i=0; i<n_phases; i++)
+    if (strcmp(phases[i].name, phase_name) == 0) return i;
+
+  if (i == AF_NOTIFYPROMETHEUS_MAXPHASES) return -1;
+
+  memset(&phases[i], 0, sizeof(phases[i]));
+  strncpy(phases[i].name, phase_name, sizeof(phases[i].name)-1);
+  n_phases++;
+
+  return i;
+}
+
+/** Report the duration of a phase of the current loop. Note: a call to
+ *  commit() is required to publish.
+ */
+void notifyPrometheus::phase(const char *phase_name, double real_sec) {
+  int i = find_phase(phase_name);
+  if (i >= 0) phases[i].real_sec = real_sec;
+}
+
+/** Report statistics of the durations of a phase since the start. Note: a call
+ *  to commit() is required to publish.
+ */
+void notifyPrometheus::phase_stats(const char *phase_name,
+  unsigned long count, double sum_sec, double p50_sec, double p95_sec,
+  double max_sec) {
+  int i = find_phase(phase_name);
+  if (i < 0) return;
+  phases[i].has_stats = true;
+  phases[i].count = count;
+  phases[i].sum_sec = sum_sec;
+  phases[i].p50_sec = p50_sec;
+  phases[i].p95_sec = p95_sec;
+  phases[i].max_sec = max_sec;
+}
+
+/** Report the number of staging slots. Note: a call to commit() is required to
+ *  publish.
+ */
+void notifyPrometheus::slots(unsigned int n_slots, unsigned int n_min,
+  unsigned int n_max, const char *reason) {
+  stat_vals.n_slots = n_slots;
+  stat_vals.n_slots_min = n_min;
+  stat_vals.n_slots_max = n_max;
+  stat_vals.has_slots = true;
+}
+
+/** Returns the index of the given storage endpoint, adding it if needed, or -1
+ *  if there is no room left.
+ */
+int notifyPrometheus::find_endpoint(const char *host) {
+
+  unsigned int i;
+  for (i=0; i<n_endpoints; i++)
+    if (strcmp(endpoints[i].host, host) == 0) return i;
+
+  if (i == AF_NOTIFYPROMETHEUS_MAXENDPOINTS) return -1;
+
+  memset(&endpoints[i], 0, sizeof(endpoints[i]));
+  strncpy(endpoints[i].host, host, sizeof(endpoints[i].host)-1);
+  n_endpoints++;
+
+  return i;
+}
+
+/** Report statistics of a storage endpoint. Note: a call to commit() is
+ *  required to publish.
+ */
+void notifyPrometheus::endpoint_stats(const char *host, unsigned long n_ok,
+  unsigned long n_fail, float wait_p50_sec, float wait_p95_sec,
+  float stage_p50_sec, float stage_p95_sec, float mbps_p50, float mbps_p5) {
+  int i = find_endpoint(host);
+  if (i < 0) return;
+  endpoints[i].n_ok = n_ok;
+  endpoints[i].n_fail = n_fail;
+  endpoints[i].wait_p50_sec = wait_p50_sec;
+  endpoints[i].wait_p95_sec = wait_p95_sec;
+  endpoints[i].stage_p50_sec = stage_p50_sec;
+  endpoints[i].stage_p95_sec = stage_p95_sec;
+  endpoints[i].mbps_p50 = mbps_p50;
+  endpoints[i].mbps_p5 = mbps_p5;
+}
+
+/** Report the state of the circuit breaker of a storage endpoint. Note: a call
+ *  to commit() is required to publish.
+ */
+void notifyPrometheus::endpoint_breaker(const char *host, const char *state,
+  unsigned int n_consec_fail, unsigned long n_trips) {
+  int i = find_endpoint(host);
+  if (i < 0) return;
+  endpoints[i].has_breaker = true;
+  if (strcmp(state, "open") == 0) endpoints[i].breaker_state = 2;
+  else if (strcmp(state, "half-open") == 0) endpoints[i].breaker_state = 1;
+  else endpoints[i].breaker_state = 0;
+  endpoints[i].n_consec_fail = n_consec_fail;
+  endpoints[i].n_trips = n_trips;
+}
+
+/** Appends a formatted line to the page being prepared.
+ */
+void notifyPrometheus::add_line(const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(linebuf, AF_NOTIFYPROMETHEUS_LINESIZE, fmt, args);
+  va_end(args);
+  draft += linebuf;
+  draft += '\n';
+}
+
+/** Renders data collected through queue(), resources(), dataset() and phase()
+ *  as a new page. The page is prepared outside the lock and then swapped in, so
+ *  that clients being served hold the lock for the shortest time possible.
+ */
+void notifyPrometheus::commit() {
+
+  draft.clear();
+
+  if (stat_vals.has_queue) {
+    add_line("# HELP afdsmgrd_queue_files Files in the transfer queue.");
+    add_line("# TYPE afdsmgrd_queue_files gauge");
+    add_line("afdsmgrd_queue_files{status=\"queued\"} %u", stat_vals.n_queued);
+    add_line("afdsmgrd_queue_files{status=\"running\"} %u", stat_vals.n_runn);
+    add_line("afdsmgrd_queue_files{status=\"success\"} %u",
+      stat_vals.n_success);
+    add_line("afdsmgrd_queue_files{status=\"failed\"} %u", stat_vals.n_fail);
+    add_line("afdsmgrd_queue_files{status=\"total\"} %u", stat_vals.n_total);
+  }
+
+  if (stat_vals.has_slots) {
+    add_line("# HELP afdsmgrd_staging_slots Concurrent staging commands "
+      "allowed.");
+    add_line("# TYPE afdsmgrd_staging_slots gauge");
+    add_line("afdsmgrd_staging_slots{type=\"current\"} %u", stat_vals.n_slots);
+    add_line("afdsmgrd_staging_slots{type=\"min\"} %u",
+      stat_vals.n_slots_min);
+    add_line("afdsmgrd_staging_slots{type=\"max\"} %u",
+      stat_vals.n_slots_max);
+  }
+
+  if (ds_vals.n_datasets > 0) {
+    memcpy(&ds_last, &ds_vals, sizeof(ds_vals));
+    memset(&ds_vals, 0, sizeof(ds_vals));
+  }
+
+  add_line("# HELP afdsmgrd_datasets Datasets found in the last scan.");
+  add_line("# TYPE afdsmgrd_datasets gauge");
+  add_line("afdsmgrd_datasets %u", ds_last.n_datasets);
+  add_line("# HELP afdsmgrd_dataset_files Files in all datasets by status.");
+  add_line("# TYPE afdsmgrd_dataset_files gauge");
+  add_line("afdsmgrd_dataset_files{status=\"total\"} %llu", ds_last.n_files);
+  add_line("afdsmgrd_dataset_files{status=\"staged\"} %llu",
+    ds_last.n_staged);
+  add_line("afdsmgrd_dataset_files{status=\"corrupted\"} %llu",
+    ds_last.n_corrupted);
+  add_line("# HELP afdsmgrd_dataset_events Events in all datasets.");
+  add_line("# TYPE afdsmgrd_dataset_events gauge");
+  add_line("afdsmgrd_dataset_events %llu", ds_last.n_events);
+  add_line("# HELP afdsmgrd_dataset_bytes Total size of all datasets.");
+  add_line("# TYPE afdsmgrd_dataset_bytes gauge");
+  add_line("afdsmgrd_dataset_bytes %llu", ds_last.total_size_bytes);
+
+  if (stat_vals.has_resources) {
+    add_line("# HELP afdsmgrd_memory_bytes Memory used by the daemon.");
+    add_line("# TYPE afdsmgrd_memory_bytes gauge");
+    add_line("afdsmgrd_memory_bytes{type=\"rss\"} %lu",
+      stat_vals.rss_kib * 1024UL);
+    add_line("afdsmgrd_memory_bytes{type=\"virt\"} %lu",
+      stat_vals.virt_kib * 1024UL);
+    add_line("# HELP afdsmgrd_uptime_seconds Time since daemon start.");
+    add_line("# TYPE afdsmgrd_uptime_seconds gauge");
+    add_line("afdsmgrd_uptime_seconds %.3f", stat_vals.uptime_sec);
+    add_line("# HELP afdsmgrd_cpu_seconds_total CPU time used by the daemon.");
+    add_line("# TYPE afdsmgrd_cpu_seconds_total counter");
+    add_line("afdsmgrd_cpu_seconds_total{mode=\"user\"} %.3f",
+      stat_vals.user_sec);
+    add_line("afdsmgrd_cpu_seconds_total{mode=\"system\"} %.3f",
+      stat_vals.sys_sec);
+    add_line("# HELP afdsmgrd_cpu_percent User CPU during the last loop.");
+    add_line("# TYPE afdsmgrd_cpu_percent gauge");
+    add_line("afdsmgrd_cpu_percent %.2f", stat_vals.pcpu_delta);
+  }
+
+  add_line("# HELP afdsmgrd_commands_total External commands finished.");
+  add_line("# TYPE afdsmgrd_commands_total counter");
+  add_line("afdsmgrd_commands_total %llu", cmds_vals.n_cmds);
+  add_line("# HELP afdsmgrd_commands_cpu_seconds_total CPU time used by "
+    "external commands.");
+  add_line("# TYPE afdsmgrd_commands_cpu_seconds_total counter");
+  add_line("afdsmgrd_commands_cpu_seconds_total %.3lf", cmds_vals.cpu_sec);
+  add_line("# HELP afdsmgrd_commands_read_bytes_total Bytes read by external "
+    "commands.");
+  add_line("# TYPE afdsmgrd_commands_read_bytes_total counter");
+  add_line("afdsmgrd_commands_read_bytes_total %llu", cmds_vals.read_bytes);
+  add_line("# HELP afdsmgrd_commands_max_rss_bytes Maximum memory used by an "
+    "external command during the last loop.");
+  add_line("# TYPE afdsmgrd_commands_max_rss_bytes gauge");
+  add_line("afdsmgrd_commands_max_rss_bytes %lu",
+    cmds_vals.max_rss_kib * 1024UL);
+  cmds_vals.max_rss_kib = 0;
+
+  if (n_endpoints > 0) {
+    add_line("# HELP afdsmgrd_endpoint_transfers_total Transfers finished "
+      "per storage endpoint.");
+    add_line("# TYPE afdsmgrd_endpoint_transfers_total counter");
+    for (unsigned int i=0; i<n_endpoints; i++) {
+      add_line("afdsmgrd_endpoint_transfers_total{host=\"%s\","
+        "result=\"ok\"} %lu", endpoints[i].host, endpoints[i].n_ok);
+      add_line("afdsmgrd_endpoint_transfers_total{host=\"%s\","
+        "result=\"failed\"} %lu", endpoints[i].host, endpoints[i].n_fail);
+    }
+    add_line("# HELP afdsmgrd_endpoint_wait_seconds Time spent in queue, "
+      "recent quantiles.");
+    add_line("# TYPE afdsmgrd_endpoint_wait_seconds gauge");
+    for (unsigned int i=0; i<n_endpoints; i++) {
+      add_line("afdsmgrd_endpoint_wait_seconds{host=\"%s\","
+        "quantile=\"0.5\"} %.3f", endpoints[i].host,
+        endpoints[i].wait_p50_sec);
+      add_line("afdsmgrd_endpoint_wait_seconds{host=\"%s\","
+        "quantile=\"0.95\"} %.3f", endpoints[i].host,
+        endpoints[i].wait_p95_sec);
+    }
+    add_line("# HELP afdsmgrd_endpoint_stage_seconds Time spent staging, "
+      "recent quantiles.");
+    add_line("# TYPE afdsmgrd_endpoint_stage_seconds gauge");
+    for (unsigned int i=0; i<n_endpoints; i++) {
+      add_line("afdsmgrd_endpoint_stage_seconds{host=\"%s\","
+        "quantile=\"0.5\"} %.3f", endpoints[i].host,
+        endpoints[i].stage_p50_sec);
+      add_line("afdsmgrd_endpoint_stage_seconds{host=\"%s\","
+        "quantile=\"0.95\"} %.3f", endpoints[i].host,
+        endpoints[i].stage_p95_sec);
+    }
+    add_line("# HELP afdsmgrd_endpoint_throughput_mbytes_per_second Staging "
+      "throughput, recent quantiles.");
+    add_line("# TYPE afdsmgrd_endpoint_throughput_mbytes_per_second gauge");
+    for (unsigned int i=0; i<n_endpoints; i++) {
+      add_line("afdsmgrd_endpoint_throughput_mbytes_per_second{host=\"%s\","
+        "quantile=\"0.5\"} %.3f", endpoints[i].host, endpoints[i].mbps_p50);
+      add_line("afdsmgrd_endpoint_throughput_mbytes_per_second{host=\"%s\","
+        "quantile=\"0.05\"} %.3f", endpoints[i].host, endpoints[i].mbps_p5);
+    }
+    add_line("# HELP afdsmgrd_endpoint_breaker_state Circuit breaker per "
+      "storage endpoint: 0 closed, 1 half-open, 2 open.");
+    add_line("# TYPE afdsmgrd_endpoint_breaker_state gauge");
+    for (unsigned int i=0; i<n_endpoints; i++) {
+      if (!endpoints[i].has_breaker) continue;
+      add_line("afdsmgrd_endpoint_breaker_state{host=\"%s\"} %d",
+        endpoints[i].host, endpoints[i].breaker_state);
+    }
+    add_line("# HELP afdsmgrd_endpoint_consecutive_failures Transfers failed "
+      "in a row per storage endpoint.");
+    add_line("# TYPE afdsmgrd_endpoint_consecutive_failures gauge");
+    for (unsigned int i=0; i<n_endpoints; i++) {
+      if (!endpoints[i].has_breaker) continue;
+      add_line("afdsmgrd_endpoint_consecutive_failures{host=\"%s\"} %u",
+        endpoints[i].host, endpoints[i].n_consec_fail);
+    }
+    add_line("# HELP afdsmgrd_endpoint_breaker_trips_total Times the circuit "
+      "breaker opened per storage endpoint.");
+    add_line("# TYPE afdsmgrd_endpoint_breaker_trips_total counter");
+    for (unsigned int i=0; i<n_endpoints; i++) {
+      if (!endpoints[i].has_breaker) continue;
+      add_line("afdsmgrd_endpoint_breaker_trips_total{host=\"%s\"} %lu",
+        endpoints[i].host, endpoints[i].n_trips);
+    }
+  }
+
+  if (n_phases > 0) {
+    add_line("# HELP afdsmgrd_phase_seconds Duration of the phases of the "
+      "last loop.");
+    add_line("# TYPE afdsmgrd_phase_seconds gauge");
+    for (unsigned int i=0; i<n_phases; i++) {
+      add_line("afdsmgrd_phase_seconds{phase=\"%s\"} %.6f", phases[i].name,
+        phases[i].real_sec);
+    }
+    add_line("# HELP afdsmgrd_phase_duration_seconds Durations of the phases "
+      "since the start.");
+    add_line("# TYPE afdsmgrd_phase_duration_seconds summary");
+    for (unsigned int i=0; i<n_phases; i++) {
+      if (!phases[i].has_stats) continue;
+      const char *n = phases[i].name;
+      add_line("afdsmgrd_phase_duration_seconds{phase=\"%s\",quantile=\"0.5\"}"
+        " %.6f", n, phases[i].p50_sec);
+      add_line("afdsmgrd_phase_duration_seconds{phase=\"%s\","
+        "quantile=\"0.95\"} %.6f", n, phases[i].p95_sec);
+      add_line("afdsmgrd_phase_duration_seconds{phase=\"%s\",quantile=\"1\"}"
+        " %.6f", n, phases[i].max_sec);
+      add_line("afdsmgrd_phase_duration_seconds_sum{phase=\"%s\"} %.6f", n,
+        phases[i].sum_sec);
+      add_line("afdsmgrd_phase_duration_seconds_count{phase=\"%s\"} %lu", n,
+        phases[i].count);
+    }
+  }
+
+  // Value of the scrapes counter is appended when serving
+  add_line("# HELP afdsmgrd_scrapes_total Requests served by this plugin.");
+  add_line("# TYPE afdsmgrd_scrapes_total counter");
+
+  pthread_mutex_lock(&page_mutex);
+  page.swap(draft);
+  pthread_mutex_unlock(&page_mutex);
+
+  // Eventually reset cache
+  memset(&stat_vals, 0, sizeof(stat_vals));
+  n_phases = 0;
+
+}
+
+/** Starts listening on the given address in the form [host:]port and spawns
+ *  the thread that serves requests. Returns false if the socket can't be
+ *  opened: in such a case, there is no listener.
+ */
+bool notifyPrometheus::start_listener(const char *listen_addr) {
+
+  std::string host = "127.0.0.1";
+  std::string port = listen_addr;
+  size_t colon = port.rfind(':');
+  if (colon != std::string::npos) {
+    if (colon > 0) host = port.substr(0, colon);
+    port.erase(0, colon+1);
+  }
+
+  struct addrinfo hints;
+  struct addrinfo *ai;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  int r = getaddrinfo(host.c_str(), port.c_str(), &hints, &ai);
+  if (r != 0) {
+    log::error(log_level_high, "Invalid address for metrics: %s (%s)",
+      listen_addr, gai_strerror(r));
+    return false;
+  }
+
+  listen_fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+  if (listen_fd >= 0) {
+    int on = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    fcntl(listen_fd, F_SETFD, FD_CLOEXEC);  // not inherited by ext commands
+    if ((bind(listen_fd, ai->ai_addr, ai->ai_addrlen) != 0) ||
+      (listen(listen_fd, 5) != 0)) {
+      close(listen_fd);
+      listen_fd = -1;
+    }
+  }
+
+  freeaddrinfo(ai);
+
+  if (listen_fd < 0) {
+    log::error(log_level_high, "Can't listen for metrics on %s: %s",
+      listen_addr, strerror(errno));
+    return false;
+  }
+
+  listener_quit = false;
+  if (pthread_create(&listener, NULL, listener_thread, this) != 0) {
+    log::error(log_level_high, "Can't start the metrics listener thread");
+    close(listen_fd);
+    listen_fd = -1;
+    return false;
+  }
+
+  log::ok(log_level_normal, "Metrics available at http://%s/metrics",
+    listen_addr);
+  return true;
+}
+
+/** Stops the listener thread, if running, and closes the socket.
+ */
+void notifyPrometheus::stop_listener() {
+  if (listen_fd < 0) return;
+  listener_quit = true;
+  pthread_join(listener, NULL);
+  close(listen_fd);
+  listen_fd = -1;
+}
+
+/** Body of the listener thread: it polls the listening socket with a timeout,
+ *  to periodically check if it has been asked to quit, and serves clients one
+ *  by one. This function is declared as static.
+ */
+void *notifyPrometheus::listener_thread(void *args) {
+
+  notifyPrometheus *self = (notifyPrometheus *)args;
+
+  // Signals are handled by the main thread only
+  sigset_t all_sigs;
+  sigfillset(&all_sigs);
+  pthread_sigmask(SIG_BLOCK, &all_sigs, NULL);
+
+  struct pollfd pfd;
+  pfd.fd = self->listen_fd;
+  pfd.events = POLLIN;
+
+  while (!self->listener_quit) {
+    pfd.revents = 0;
+    if (poll(&pfd, 1, AF_NOTIFYPROMETHEUS_POLL_MSEC) <= 0) continue;
+    int client_fd = accept(self->listen_fd, NULL, NULL);
+    if (client_fd < 0) continue;
+    fcntl(client_fd, F_SETFD, FD_CLOEXEC);  // as the listening socket
+    self->serve(client_fd);
+    close(client_fd);
+  }
+
+  return NULL;
+}
+
+/** Serves a single client: only GET /metrics is supported. Slow clients are
+ *  given up after a short timeout, so that they can't stall the listener.
+ */
+void notifyPrometheus::serve(int client_fd) {
+
+  struct timeval tv;
+  tv.tv_sec = AF_NOTIFYPROMETHEUS_IO_SECS;
+  tv.tv_usec = 0;
+  setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+  // Only the request line is needed: headers are not read
+  char req[AF_NOTIFYPROMETHEUS_REQSIZE];
+  ssize_t len = 0;
+  while ((size_t)len < sizeof(req)-1) {
+    ssize_t r = recv(client_fd, &req[len], sizeof(req)-1-len, 0);
+    if (r <= 0) break;
+    len += r;
+    req[len] = '\0';
+    if (strchr(req, '\n')) break;
+  }
+  req[len] = '\0';
+
+  std::string resp;
+  char hdr[200];
+
+  if ((strncmp(req, "GET /metrics ", 13) == 0) ||
+    (strncmp(req, "GET / ", 6) == 0)) {
+
+    pthread_mutex_lock(&page_mutex);
+    std::string body = page;
+    n_scrapes++;
+    snprintf(hdr, sizeof(hdr), "afdsmgrd_scrapes_total %lu\n", n_scrapes);
+    pthread_mutex_unlock(&page_mutex);
+
+    body += hdr;
+
+    snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+      "Content-Type: text/plain; version=0.0.4\r\n"
+      "Content-Length: %lu\r\nConnection: close\r\n\r\n",
+      (unsigned long)body.length());
+    resp = hdr;
+    resp += body;
+
+  }
+  else {
+    resp = "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\n"
+      "Content-Length: 10\r\nConnection: close\r\n\r\nNot found\n";
+  }
+
+  size_t off = 0;
+  while (off < resp.length()) {
+    ssize_t w = send(client_fd, resp.c_str()+off, resp.length()-off,
+      MSG_NOSIGNAL);
+    if (w <= 0) break;
+    off += w;
+  }
+
+}
+
+/** Callback called the first time the configuration is read after loading the
+ *  plugin, and every time dsmgrd.metricslisten changes: it starts the listener
+ *  or moves it to the new address, or to the default one if the directive is
+ *  missing. This function is static: args is the plugin instance.
+ */
+void notifyPrometheus::config_listen_callback(const char *dir_name,
+  const char *dir_val, void *args) {
+  notifyPrometheus *self = (notifyPrometheus *)args;
+  self->stop_listener();
+  self->start_listener(dir_val ? dir_val : AF_NOTIFYPROMETHEUS_DEFAULT_LISTEN);
+}
@@ -0,0 +1,169 @@
+/**
+ * afNotifyPrometheus.h -- by Dario Berzano <dario.berzano@cern.ch>
+ *
+ * This file is part of afdsmgrd -- see http://code.google.com/p/afdsmgrd
+ *
+ * Plugin that exposes queue, datasets and resources information in the
+ * Prometheus text format through a minimal embedded HTTP server, listening on
+ * a separate thread. Data is collected by the daemon and rendered as a page
+ * upon commit(): requests are served from the last rendered page only, so that
+ * the main loop never waits for clients.
+ */
+
+#ifndef AFNOTIFYPROMETHEUS_H
+#define AFNOTIFYPROMETHEUS_H
+
+#define AF_NOTIFYPROMETHEUS_DEFAULT_LISTEN "127.0.0.1:9464"
+#define AF_NOTIFYPROMETHEUS_POLL_MSEC 500
+#define AF_NOTIFYPROMETHEUS_IO_SECS 2
+#define AF_NOTIFYPROMETHEUS_REQSIZE 1024
+#define AF_NOTIFYPROMETHEUS_LINESIZE 300
+#define AF_NOTIFYPROMETHEUS_MAXPHASES 20
+#define AF_NOTIFYPROMETHEUS_MAXENDPOINTS 50
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "afNotify.h"
+
+namespace af {
+
+  class notifyPrometheus : public notify {
+
+    public:
+      notifyPrometheus(config &_cfg);
+      virtual const char *whoami() const;
+      virtual void dataset(const char *ds_name, int n_files, int n_staged,
+        int n_corrupted, const char *tree_name, int n_events,
+        unsigned long long total_size_bytes);
+      virtual void resources(unsigned long rss_kib, unsigned long virt_kib,
+        float real_sec, float user_sec, float sys_sec,
+        float real_delta_sec, float user_delta_sec, float sys_delta_sec);
+      virtual void queue(unsigned int n_queued, unsigned int n_runn,
+        unsigned int n_success, unsigned int n_fail, unsigned int n_total);
+      virtual void phase(const char *phase_name, double real_sec);
+      virtual void phase_stats(const char *phase_name, unsigned long count,
+        double sum_sec, double p50_sec, double p95_sec, double max_sec);
+      virtual void commands(unsigned int n_cmds, float cpu_sec,
+        unsigned long max_rss_kib, unsigned long long read_bytes);
+      virtual void endpoint_stats(const char *host, unsigned long n_ok,
+        unsigned long n_fail, float wait_p50_sec, float wait_p95_sec,
+        float stage_p50_sec, float stage_p95_sec, float mbps_p50,
+        float mbps_p5);
+      virtual void endpoint_breaker(const char *host, const char *state,
+        unsigned int n_consec_fail, unsigned long n_trips);
+      virtual void slots(unsigned int n_slots, unsigned int n_min,
+        unsigned int n_max, const char *reason);
+      virtual void commit();
+      virtual ~notifyPrometheus();
+
+    private:
+      bool start_listener(const char *listen_addr);
+      void stop_listener();
+      void serve(int client_fd);
+      int find_phase(const char *phase_name);
+      int find_endpoint(const char *host);
+      void add_line(const char *fmt, ...);
+      static void *listener_thread(void *args);
+      static void config_listen_callback(const char *dir_name,
+        const char *dir_val, void *args);
+
+      // Listener
+      int             listen_fd;
+      pthread_t       listener;
+      volatile bool   listener_quit;
+      pthread_mutex_t page_mutex;
+      std::string     page;   // protected by page_mutex
+      std::string     draft;  // only used by the main thread
+      unsigned long   n_scrapes;
+
+      // Values collected since last commit()
+      struct {
+        unsigned long      rss_kib;
+        unsigned long      virt_kib;
+        float              uptime_sec;
+        float              user_sec;
+        float              sys_sec;
+        float              pcpu_delta;
+        bool               has_resources;
+        unsigned int       n_queued;
+        unsigned int       n_runn;
+        unsigned int       n_success;
+        unsigned int       n_fail;
+        unsigned int       n_total;
+        bool               has_queue;
+        unsigned int       n_slots;
+        unsigned int       n_slots_min;
+        unsigned int       n_slots_max;
+        bool               has_slots;
+      } stat_vals;
+
+      // External commands: totals since the start, and maximum memory used by
+      // a command during the last loop
+      struct {
+        unsigned long long n_cmds;
+        double             cpu_sec;
+        unsigned long long read_bytes;
+        unsigned long      max_rss_kib;
+      } cmds_vals;
+
+      // Datasets aggregates: they are reported only for loops where datasets
+      // have been processed, and the last values are kept otherwise
+      struct {
+        unsigned int       n_datasets;
+        unsigned long long n_files;
+        unsigned long long n_staged;
+        unsigned long long n_corrupted;
+        unsigned long long n_events;
+        unsigned long long total_size_bytes;
+      } ds_vals, ds_last;
+
+      // Phase timings of the last loop, and overall statistics
+      unsigned int n_phases;
+      struct {
+        char          name[50];
+        double        real_sec;
+        bool          has_stats;
+        unsigned long count;
+        double        sum_sec;
+        double        p50_sec;
+        double        p95_sec;
+        double        max_sec;
+      } phases[AF_NOTIFYPROMETHEUS_MAXPHASES];
+
+      // Storage endpoints: the last values are kept
+      unsigned int n_endpoints;
+      struct {
+        char          host[100];
+        unsigned long n_ok;
+        unsigned long n_fail;
+        float         wait_p50_sec;
+        float         wait_p95_sec;
+        float         stage_p50_sec;
+        float         stage_p95_sec;
+        float         mbps_p50;
+        float         mbps_p5;
+        bool          has_breaker;
+        int           breaker_state;  // 0: closed, 1: half-open, 2: open
+        unsigned int  n_consec_fail;
+        unsigned long n_trips;
+      } endpoints[AF_NOTIFYPROMETHEUS_MAXENDPOINTS];
+
+      char linebuf[AF_NOTIFYPROMETHEUS_LINESIZE];
+
+  };
+
+}
+
+#endif // AFNOTIFYPROMETHEUS_H
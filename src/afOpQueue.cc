@@ -19,7 +19,9 @@ using namespace af;
  */
 queueEntry::queueEntry(bool _own) : main_url(NULL), endp_url(NULL),
   tree_name(NULL), n_events(0L), n_failures(0), size_bytes(0L), staged(false),
-  status(qstat_queue), own(_own) {};
+  status(qstat_queue), own(_own), cpu_sec(0.), max_rss_kib(0L),
+  read_bytes(0LL), enqueued_at(0.), started_at(0.), finished_at(0.),
+  next_attempt_at(0.), expected_bytes(0LL), priority(0), share(NULL) {};
 
 /** Constructor that assigns passed values to the members. The _own parameter
  *  decides if this class should dispose the strings when destroying. NULL
@@ -27,10 +29,12 @@ queueEntry::queueEntry(bool _own) : main_url(NULL), endp_url(NULL),
  */
 queueEntry::queueEntry(const char *_main_url, const char *_endp_url,
   const char *_tree_name, unsigned long _n_events, unsigned int _n_failures,
-  unsigned long _size_bytes, bool _own, bool _staged) :
+  unsigned long long _size_bytes, bool _own, bool _staged) :
   main_url(NULL), endp_url(NULL), tree_name(NULL), n_events(_n_events),
   n_failures(_n_failures), size_bytes(_size_bytes), status(qstat_queue),
-  own(_own), staged(_staged) {
+  own(_own), staged(_staged), cpu_sec(0.), max_rss_kib(0L), read_bytes(0LL),
+  enqueued_at(0.), started_at(0.), finished_at(0.), next_attempt_at(0.),
+  expected_bytes(0LL), priority(0), share(NULL) {
   set_str(&main_url, _main_url);
   set_str(&endp_url, _endp_url);
   set_str(&tree_name, _tree_name);
@@ -43,6 +47,7 @@ queueEntry::~queueEntry() {
     if (main_url) free(main_url);
     if (endp_url) free(endp_url);
     if (tree_name) free(tree_name);
+    if (share) free(share);
   }
 }
 
@@ -56,8 +61,18 @@ void queueEntry::reset() {
   set_main_url(NULL);
   set_endp_url(NULL);
   set_tree_name(NULL);
+  set_share(NULL);
   staged = false;
   flags.reset();
+  cpu_sec = 0.;
+  max_rss_kib = 0L;
+  read_bytes = 0LL;
+  enqueued_at = 0.;
+  started_at = 0.;
+  finished_at = 0.;
+  next_attempt_at = 0.;
+  expected_bytes = 0LL;
+  priority = 0;
 }
 
 /** Private auxiliary function to assign a value to a string depending on the
@@ -97,6 +112,12 @@ void queueEntry::set_tree_name(const char *_tree_name) {
   set_str(&tree_name, _tree_name);
 };
 
+/** Setter for share. See set_str().
+ */
+void queueEntry::set_share(const char *_share) {
+  set_str(&share, _share);
+};
+
 /** Debug function to print on stdout the members of this class.
  */
 void queueEntry::print() const {
@@ -106,10 +127,20 @@ void queueEntry::print() const {
   printf("tree_name:  %s\n", AF_NULL_STR(tree_name));
   printf("n_events:   %lu\n", n_events);
   printf("n_failures: %u\n", n_failures);
-  printf("size_bytes: %lu\n", size_bytes);
+  printf("size_bytes: %llu\n", size_bytes);
   printf("status:     %c\n", status);
   printf("staged:     %s\n", (staged ? "yes" : "no"));
   printf("flags:      0x%04x\n", (unsigned short)flags.to_ulong());
+  printf("cpu_sec:    %.3lf\n", cpu_sec);
+  printf("max_rss:    %lu KiB\n", max_rss_kib);
+  printf("read_bytes: %llu\n", read_bytes);
+  printf("enqueued:   %.3lf\n", enqueued_at);
+  printf("started:    %.3lf\n", started_at);
+  printf("finished:   %.3lf\n", finished_at);
+  printf("next_try:   %.3lf\n", next_attempt_at);
+  printf("expected:   %llu\n", expected_bytes);
+  printf("priority:   %d\n", priority);
+  printf("share:      %s\n", AF_NULL_STR(share));
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -120,11 +151,14 @@ void queueEntry::print() const {
  *  creates the database in memory. SQLite takes care of creating (and
  *  immediately unlinking) a swap file for it.
  *
- *  The argument max_failures sets the maximum number of failures before
- *  removing ("flushing") the element from the queue. Zero means never flush it.
+ *  By default failed entries are retried forever, immediately: see
+ *  set_max_failures() and set_backoff().
  */
 opQueue::opQueue() :
-  fail_threshold(0), qentry_buf(false), unique_instance_id(0) {
+  fail_threshold(0), backoff_base_sec(0.), backoff_max_sec(0.),
+  qentry_buf(false), unique_instance_id(0), last_ds_id(0) {
+
+  query_by_status_cur = NULL;
 
   qstat_str[1] = '\0';
 
@@ -151,6 +185,17 @@ opQueue::opQueue() :
     "  size_bytes BIGINT UNSIGNED,"
     "  is_staged INTEGER NOT NULL DEFAULT 0,"  // no BOOL in SQLite
     "  flags INTEGER UNSIGNED NOT NULL DEFAULT 0,"
+    "  cpu_sec REAL NOT NULL DEFAULT 0,"  // resources of the last command
+    "  max_rss_kib INTEGER UNSIGNED NOT NULL DEFAULT 0,"
+    "  read_bytes BIGINT UNSIGNED NOT NULL DEFAULT 0,"
+    "  enqueued_at REAL NOT NULL DEFAULT 0,"  // last (re)enqueue
+    "  started_at REAL NOT NULL DEFAULT 0,"
+    "  finished_at REAL NOT NULL DEFAULT 0,"
+    "  next_attempt_at REAL NOT NULL DEFAULT 0,"  // for delayed entries
+    "  expected_bytes BIGINT UNSIGNED NOT NULL DEFAULT 0,"
+    "  endp_host VARCHAR( 100 ) NOT NULL DEFAULT '',"
+    "  share VARCHAR( 100 ) NOT NULL DEFAULT '',"
+    "  priority INTEGER NOT NULL DEFAULT 0,"
     "  UNIQUE (main_url)"
     ")",
   NULL, NULL, &sql_err);
@@ -163,10 +208,62 @@ opQueue::opQueue() :
     throw std::runtime_error(strbuf);
   }
 
+  // Queued entries are selected per storage endpoint and share
+  r = sqlite3_exec(db,
+    "CREATE INDEX temp.queue_by_host ON queue (status,endp_host,rank);"
+    "CREATE INDEX temp.queue_by_share ON queue "
+    "  (status,endp_host,share,priority DESC,rank);"
+    "CREATE INDEX temp.queue_by_due ON queue (status,next_attempt_at)",
+    NULL, NULL, &sql_err);
+  if (r != SQLITE_OK) {
+    snprintf(strbuf, AF_OPQUEUE_BUFSIZE, "Error in SQL CREATE query: %s\n",
+      sql_err);
+    sqlite3_free(sql_err);
+    throw std::runtime_error(strbuf);
+  }
+
+  // Datasets owning the entries: a trigger counts the entries of each dataset
+  // entering or leaving the finished states (D, F), for every owner
+  r = sqlite3_exec(db,
+    "CREATE TEMPORARY TABLE owners ("
+    "  ds_id INTEGER UNSIGNED NOT NULL,"
+    "  file_idx INTEGER UNSIGNED NOT NULL,"  // position in the dataset
+    "  main_url VARCHAR( 200 ) NOT NULL"
+    ");"
+    "CREATE INDEX temp.owners_by_ds ON owners (ds_id);"
+    "CREATE INDEX temp.owners_by_url ON owners (main_url,ds_id);"
+    "CREATE TEMPORARY TABLE datasets ("
+    "  ds_id INTEGER PRIMARY KEY NOT NULL,"
+    "  n_files INTEGER UNSIGNED NOT NULL DEFAULT 0,"
+    "  n_done INTEGER UNSIGNED NOT NULL DEFAULT 0"
+    ");"
+    "CREATE TEMPORARY TRIGGER queue_done AFTER UPDATE OF status ON queue "
+    "  WHEN NEW.status IN ('D','F') AND OLD.status NOT IN ('D','F') "
+    "  BEGIN UPDATE datasets SET n_done=n_done+(SELECT COUNT(*) FROM owners "
+    "    WHERE owners.ds_id=datasets.ds_id AND owners.main_url=NEW.main_url) "
+    "    WHERE ds_id IN (SELECT ds_id FROM owners "
+    "    WHERE owners.main_url=NEW.main_url); END;"
+    "CREATE TEMPORARY TRIGGER queue_undone AFTER UPDATE OF status ON queue "
+    "  WHEN OLD.status IN ('D','F') AND NEW.status NOT IN ('D','F') "
+    "  BEGIN UPDATE datasets SET n_done=n_done-(SELECT COUNT(*) FROM owners "
+    "    WHERE owners.ds_id=datasets.ds_id AND owners.main_url=NEW.main_url) "
+    "    WHERE ds_id IN (SELECT ds_id FROM owners "
+    "    WHERE owners.main_url=NEW.main_url); END",
+    NULL, NULL, &sql_err);
+  if (r != SQLITE_OK) {
+    snprintf(strbuf, AF_OPQUEUE_BUFSIZE, "Error in SQL CREATE query: %s\n",
+      sql_err);
+    sqlite3_free(sql_err);
+    throw std::runtime_error(strbuf);
+  }
+
   // Query for get_full_entry()
   r = sqlite3_prepare_v2(db,
     "SELECT main_url,endp_url,tree_name,n_events,n_failures,size_bytes,"
-    "  status,instance_id,is_staged,flags FROM queue WHERE main_url=? LIMIT 1",
+    "  status,instance_id,is_staged,flags,cpu_sec,max_rss_kib,read_bytes,"
+    "  enqueued_at,started_at,finished_at,priority,share,next_attempt_at,"
+    "  expected_bytes "
+    "  FROM queue WHERE main_url=? LIMIT 1",
     -1, &query_get_full_entry, NULL);
   if (r != SQLITE_OK) {
     snprintf(strbuf, AF_OPQUEUE_BUFSIZE,
@@ -189,7 +286,10 @@ opQueue::opQueue() :
   // Query for *_query_by_status()
   r = sqlite3_prepare_v2(db,
     "SELECT main_url,endp_url,tree_name,n_events,n_failures,size_bytes,"
-    "  status,instance_id,is_staged,flags FROM queue WHERE status=? "
+    "  status,instance_id,is_staged,flags,cpu_sec,max_rss_kib,read_bytes,"
+    "  enqueued_at,started_at,finished_at,priority,share,next_attempt_at,"
+    "  expected_bytes "
+    "  FROM queue WHERE status=? "
     "  ORDER BY rank ASC LIMIT ?",
     -1, &query_by_status_limited, NULL);
   if (r != SQLITE_OK) {
@@ -199,10 +299,84 @@ opQueue::opQueue() :
     throw std::runtime_error(strbuf);
   }
 
+  // Query for *_query_by_status() -- on a single storage endpoint
+  r = sqlite3_prepare_v2(db,
+    "SELECT main_url,endp_url,tree_name,n_events,n_failures,size_bytes,"
+    "  status,instance_id,is_staged,flags,cpu_sec,max_rss_kib,read_bytes,"
+    "  enqueued_at,started_at,finished_at,priority,share,next_attempt_at,"
+    "  expected_bytes "
+    "  FROM queue WHERE status=? AND endp_host=? "
+    "  ORDER BY rank ASC LIMIT ?",
+    -1, &query_by_status_host_limited, NULL);
+  if (r != SQLITE_OK) {
+    snprintf(strbuf, AF_OPQUEUE_BUFSIZE,
+      "Error #%d while preparing query_by_status_host_limited: %s\n", r,
+      sqlite3_errmsg(db));
+    throw std::runtime_error(strbuf);
+  }
+
+  // Query for *_query_by_status() -- on a single share of an endpoint
+  r = sqlite3_prepare_v2(db,
+    "SELECT main_url,endp_url,tree_name,n_events,n_failures,size_bytes,"
+    "  status,instance_id,is_staged,flags,cpu_sec,max_rss_kib,read_bytes,"
+    "  enqueued_at,started_at,finished_at,priority,share,next_attempt_at,"
+    "  expected_bytes "
+    "  FROM queue WHERE status=? AND endp_host=? AND share=? "
+    "  ORDER BY priority DESC,rank ASC LIMIT ?",
+    -1, &query_by_status_share_limited, NULL);
+  if (r != SQLITE_OK) {
+    snprintf(strbuf, AF_OPQUEUE_BUFSIZE,
+      "Error #%d while preparing query_by_status_share_limited: %s\n", r,
+      sqlite3_errmsg(db));
+    throw std::runtime_error(strbuf);
+  }
+
+  // Query for *_query_by_dataset(): finished entries, with their position
+  r = sqlite3_prepare_v2(db,
+    "SELECT main_url,endp_url,tree_name,n_events,n_failures,size_bytes,"
+    "  status,instance_id,is_staged,flags,cpu_sec,max_rss_kib,read_bytes,"
+    "  enqueued_at,started_at,finished_at,priority,share,next_attempt_at,"
+    "  expected_bytes,file_idx "
+    "  FROM owners JOIN queue USING (main_url) "
+    "  WHERE ds_id=? AND status IN ('D','F') "
+    "  ORDER BY file_idx ASC",
+    -1, &query_by_dataset, NULL);
+  if (r != SQLITE_OK) {
+    snprintf(strbuf, AF_OPQUEUE_BUFSIZE,
+      "Error #%d while preparing query_by_dataset: %s\n", r,
+      sqlite3_errmsg(db));
+    throw std::runtime_error(strbuf);
+  }
+
+  // Query for get_endp_hosts(): one index lookup per endpoint
+  r = sqlite3_prepare_v2(db,
+    "SELECT endp_host,rank FROM queue WHERE status=? AND endp_host>=? "
+    "  ORDER BY endp_host ASC,rank ASC LIMIT 1",
+    -1, &query_next_endp_host, NULL);
+  if (r != SQLITE_OK) {
+    snprintf(strbuf, AF_OPQUEUE_BUFSIZE,
+      "Error #%d while preparing query_next_endp_host: %s\n", r,
+      sqlite3_errmsg(db));
+    throw std::runtime_error(strbuf);
+  }
+
+  // Query for get_shares(): one index lookup per share
+  r = sqlite3_prepare_v2(db,
+    "SELECT share FROM queue WHERE status=? AND endp_host=? AND share>=? "
+    "  ORDER BY share ASC LIMIT 1",
+    -1, &query_next_share, NULL);
+  if (r != SQLITE_OK) {
+    snprintf(strbuf, AF_OPQUEUE_BUFSIZE,
+      "Error #%d while preparing query_next_share: %s\n", r,
+      sqlite3_errmsg(db));
+    throw std::runtime_error(strbuf);
+  }
+
   // Query for cond_insert()
   r = sqlite3_prepare_v2(db,
     "INSERT INTO queue "
-    "  (main_url,tree_name,instance_id,flags) VALUES (?,?,?,?)", -1,
+    "  (main_url,tree_name,instance_id,flags,enqueued_at,endp_host,share,"
+    "  priority,expected_bytes) VALUES (?,?,?,?,?,?,?,?,?)", -1,
     &query_cond_insert, NULL);
   if (r != SQLITE_OK) {
     snprintf(strbuf, AF_OPQUEUE_BUFSIZE,
@@ -214,7 +388,8 @@ opQueue::opQueue() :
   // Query for success()
   r = sqlite3_prepare_v2(db,
     "UPDATE queue SET status='D',"
-    "  endp_url=?,tree_name=?,n_events=?,size_bytes=?,is_staged=1 "
+    "  endp_url=?,tree_name=?,n_events=?,size_bytes=?,is_staged=1,"
+    "  finished_at=? "
     "  WHERE main_url=?", -1, &query_success, NULL);
   if (r != SQLITE_OK) {
     snprintf(strbuf, AF_OPQUEUE_BUFSIZE,
@@ -223,13 +398,16 @@ opQueue::opQueue() :
     throw std::runtime_error(strbuf);
   }
 
-  // Query for failed() -- with threshold
+  // Query for failed() -- with threshold. Retry delay doubles at each failure
+  // (SET expressions see the old n_failures), then it is capped and jittered
   r = sqlite3_prepare_v2(db,
     "UPDATE queue SET"
     "  n_failures=n_failures+1,rank=?,is_staged=?,status=CASE"
     "    WHEN n_failures>=? THEN 'F'"
-    "    ELSE 'Q'"
-    "  END"
+    "    ELSE ?"
+    "  END,"
+    "  finished_at=?,enqueued_at=?,"
+    "  next_attempt_at=?+MIN(?,?*(1<<MIN(n_failures,?)))*?"
     "  WHERE main_url=?", -1, &query_failed_thr, NULL);
   if (r != SQLITE_OK) {
     snprintf(strbuf, AF_OPQUEUE_BUFSIZE,
@@ -241,7 +419,9 @@ opQueue::opQueue() :
   // Query for failed() -- without threshold
   r = sqlite3_prepare_v2(db,
     "UPDATE queue SET"
-    "  n_failures=n_failures+1,rank=?,is_staged=?,status='Q'"
+    "  n_failures=n_failures+1,rank=?,is_staged=?,status=?,"
+    "  finished_at=?,enqueued_at=?,"
+    "  next_attempt_at=?+MIN(?,?*(1<<MIN(n_failures,?)))*?"
     "  WHERE main_url=?", -1, &query_failed_nothr, NULL);
   if (r != SQLITE_OK) {
     snprintf(strbuf, AF_OPQUEUE_BUFSIZE,
@@ -250,6 +430,79 @@ opQueue::opQueue() :
     throw std::runtime_error(strbuf);
   }
 
+  // Query for requeue_due(): only due entries are visited, through the index
+  r = sqlite3_prepare_v2(db,
+    "UPDATE queue SET status='Q' WHERE status='W' AND next_attempt_at<=?",
+    -1, &query_requeue_due, NULL);
+  if (r != SQLITE_OK) {
+    snprintf(strbuf, AF_OPQUEUE_BUFSIZE,
+      "Error #%d while preparing query_requeue_due: %s\n", r,
+      sqlite3_errmsg(db));
+    throw std::runtime_error(strbuf);
+  }
+
+  // Query for add_owner(): entries already finished are counted at once
+  r = sqlite3_prepare_v2(db,
+    "INSERT INTO owners (ds_id,file_idx,main_url) VALUES (?,?,?)",
+    -1, &query_add_owner, NULL);
+  if (r != SQLITE_OK) {
+    snprintf(strbuf, AF_OPQUEUE_BUFSIZE,
+      "Error #%d while preparing query_add_owner: %s\n", r,
+      sqlite3_errmsg(db));
+    throw std::runtime_error(strbuf);
+  }
+
+  // Query for add_owner(): counts the new file in its dataset
+  r = sqlite3_prepare_v2(db,
+    "UPDATE datasets SET n_files=n_files+1,n_done=n_done+"
+    "  (SELECT COUNT(*) FROM queue WHERE main_url=? AND status IN ('D','F')) "
+    "  WHERE ds_id=?",
+    -1, &query_count_owner, NULL);
+  if (r != SQLITE_OK) {
+    snprintf(strbuf, AF_OPQUEUE_BUFSIZE,
+      "Error #%d while preparing query_count_owner: %s\n", r,
+      sqlite3_errmsg(db));
+    throw std::runtime_error(strbuf);
+  }
+
+  // Query for get_ready_datasets(): optionally, entries not finished but not
+  // running and failed at least once do not hold the dataset
+  r = sqlite3_prepare_v2(db,
+    "SELECT ds_id FROM datasets WHERE n_done>=n_files OR (?1 AND NOT EXISTS "
+    "  (SELECT 1 FROM owners JOIN queue USING (main_url) "
+    "  WHERE owners.ds_id=datasets.ds_id AND status NOT IN ('D','F') AND "
+    "  (status='R' OR n_failures=0))) "
+    "  ORDER BY ds_id ASC",
+    -1, &query_ready_datasets, NULL);
+  if (r != SQLITE_OK) {
+    snprintf(strbuf, AF_OPQUEUE_BUFSIZE,
+      "Error #%d while preparing query_ready_datasets: %s\n", r,
+      sqlite3_errmsg(db));
+    throw std::runtime_error(strbuf);
+  }
+
+  // Query for set_resources()
+  r = sqlite3_prepare_v2(db,
+    "UPDATE queue SET cpu_sec=?,max_rss_kib=?,read_bytes=? WHERE main_url=?",
+    -1, &query_set_resources, NULL);
+  if (r != SQLITE_OK) {
+    snprintf(strbuf, AF_OPQUEUE_BUFSIZE,
+      "Error #%d while preparing query_set_resources: %s\n", r,
+      sqlite3_errmsg(db));
+    throw std::runtime_error(strbuf);
+  }
+
+  // Query for set_instance_id()
+  r = sqlite3_prepare_v2(db,
+    "UPDATE queue SET instance_id=? WHERE main_url=?",
+    -1, &query_set_instance_id, NULL);
+  if (r != SQLITE_OK) {
+    snprintf(strbuf, AF_OPQUEUE_BUFSIZE,
+      "Error #%d while preparing query_set_instance_id: %s\n", r,
+      sqlite3_errmsg(db));
+    throw std::runtime_error(strbuf);
+  }
+
   // Query for summary() -- without threshold
   r = sqlite3_prepare_v2(db,
     "SELECT COUNT(*),status FROM queue GROUP BY status",
@@ -367,8 +620,16 @@ bool opQueue::set_status(const char *url, qstat_t qstat) {
 
   if (!url) return false;
 
-  snprintf(strbuf, AF_OPQUEUE_BUFSIZE,
-    "UPDATE queue SET status='%c' WHERE main_url='%s'", qstat, url);
+  // Entries turning to "running" get their start time
+  if (qstat == qstat_running) {
+    snprintf(strbuf, AF_OPQUEUE_BUFSIZE,
+      "UPDATE queue SET status='%c',started_at=%.6lf WHERE main_url='%s'",
+      qstat, now_sec(), url);
+  }
+  else {
+    snprintf(strbuf, AF_OPQUEUE_BUFSIZE,
+      "UPDATE queue SET status='%c' WHERE main_url='%s'", qstat, url);
+  }
 
   int r = sqlite3_exec(db, strbuf, NULL, NULL, &sql_err);
 
@@ -382,44 +643,84 @@ bool opQueue::set_status(const char *url, qstat_t qstat) {
   return true;
 }
 
+/** Sets the instance id of the given URL, e.g. to process it together with
+ *  other URLs under the same id. Returns true if the URL was found.
+ */
+bool opQueue::set_instance_id(const char *url, unsigned int iid) {
+
+  if (!url) return false;
+
+  sqlite3_reset(query_set_instance_id);
+  sqlite3_bind_int64(query_set_instance_id, 1, iid);
+  sqlite3_bind_text(query_set_instance_id, 2, url, -1, SQLITE_STATIC);
+
+  if (sqlite3_step(query_set_instance_id) != SQLITE_DONE) {
+    snprintf(strbuf, AF_OPQUEUE_BUFSIZE, "Error in SQL UPDATE query: %s\n",
+      sqlite3_errmsg(db));
+    throw std::runtime_error(strbuf);
+  }
+
+  return (sqlite3_changes(db) == 1);
+}
+
+/** Returns a new instance id, never given to any entry: used to process
+ *  several URLs together under the same id. See set_instance_id().
+ */
+unsigned int opQueue::new_instance_id() {
+  return AF_OPQUEUE_NEXT_UIID();
+}
+
 /** Manages failed operations on the given URL: increments the failure counter
  *  and places the URL at the end of the queue (biggest rank), and if the number
  *  of failures is above threshold, sets the status to failed (F). Everything is
  *  done in a single UPDATE SQL query for efficiency reasons. It returns true on
  *  success, false on failure. Since a file may be corrupted but still staged,
  *  you can flag it as such by setting to true the optional parameter is_staged.
+ *
+ *  If a backoff is set (see set_backoff()), entries to be retried are delayed
+ *  (W) instead of queued: the delay doubles at every failure up to a maximum,
+ *  and it is randomly shortened by up to one half to spread the retries of
+ *  files failed together. Delayed entries are queued again by requeue_due().
  */
 bool opQueue::failed(const char *url, bool is_staged) {
 
   if (!url) return false;
 
   int r;
+  double now = now_sec();  // failed entries are enqueued again
+  double jitter = 0.5 + 0.5 * rand() / ((double)RAND_MAX + 1.);
+  char retry_str[2] = { (backoff_base_sec > 0.) ? (char)qstat_delayed :
+    (char)qstat_queue, '\0' };
+  sqlite3_stmt *q;
+  int i = 1;
 
   if (fail_threshold != 0) {
-
-    sqlite3_reset(query_failed_thr);
-    sqlite3_clear_bindings(query_failed_thr);
-
-    sqlite3_bind_int64(query_failed_thr, 1, ++last_queue_rowid);
-    sqlite3_bind_int64(query_failed_thr, 2, is_staged);
-    sqlite3_bind_int64(query_failed_thr, 3, fail_threshold-1);
-    sqlite3_bind_text(query_failed_thr, 4, url, -1, SQLITE_STATIC);
-
-    r = sqlite3_step(query_failed_thr);
-
+    q = query_failed_thr;
+    sqlite3_reset(q);
+    sqlite3_clear_bindings(q);
+    sqlite3_bind_int64(q, i++, ++last_queue_rowid);
+    sqlite3_bind_int64(q, i++, is_staged);
+    sqlite3_bind_int64(q, i++, fail_threshold-1);
   }
   else {
+    q = query_failed_nothr;
+    sqlite3_reset(q);
+    sqlite3_clear_bindings(q);
+    sqlite3_bind_int64(q, i++, ++last_queue_rowid);
+    sqlite3_bind_int64(q, i++, is_staged);
+  }
 
-    sqlite3_reset(query_failed_nothr);
-    sqlite3_clear_bindings(query_failed_nothr);
-
-    sqlite3_bind_int64(query_failed_nothr, 1, ++last_queue_rowid);
-    sqlite3_bind_int64(query_failed_nothr, 2, is_staged);
-    sqlite3_bind_text(query_failed_nothr, 3, url, -1, SQLITE_STATIC);
-
-    r = sqlite3_step(query_failed_nothr);
+  sqlite3_bind_text(q, i++, retry_str, -1, SQLITE_TRANSIENT);
+  sqlite3_bind_double(q, i++, now);
+  sqlite3_bind_double(q, i++, now);
+  sqlite3_bind_double(q, i++, now);
+  sqlite3_bind_double(q, i++, backoff_max_sec);
+  sqlite3_bind_double(q, i++, backoff_base_sec);
+  sqlite3_bind_int(q, i++, AF_OPQUEUE_BACKOFF_MAXSHIFT);
+  sqlite3_bind_double(q, i++, jitter);
+  sqlite3_bind_text(q, i++, url, -1, SQLITE_STATIC);
 
-  }
+  r = sqlite3_step(q);
 
   if (r != SQLITE_DONE) {
     snprintf(strbuf, AF_OPQUEUE_BUFSIZE, "Error in SQL UPDATE query: %s\n",
@@ -432,6 +733,23 @@ bool opQueue::failed(const char *url, bool is_staged) {
   return false;
 }
 
+/** Queues again the delayed entries whose retry time has come, keeping their
+ *  rank. Returns the number of entries queued.
+ */
+unsigned int opQueue::requeue_due() {
+
+  sqlite3_reset(query_requeue_due);
+  sqlite3_bind_double(query_requeue_due, 1, now_sec());
+
+  if (sqlite3_step(query_requeue_due) != SQLITE_DONE) {
+    snprintf(strbuf, AF_OPQUEUE_BUFSIZE, "Error in SQL UPDATE query: %s\n",
+      sqlite3_errmsg(db));
+    throw std::runtime_error(strbuf);
+  }
+
+  return (unsigned int)sqlite3_changes(db);
+}
+
 /** Manages successfully completed operations on the given URL: the only
  *  required argument is the original enqueued URL of the file; optional
  *  parameters, which may also be NULL (or zero for numbers), are the endpoint
@@ -439,7 +757,8 @@ bool opQueue::failed(const char *url, bool is_staged) {
  *  size in bytes.
  */
 bool opQueue::success(const char *main_url, const char *endp_url,
-  const char *tree_name, unsigned long n_events, unsigned long size_bytes) {
+  const char *tree_name, unsigned long n_events,
+  unsigned long long size_bytes) {
 
   if (!main_url) return false;
 
@@ -451,7 +770,8 @@ bool opQueue::success(const char *main_url, const char *endp_url,
   sqlite3_bind_text(query_success, 2, tree_name, -1, SQLITE_STATIC);
   sqlite3_bind_int64(query_success, 3, n_events);
   sqlite3_bind_int64(query_success, 4, size_bytes);
-  sqlite3_bind_text(query_success, 5, main_url, -1, SQLITE_STATIC);
+  sqlite3_bind_double(query_success, 5, now_sec());
+  sqlite3_bind_text(query_success, 6, main_url, -1, SQLITE_STATIC);
 
   int r = sqlite3_step(query_success);
 
@@ -466,24 +786,70 @@ bool opQueue::success(const char *main_url, const char *endp_url,
   return false;
 }
 
+/** Records the resources used by the last command run on the given URL: CPU
+ *  time (user plus system), maximum resident memory and bytes read. Returns
+ *  true on success, false if the URL was not found.
+ */
+bool opQueue::set_resources(const char *url, double cpu_sec,
+  unsigned long max_rss_kib, unsigned long long read_bytes) {
+
+  if (!url) return false;
+
+  sqlite3_reset(query_set_resources);
+  sqlite3_clear_bindings(query_set_resources);
+
+  sqlite3_bind_double(query_set_resources, 1, cpu_sec);
+  sqlite3_bind_int64(query_set_resources, 2, max_rss_kib);
+  sqlite3_bind_int64(query_set_resources, 3, read_bytes);
+  sqlite3_bind_text(query_set_resources, 4, url, -1, SQLITE_STATIC);
+
+  int r = sqlite3_step(query_set_resources);
+
+  if (r != SQLITE_DONE) {
+    // Generic error: exception is thrown (should never happen!)
+    snprintf(strbuf, AF_OPQUEUE_BUFSIZE, "Error #%d in SQL UPDATE query: %s",
+      r, sqlite3_errmsg(db));
+    throw std::runtime_error(strbuf);
+  }
+
+  if (sqlite3_changes(db) == 1) return true;
+  return false;
+}
+
 /** Queue destructor: it closes the connection to the opened SQLite db.
  */
 opQueue::~opQueue() {
   sqlite3_finalize(query_get_full_entry);
   sqlite3_finalize(query_get_status);
   sqlite3_finalize(query_by_status_limited);
+  sqlite3_finalize(query_by_status_host_limited);
+  sqlite3_finalize(query_by_status_share_limited);
+  sqlite3_finalize(query_next_endp_host);
+  sqlite3_finalize(query_next_share);
   sqlite3_finalize(query_cond_insert);
   sqlite3_finalize(query_success);
   sqlite3_finalize(query_failed_thr);
   sqlite3_finalize(query_failed_nothr);
+  sqlite3_finalize(query_requeue_due);
+  sqlite3_finalize(query_add_owner);
+  sqlite3_finalize(query_count_owner);
+  sqlite3_finalize(query_ready_datasets);
+  sqlite3_finalize(query_by_dataset);
   sqlite3_finalize(query_summary);
+  sqlite3_finalize(query_set_resources);
+  sqlite3_finalize(query_set_instance_id);
   sqlite3_close(db);
 }
 
-/** Enqueue URL associating an unique "instance id" to it.
+/** Enqueue URL associating an unique "instance id" to it. The storage endpoint
+ *  (host and port) the URL points to, the fair share group and the priority
+ *  can be given to select entries per endpoint and share: see
+ *  init_query_by_status(). The expected size of the file, if known, can be
+ *  given as well. If the URL is already in queue, they are unchanged.
  */
 const queueEntry *opQueue::cond_insert(const char *url, const char *treename,
-  unsigned int *iid_ptr, unsigned short flags) {
+  unsigned int *iid_ptr, unsigned short flags, const char *endp_host,
+  const char *share, int priority, unsigned long long expected_bytes) {
 
   AF_OPQUEUE_NEXT_UIID();
 
@@ -494,6 +860,13 @@ const queueEntry *opQueue::cond_insert(const char *url, const char *treename,
   sqlite3_bind_text(query_cond_insert, 2, treename, -1, SQLITE_STATIC);
   sqlite3_bind_int64(query_cond_insert, 3, unique_instance_id);
   sqlite3_bind_int(query_cond_insert, 4, flags);
+  sqlite3_bind_double(query_cond_insert, 5, now_sec());
+  sqlite3_bind_text(query_cond_insert, 6, endp_host ? endp_host : "", -1,
+    SQLITE_STATIC);
+  sqlite3_bind_text(query_cond_insert, 7, share ? share : "", -1,
+    SQLITE_STATIC);
+  sqlite3_bind_int(query_cond_insert, 8, priority);
+  sqlite3_bind_int64(query_cond_insert, 9, expected_bytes);
 
   int r = sqlite3_step(query_cond_insert);
 
@@ -596,7 +969,10 @@ const queueEntry *opQueue::get_full_entry(const char *url) {
   // See http://www.sqlite.org/c3ref/c_abort.html for SQLite3 constants
   if (r == SQLITE_ROW) {
     // 0:main_url, 1:endp_url, 2:tree_name, 3:n_events, 4:n_failures,
-    // 5:size_bytes, 6:status, 7:instance_id, 8:is_staged, 9:flags
+    // 5:size_bytes, 6:status, 7:instance_id, 8:is_staged, 9:flags,
+    // 10:cpu_sec, 11:max_rss_kib, 12:read_bytes, 13:enqueued_at,
+    // 14:started_at, 15:finished_at, 16:priority, 17:share,
+    // 18:next_attempt_at, 19:expected_bytes
 
     qentry_buf.set_main_url(
       (char*)sqlite3_column_text(query_get_full_entry, 0) );
@@ -615,6 +991,20 @@ const queueEntry *opQueue::get_full_entry(const char *url) {
       (bool)sqlite3_column_int(query_get_full_entry, 8) );
     qentry_buf.set_flags(
       (unsigned short)sqlite3_column_int(query_get_full_entry, 9) );
+    qentry_buf.set_cpu_sec( sqlite3_column_double(query_get_full_entry, 10) );
+    qentry_buf.set_max_rss_kib(
+      sqlite3_column_int64(query_get_full_entry, 11) );
+    qentry_buf.set_read_bytes( sqlite3_column_int64(query_get_full_entry, 12) );
+    qentry_buf.set_times( sqlite3_column_double(query_get_full_entry, 13),
+      sqlite3_column_double(query_get_full_entry, 14),
+      sqlite3_column_double(query_get_full_entry, 15) );
+    qentry_buf.set_priority( sqlite3_column_int(query_get_full_entry, 16) );
+    qentry_buf.set_share(
+      (char*)sqlite3_column_text(query_get_full_entry, 17) );
+    qentry_buf.set_next_attempt_at(
+      sqlite3_column_double(query_get_full_entry, 18) );
+    qentry_buf.set_expected_bytes(
+      sqlite3_column_int64(query_get_full_entry, 19) );
 
     return &qentry_buf;
   }
@@ -625,17 +1015,21 @@ const queueEntry *opQueue::get_full_entry(const char *url) {
 /** Initializes a query by status. This is the first function to call in a
  *  three-steps mechanism illustrated in the following example:
  *
- *  init_query_by_status(<qstat>, [limit]);
+ *  init_query_by_status(<qstat>, [limit], [endp_host], [share]);
  *  while (entry = next_query_by_status() { ... }
  *  free_query_by_status();
  *
  *  Query output is ordered by rank (lowest rank items are returned before
  *  highest rank items) and can be optionally limited. A value of limit of 0 or
- *  a negative value means no limits (default).
+ *  a negative value means no limits (default). If endp_host is given, only
+ *  entries enqueued with that storage endpoint are returned. If share is given
+ *  too, only entries of that share on that endpoint are returned, by
+ *  descending priority first.
  *
  *  This function never fails.
  */
-void opQueue::init_query_by_status(qstat_t qstat, long limit) {
+void opQueue::init_query_by_status(qstat_t qstat, long limit,
+  const char *endp_host, const char *share) {
 
   free_query_by_status();  // We can never tell... it's harmless in the WCS
 
@@ -646,8 +1040,26 @@ void opQueue::init_query_by_status(qstat_t qstat, long limit) {
   qstat_str[0] = (char)qstat;  // qstat_str[1] inited in ctor
 
   // See http://www.sqlite.org/c3ref/bind_blob.html: indexes start from 1
-  sqlite3_bind_text(query_by_status_limited, 1, qstat_str, -1, SQLITE_STATIC);
-  sqlite3_bind_int64(query_by_status_limited, 2, limit);
+  if ((endp_host) && (share)) {
+    query_by_status_cur = query_by_status_share_limited;
+    sqlite3_bind_text(query_by_status_cur, 1, qstat_str, -1, SQLITE_STATIC);
+    sqlite3_bind_text(query_by_status_cur, 2, endp_host, -1,
+      SQLITE_TRANSIENT);
+    sqlite3_bind_text(query_by_status_cur, 3, share, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(query_by_status_cur, 4, limit);
+  }
+  else if (endp_host) {
+    query_by_status_cur = query_by_status_host_limited;
+    sqlite3_bind_text(query_by_status_cur, 1, qstat_str, -1, SQLITE_STATIC);
+    sqlite3_bind_text(query_by_status_cur, 2, endp_host, -1,
+      SQLITE_TRANSIENT);
+    sqlite3_bind_int64(query_by_status_cur, 3, limit);
+  }
+  else {
+    query_by_status_cur = query_by_status_limited;
+    sqlite3_bind_text(query_by_status_cur, 1, qstat_str, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(query_by_status_cur, 2, limit);
+  }
 
 }
 
@@ -656,52 +1068,285 @@ void opQueue::init_query_by_status(qstat_t qstat, long limit) {
  */
 const queueEntry *opQueue::next_query_by_status() {
 
-  int r = sqlite3_step(query_by_status_limited);
+  int r = sqlite3_step(query_by_status_cur);
   if (r != SQLITE_ROW) return NULL;
 
   // 0:main_url, 1:endp_url, 2:tree_name, 3:n_events, 4:n_failures,
-  // 5:size_bytes, 6:status, 7:instance_id, 8:is_staged, 9:flags
+  // 5:size_bytes, 6:status, 7:instance_id, 8:is_staged, 9:flags,
+  // 10:cpu_sec, 11:max_rss_kib, 12:read_bytes, 13:enqueued_at,
+  // 14:started_at, 15:finished_at, 16:priority, 17:share,
+  // 18:next_attempt_at, 19:expected_bytes
 
   //qentry_buf.reset(); --> not needed
   qentry_buf.set_main_url(
-    (const char *)sqlite3_column_text(query_by_status_limited, 0) );
+    (const char *)sqlite3_column_text(query_by_status_cur, 0) );
   qentry_buf.set_endp_url(
-    (const char*)sqlite3_column_text(query_by_status_limited, 1) );
+    (const char*)sqlite3_column_text(query_by_status_cur, 1) );
   qentry_buf.set_tree_name(
-    (const char *)sqlite3_column_text(query_by_status_limited, 2) );
-  qentry_buf.set_n_events( sqlite3_column_int64(query_by_status_limited, 3) );
-  qentry_buf.set_n_failures( sqlite3_column_int64(query_by_status_limited, 4) );
-  qentry_buf.set_size_bytes( sqlite3_column_int64(query_by_status_limited, 5) );
+    (const char *)sqlite3_column_text(query_by_status_cur, 2) );
+  qentry_buf.set_n_events( sqlite3_column_int64(query_by_status_cur, 3) );
+  qentry_buf.set_n_failures( sqlite3_column_int64(query_by_status_cur, 4) );
+  qentry_buf.set_size_bytes( sqlite3_column_int64(query_by_status_cur, 5) );
   qentry_buf.set_status(
-    (qstat_t)*sqlite3_column_text(query_by_status_limited, 6) );
+    (qstat_t)*sqlite3_column_text(query_by_status_cur, 6) );
   qentry_buf.set_instance_id(
-    sqlite3_column_int64(query_by_status_limited, 7) );
+    sqlite3_column_int64(query_by_status_cur, 7) );
   qentry_buf.set_staged(
-    (bool)sqlite3_column_int(query_by_status_limited, 8) );
+    (bool)sqlite3_column_int(query_by_status_cur, 8) );
   qentry_buf.set_flags(
-    (unsigned short)sqlite3_column_int(query_by_status_limited, 9) );
+    (unsigned short)sqlite3_column_int(query_by_status_cur, 9) );
+  qentry_buf.set_cpu_sec( sqlite3_column_double(query_by_status_cur, 10) );
+  qentry_buf.set_max_rss_kib(
+    sqlite3_column_int64(query_by_status_cur, 11) );
+  qentry_buf.set_read_bytes(
+    sqlite3_column_int64(query_by_status_cur, 12) );
+  qentry_buf.set_times( sqlite3_column_double(query_by_status_cur, 13),
+    sqlite3_column_double(query_by_status_cur, 14),
+    sqlite3_column_double(query_by_status_cur, 15) );
+  qentry_buf.set_priority( sqlite3_column_int(query_by_status_cur, 16) );
+  qentry_buf.set_share(
+    (const char *)sqlite3_column_text(query_by_status_cur, 17) );
+  qentry_buf.set_next_attempt_at(
+    sqlite3_column_double(query_by_status_cur, 18) );
+  qentry_buf.set_expected_bytes(
+    sqlite3_column_int64(query_by_status_cur, 19) );
 
   return &qentry_buf;
 }
 
+/** Returns the current time in seconds since the Epoch, as stored in the
+ *  timestamps of the entries.
+ */
+double opQueue::now_sec() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (double)tv.tv_sec + (double)tv.tv_usec * 1e-6;
+}
+
 /** Frees the resources used by the current query by status. This function never
  *  fails, and it is harmless if called twice. See init_query_by_status() for
  *  more information.
  */
 void opQueue::free_query_by_status() {
-  sqlite3_reset(query_by_status_limited);
-  sqlite3_clear_bindings(query_by_status_limited);
+  if (!query_by_status_cur) return;
+  sqlite3_reset(query_by_status_cur);
+  sqlite3_clear_bindings(query_by_status_cur);
+  query_by_status_cur = NULL;
+}
+
+/** Fills the given list with the storage endpoints of the entries with the
+ *  given status, in order of their first entry (lowest rank first). Each
+ *  endpoint costs a single index lookup, regardless of its number of entries.
+ */
+void opQueue::get_endp_hosts(qstat_t qstat, std::vector<std::string> &hosts) {
+
+  std::vector< std::pair<long long, std::string> > found;
+  char qstat_buf[2] = { (char)qstat, '\0' };
+  std::string bound;  // empty: the smallest possible
+
+  sqlite3_bind_text(query_next_endp_host, 1, qstat_buf, -1, SQLITE_STATIC);
+
+  while (true) {
+
+    sqlite3_bind_text(query_next_endp_host, 2, bound.c_str(), -1,
+      SQLITE_TRANSIENT);
+    if (sqlite3_step(query_next_endp_host) != SQLITE_ROW) break;
+
+    bound = (const char *)sqlite3_column_text(query_next_endp_host, 0);
+    found.push_back( std::make_pair(
+      (long long)sqlite3_column_int64(query_next_endp_host, 1), bound) );
+    sqlite3_reset(query_next_endp_host);
+
+    // Nothing can sort between a string and the same string followed by \x01
+    bound += '\x01';
+  }
+
+  sqlite3_reset(query_next_endp_host);
+  sqlite3_clear_bindings(query_next_endp_host);
+
+  std::sort(found.begin(), found.end());
+  hosts.clear();
+  for (size_t i=0; i<found.size(); i++) hosts.push_back(found[i].second);
+
+}
+
+/** Fills the given list with the fair share groups having entries with the
+ *  given status on the given endpoint, in alphabetical order. Each share costs
+ *  a single index lookup, regardless of its number of entries.
+ */
+void opQueue::get_shares(qstat_t qstat, const char *endp_host,
+  std::vector<std::string> &shares) {
+
+  char qstat_buf[2] = { (char)qstat, '\0' };
+  std::string bound;  // empty: the smallest possible
+
+  shares.clear();
+
+  sqlite3_bind_text(query_next_share, 1, qstat_buf, -1, SQLITE_STATIC);
+  sqlite3_bind_text(query_next_share, 2, endp_host ? endp_host : "", -1,
+    SQLITE_TRANSIENT);
+
+  while (true) {
+
+    sqlite3_bind_text(query_next_share, 3, bound.c_str(), -1,
+      SQLITE_TRANSIENT);
+    if (sqlite3_step(query_next_share) != SQLITE_ROW) break;
+
+    bound = (const char *)sqlite3_column_text(query_next_share, 0);
+    shares.push_back(bound);
+    sqlite3_reset(query_next_share);
+
+    // See get_endp_hosts()
+    bound += '\x01';
+  }
+
+  sqlite3_reset(query_next_share);
+  sqlite3_clear_bindings(query_next_share);
+
+}
+
+/** Registers a new dataset owning entries, and returns its identifier. See
+ *  add_owner().
+ */
+unsigned int opQueue::add_dataset() {
+
+  last_ds_id++;
+  snprintf(strbuf, AF_OPQUEUE_BUFSIZE,
+    "INSERT INTO datasets (ds_id) VALUES (%u)", last_ds_id);
+
+  int r = sqlite3_exec(db, strbuf, NULL, NULL, &sql_err);
+
+  if (r != SQLITE_OK) {
+    snprintf(strbuf, AF_OPQUEUE_BUFSIZE, "Error in SQL INSERT query: %s\n",
+      sql_err);
+    sqlite3_free(sql_err);
+    throw std::runtime_error(strbuf);
+  }
+
+  return last_ds_id;
+}
+
+/** Records that the given URL is the file at the given position of the given
+ *  dataset (see add_dataset()). The same URL may belong to several datasets,
+ *  or to the same dataset more than once. The dataset is ready as soon as all
+ *  of its entries are finished, successfully or not: see get_ready_datasets().
+ */
+bool opQueue::add_owner(const char *url, unsigned int ds_id,
+  unsigned int file_idx) {
+
+  if (!url) return false;
+
+  sqlite3_reset(query_add_owner);
+  sqlite3_bind_int64(query_add_owner, 1, ds_id);
+  sqlite3_bind_int64(query_add_owner, 2, file_idx);
+  sqlite3_bind_text(query_add_owner, 3, url, -1, SQLITE_STATIC);
+
+  if (sqlite3_step(query_add_owner) != SQLITE_DONE) {
+    snprintf(strbuf, AF_OPQUEUE_BUFSIZE, "Error in SQL INSERT query: %s\n",
+      sqlite3_errmsg(db));
+    throw std::runtime_error(strbuf);
+  }
+
+  sqlite3_reset(query_count_owner);
+  sqlite3_bind_text(query_count_owner, 1, url, -1, SQLITE_STATIC);
+  sqlite3_bind_int64(query_count_owner, 2, ds_id);
+
+  if (sqlite3_step(query_count_owner) != SQLITE_DONE) {
+    snprintf(strbuf, AF_OPQUEUE_BUFSIZE, "Error in SQL UPDATE query: %s\n",
+      sqlite3_errmsg(db));
+    throw std::runtime_error(strbuf);
+  }
+
+  return (sqlite3_changes(db) == 1);
+}
+
+/** Fills the given vector with the identifiers of the datasets whose entries
+ *  are all finished, in order of registration. If failed_once is true, entries
+ *  waiting for a retry after having failed at least once are considered as
+ *  finished too: useful when failures are retried forever.
+ */
+void opQueue::get_ready_datasets(std::vector<unsigned int> &ds_ids,
+  bool failed_once) {
+
+  ds_ids.clear();
+  sqlite3_bind_int(query_ready_datasets, 1, failed_once);
+
+  while (sqlite3_step(query_ready_datasets) == SQLITE_ROW) {
+    ds_ids.push_back(
+      (unsigned int)sqlite3_column_int64(query_ready_datasets, 0) );
+  }
+
+  sqlite3_reset(query_ready_datasets);
+
+}
+
+/** Forgets the given dataset: its entries are removed from queue, whatever
+ *  their status, unless they are owned by other datasets too. Returns the
+ *  number of entries removed.
+ */
+unsigned int opQueue::remove_dataset(unsigned int ds_id) {
+
+  snprintf(strbuf, AF_OPQUEUE_BUFSIZE,
+    "DELETE FROM datasets WHERE ds_id=%u;"
+    "DELETE FROM queue WHERE main_url IN "
+    "  (SELECT main_url FROM owners WHERE ds_id=%u) AND NOT EXISTS "
+    "  (SELECT 1 FROM owners AS o WHERE o.main_url=queue.main_url AND "
+    "  o.ds_id<>%u)", ds_id, ds_id, ds_id);
+
+  int r = sqlite3_exec(db, strbuf, NULL, NULL, &sql_err);
+  unsigned int n_removed = sqlite3_changes(db);
+
+  if (r == SQLITE_OK) {
+    snprintf(strbuf, AF_OPQUEUE_BUFSIZE,
+      "DELETE FROM owners WHERE ds_id=%u", ds_id);
+    r = sqlite3_exec(db, strbuf, NULL, NULL, &sql_err);
+  }
+
+  if (r != SQLITE_OK) {
+    snprintf(strbuf, AF_OPQUEUE_BUFSIZE, "Error in SQL DELETE query: %s\n",
+      sql_err);
+    sqlite3_free(sql_err);
+    throw std::runtime_error(strbuf);
+  }
+
+  return n_removed;
+}
+
+/** Initializes a query returning the finished entries of the given dataset,
+ *  in order of position in the dataset: see next_query_by_dataset(). Resources
+ *  are freed with free_query_by_status().
+ */
+void opQueue::init_query_by_dataset(unsigned int ds_id) {
+  free_query_by_status();
+  query_by_status_cur = query_by_dataset;
+  sqlite3_bind_int64(query_by_status_cur, 1, ds_id);
+}
+
+/** Returns the next finished entry of the dataset given to
+ *  init_query_by_dataset(), and its position in the dataset at the given
+ *  reference, or NULL when no more rows are available.
+ */
+const queueEntry *opQueue::next_query_by_dataset(unsigned int &file_idx) {
+  const queueEntry *qent = next_query_by_status();
+  if (qent) {
+    // Position follows the columns of the entry: see next_query_by_status()
+    file_idx = (unsigned int)sqlite3_column_int64(query_by_status_cur, 20);
+  }
+  return qent;
 }
 
-/** Returns at the given references the number of elements divided by status.
+/** Returns at the given references the number of elements divided by status:
+ *  delayed entries are counted as queued. If n_eligible is given, it is set to
+ *  the number of queued entries which can be started now (i.e., not delayed).
  */
 void opQueue::summary(unsigned int &n_queued, unsigned int &n_runn,
-  unsigned int &n_success, unsigned int &n_fail) {
+  unsigned int &n_success, unsigned int &n_fail, unsigned int *n_eligible) {
 
   n_queued = 0;
   n_runn = 0;
   n_success = 0;
   n_fail = 0;
+  if (n_eligible) *n_eligible = 0;
 
   int r;
 
@@ -711,7 +1356,11 @@ void opQueue::summary(unsigned int &n_queued, unsigned int &n_runn,
     qstat_t status = (qstat_t)*sqlite3_column_text(query_summary, 1);
 
     switch (status) {
-      case qstat_queue:   n_queued = count;  break;
+      case qstat_queue:
+        n_queued += count;
+        if (n_eligible) *n_eligible = count;
+      break;
+      case qstat_delayed: n_queued += count; break;
       case qstat_running: n_runn = count;    break;
       case qstat_success: n_success = count; break;
       case qstat_failed:  n_fail = count;    break;
@@ -6,6 +6,10 @@
  * A queue that holds the files to be processed with their status. It is
  * implemented as a SQLite database for holding large amounts of data without
  * eating up the memory.
+ *
+ * Entries can be owned by one or more datasets: the number of finished entries
+ * of each dataset is kept up to date by the database itself, so that datasets
+ * whose entries are all finished can be found without looking at each entry.
  */
 
 #ifndef AFOPQUEUE_H
@@ -16,16 +20,21 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/time.h>
 
 #include "sqlite3.h"
 
 #include <stdexcept>
 #include <limits>
 #include <bitset>
+#include <string>
+#include <vector>
+#include <algorithm>
 
 #define AF_NULL_STR(STR) ((STR) ? (STR) : "#null#")
 #define AF_OPQUEUE_BUFSIZE 1000
 #define AF_OPQUEUE_MAXROWS ( std::numeric_limits<long>::max() )
+#define AF_OPQUEUE_BACKOFF_MAXSHIFT 20
 #define AF_OPQUEUE_NEXT_UIID() \
   ( (++unique_instance_id == 0) ? ++unique_instance_id : unique_instance_id  )
 #define AF_OPQUEUE_PREV_UIID() \
@@ -36,7 +45,8 @@ namespace af {
   typedef enum { qstat_queue   = 'Q',
                  qstat_running = 'R',
                  qstat_success = 'D',
-                 qstat_failed  = 'F' } qstat_t;
+                 qstat_failed  = 'F',
+                 qstat_delayed = 'W' } qstat_t;  // waiting to be retried
 
   /** In-memory representation of an entry of the opQueue. It can own its
    *  members or not.
@@ -49,7 +59,7 @@ namespace af {
       queueEntry(bool _own);
       queueEntry(const char *_main_url, const char *_endp_url,
         const char *_tree_name, unsigned long _n_events,
-        unsigned int _n_failures, unsigned long _size_bytes, bool _own,
+        unsigned int _n_failures, unsigned long long _size_bytes, bool _own,
         bool _staged);
       virtual ~queueEntry();
     
@@ -59,13 +69,25 @@ namespace af {
       inline const char *get_tree_name() const { return tree_name; };
       inline unsigned long get_n_events() const { return n_events; };
       inline unsigned int get_n_failures() const { return n_failures; };
-      inline unsigned long get_size_bytes() const { return size_bytes; };
+      inline unsigned long long get_size_bytes() const { return size_bytes; };
       inline unsigned int get_instance_id() const { return uiid; };
       inline qstat_t get_status() const { return status; };
       inline bool is_staged() const { return staged; }
       inline unsigned long get_flags() const {
         return (unsigned short)flags.to_ulong(); }
       inline bool get_flag(size_t pos) const { return flags.test(pos); }
+      inline double get_cpu_sec() const { return cpu_sec; };
+      inline unsigned long get_max_rss_kib() const { return max_rss_kib; };
+      inline unsigned long long get_read_bytes() const { return read_bytes; };
+      inline double get_enqueued_at() const { return enqueued_at; };
+      inline double get_started_at() const { return started_at; };
+      inline double get_finished_at() const { return finished_at; };
+      inline double get_next_attempt_at() const { return next_attempt_at; };
+      inline unsigned long long get_expected_bytes() const {
+        return expected_bytes;
+      };
+      inline int get_priority() const { return priority; };
+      inline const char *get_share() const { return share; };
 
       // Setters
       inline void set_main_url(const char *_main_url);
@@ -76,7 +98,7 @@ namespace af {
       inline void set_n_failures(unsigned int _n_failures) {
         n_failures = _n_failures;
       };
-      inline void set_size_bytes(unsigned long _size_bytes) {
+      inline void set_size_bytes(unsigned long long _size_bytes) {
         size_bytes = _size_bytes;
       };
       inline void set_instance_id(unsigned int _uiid) { uiid = _uiid; };
@@ -85,6 +107,27 @@ namespace af {
       inline void set_flag(size_t pos, bool val = true) {
         flags.set(pos, val); };
       inline void set_flags(unsigned short _flags) { flags = _flags; };
+      inline void set_cpu_sec(double _cpu_sec) { cpu_sec = _cpu_sec; };
+      inline void set_max_rss_kib(unsigned long _max_rss_kib) {
+        max_rss_kib = _max_rss_kib;
+      };
+      inline void set_read_bytes(unsigned long long _read_bytes) {
+        read_bytes = _read_bytes;
+      };
+      inline void set_priority(int _priority) { priority = _priority; };
+      inline void set_share(const char *_share);
+      inline void set_times(double _enqueued_at, double _started_at,
+        double _finished_at) {
+        enqueued_at = _enqueued_at;
+        started_at = _started_at;
+        finished_at = _finished_at;
+      };
+      inline void set_next_attempt_at(double _next_attempt_at) {
+        next_attempt_at = _next_attempt_at;
+      };
+      inline void set_expected_bytes(unsigned long long _expected_bytes) {
+        expected_bytes = _expected_bytes;
+      };
 
       void print() const;
       void reset();
@@ -99,11 +142,21 @@ namespace af {
       char *tree_name;
       unsigned long n_events;
       unsigned int n_failures;
-      unsigned long size_bytes;
+      unsigned long long size_bytes;
       unsigned int uiid;
       qstat_t status;
       bool staged;
       std::bitset<8> flags;
+      double cpu_sec;
+      unsigned long max_rss_kib;
+      unsigned long long read_bytes;
+      double enqueued_at;  // timestamps: seconds since the Epoch, 0 if unset
+      double started_at;
+      double finished_at;
+      double next_attempt_at;  // retries not started before
+      unsigned long long expected_bytes;  // size known before staging, or 0
+      int priority;  // higher first
+      char *share;   // fair share group, e.g. "/group/user"
 
   };
 
@@ -118,21 +171,35 @@ namespace af {
 
       const queueEntry *cond_insert(const char *url,
         const char *treename = NULL, unsigned int *iid_ptr = NULL,
-        unsigned short flags = 0x0);
+        unsigned short flags = 0x0, const char *endp_host = NULL,
+        const char *share = NULL, int priority = 0,
+        unsigned long long expected_bytes = 0);
 
       int flush();
       bool set_status(const char *url, qstat_t qstat);
+      bool set_instance_id(const char *url, unsigned int iid);
+      unsigned int new_instance_id();
       void set_max_failures(unsigned int max_failures) {
         fail_threshold = max_failures;
       };
+      void set_backoff(double base_sec, double max_sec) {
+        backoff_base_sec = (base_sec > 0.) ? base_sec : 0.;
+        backoff_max_sec = (max_sec > base_sec) ? max_sec : backoff_base_sec;
+      };
 
       bool failed(const char *url, bool is_staged = false);
+      unsigned int requeue_due();
       bool success(const char *main_url, const char *endp_url = NULL,
         const char *tree_name = NULL, unsigned long n_events = 0,
-        unsigned long size_bytes = 0);
+        unsigned long long size_bytes = 0);
+      bool set_resources(const char *url, double cpu_sec,
+        unsigned long max_rss_kib, unsigned long long read_bytes);
 
       void summary(unsigned int &n_queued, unsigned int &n_runn,
-        unsigned int &n_success, unsigned int &n_fail);
+        unsigned int &n_success, unsigned int &n_fail,
+        unsigned int *n_eligible = NULL);
+
+      static double now_sec();
 
       void arbitrary_query(const char *query);
       void dump(bool to_log = false);
@@ -142,10 +209,26 @@ namespace af {
       const queueEntry *get_cond_entry(const char *url);
 
       // Query by status triplet
-      void init_query_by_status(qstat_t qstat, long limit = 0);
+      void init_query_by_status(qstat_t qstat, long limit = 0,
+        const char *endp_host = NULL, const char *share = NULL);
       const queueEntry *next_query_by_status();
       void free_query_by_status();
 
+      void get_endp_hosts(qstat_t qstat, std::vector<std::string> &hosts);
+      void get_shares(qstat_t qstat, const char *endp_host,
+        std::vector<std::string> &shares);
+
+      // Datasets owning the entries
+      unsigned int add_dataset();
+      bool add_owner(const char *url, unsigned int ds_id,
+        unsigned int file_idx);
+      void get_ready_datasets(std::vector<unsigned int> &ds_ids,
+        bool failed_once = false);
+      unsigned int remove_dataset(unsigned int ds_id);
+
+      // Query by dataset: finished entries only, freed by free_query_by_status
+      void init_query_by_dataset(unsigned int ds_id);
+      const queueEntry *next_query_by_dataset(unsigned int &file_idx);
 
     private:
 
@@ -155,7 +238,10 @@ namespace af {
       static int query_callback(void *, int argc, char *argv[], char **colname);
       unsigned long last_queue_rowid;
       unsigned int fail_threshold;
+      double backoff_base_sec;  // retry delay after the first failure
+      double backoff_max_sec;
       unsigned int unique_instance_id;
+      unsigned int last_ds_id;
 
       sqlite3_stmt *query_cond_insert;
       sqlite3_stmt *query_get_full_entry;
@@ -163,9 +249,22 @@ namespace af {
       sqlite3_stmt *query_success;
       sqlite3_stmt *query_failed_thr;
       sqlite3_stmt *query_failed_nothr;
+      sqlite3_stmt *query_requeue_due;
+      sqlite3_stmt *query_add_owner;
+      sqlite3_stmt *query_count_owner;
+      sqlite3_stmt *query_ready_datasets;
       sqlite3_stmt *query_summary;
+      sqlite3_stmt *query_set_resources;
+      sqlite3_stmt *query_set_instance_id;
+
+      sqlite3_stmt *query_next_endp_host;
+      sqlite3_stmt *query_next_share;
 
       sqlite3_stmt *query_by_status_limited;  // for query by status triplet
+      sqlite3_stmt *query_by_status_host_limited;
+      sqlite3_stmt *query_by_status_share_limited;
+      sqlite3_stmt *query_by_dataset;
+      sqlite3_stmt *query_by_status_cur;
       char qstat_str[2];
 
       queueEntry qentry_buf;
@@ -98,11 +98,141 @@ bool resMon::fetch_cpu_timing(res_timing_t &rt) {
 /** Gets value of an arbitrarily-started timer, in seconds. The chosen timer's
  *  absolute value is meaningless: relative values (i.e., differences) are to be
  *  considered. The selected timer is chosen to be resilient to system time
- *  modifications.
+ *  modifications. This function is declared as static.
  */
 double resMon::get_wall_sec() {
-  //clock_gettime(CLOCK_MONOTONIC, &buf_ts);
-  //return (double)buf_ts.tv_sec + (double)buf_ts.tv_nsec / 1000000000.;
-  gettimeofday(&buf_tv, 0);
-  return (double)buf_tv.tv_sec + (double)buf_tv.tv_usec / 1000000.;
+  struct timespec buf_ts;
+  clock_gettime(CLOCK_MONOTONIC, &buf_ts);
+  return (double)buf_ts.tv_sec + (double)buf_ts.tv_nsec / 1000000000.;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Member functions for the af::phaseHist class
+////////////////////////////////////////////////////////////////////////////////
+
+/** Constructor: empty histogram.
+ */
+phaseHist::phaseHist() : count(0), sum_sec(0.), max_sec(0.), loop_sec(0.),
+  loop_count(0) {
+  memset(buckets, 0, sizeof(buckets));
+}
+
+/** Accounts for a duration: bucket i contains durations up to 2^((i+1)/B) us,
+ *  where B is the number of buckets per octave. Durations below 1 us go in the
+ *  first bucket, too long ones in the last.
+ */
+void phaseHist::fill(double sec) {
+
+  if (sec < 0.) sec = 0.;
+
+  double usec = sec * 1e6;
+  int b = 0;
+  if (usec > 1.) {
+    b = (int)(log2(usec) * AFRESMON_HIST_BUCKETS_PER_OCTAVE);
+    if (b >= AFRESMON_HIST_NBUCKETS) b = AFRESMON_HIST_NBUCKETS-1;
+  }
+
+  buckets[b]++;
+  count++;
+  sum_sec += sec;
+  if (sec > max_sec) max_sec = sec;
+  loop_sec += sec;
+  loop_count++;
+}
+
+/** Adds the content of another histogram to this one (per-loop counters
+ *  included).
+ */
+void phaseHist::add(const phaseHist &other) {
+  for (int b=0; b<AFRESMON_HIST_NBUCKETS; b++) buckets[b] += other.buckets[b];
+  count += other.count;
+  sum_sec += other.sum_sec;
+  if (other.max_sec > max_sec) max_sec = other.max_sec;
+  loop_sec += other.loop_sec;
+  loop_count += other.loop_count;
+}
+
+/** Empties the histogram.
+ */
+void phaseHist::reset() {
+  memset(buckets, 0, sizeof(buckets));
+  count = 0;
+  sum_sec = 0.;
+  max_sec = 0.;
+  new_loop();
+}
+
+/** Estimates the given quantile (between 0 and 1) of the durations, in
+ *  seconds. The estimate never exceeds the maximum recorded duration.
+ */
+double phaseHist::get_quantile(double q) const {
+
+  if (count == 0) return 0.;
+
+  unsigned long rank = (unsigned long)ceil(q * count);
+  if (rank < 1) rank = 1;
+
+  unsigned long cumul = 0;
+  for (int b=0; b<AFRESMON_HIST_NBUCKETS; b++) {
+    cumul += buckets[b];
+    if (cumul >= rank) {
+      double upper_sec =
+        pow(2., (double)(b+1) / AFRESMON_HIST_BUCKETS_PER_OCTAVE) * 1e-6;
+      return (upper_sec < max_sec) ? upper_sec : max_sec;
+    }
+  }
+
+  return max_sec;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Member functions for the af::phaseStats class
+////////////////////////////////////////////////////////////////////////////////
+
+/** Constructor: no phases.
+ */
+phaseStats::phaseStats() : n_phases(0) {
+  names[AFRESMON_MAX_PHASES] = "other";
+}
+
+/** Returns the histogram of the given phase, creating it if needed. Phase
+ *  names are not copied: string literals are expected.
+ */
+phaseHist &phaseStats::get(const char *phase_name) {
+
+  for (unsigned int i=0; i<n_phases; i++)
+    if (strcmp(names[i], phase_name) == 0) return hists[i];
+
+  if (n_phases == AFRESMON_MAX_PHASES) return hists[AFRESMON_MAX_PHASES];
+
+  names[n_phases] = phase_name;
+  return hists[n_phases++];
+}
+
+/** Writes one line on the log for every phase run during the current loop,
+ *  with the time spent in the loop and the statistics since the start.
+ */
+void phaseStats::log_summary(log_level_t level) {
+
+  if (!log::enabled(level)) return;
+
+  for (unsigned int i=0; i<=AFRESMON_MAX_PHASES; i++) {
+
+    if ((i >= n_phases) && (i != AFRESMON_MAX_PHASES)) continue;
+
+    const phaseHist &h = hists[i];
+    if (h.get_loop_count() == 0) continue;
+
+    log::info(level, "Phase %s: %.3lf s in this loop (%lu times) || "
+      "Overall: %lu times | p50: %.3lf s | p95: %.3lf s | max: %.3lf s",
+      names[i], h.get_loop_sec(), h.get_loop_count(), h.get_count(),
+      h.get_quantile(.5), h.get_quantile(.95), h.get_max_sec());
+  }
+
+}
+
+/** Resets the per-loop counters of every phase.
+ */
+void phaseStats::new_loop() {
+  for (unsigned int i=0; i<=AFRESMON_MAX_PHASES; i++) hists[i].new_loop();
 }
@@ -3,7 +3,9 @@
  *
  * This file is part of afdsmgrd -- see http://code.google.com/p/afdsmgrd
  *
- * Monitor system resources incrementally and differentially.
+ * Monitor system resources incrementally and differentially. Durations of the
+ * phases of a loop are measured with scoped timers and accumulated in
+ * histograms with logarithmic buckets.
  */
 
 #ifndef AFRESMON_H
@@ -12,7 +14,8 @@
 #include <fstream>
 
 #include <unistd.h>
-//#include <time.h>
+#include <time.h>
+#include <math.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <string.h>
@@ -22,6 +25,17 @@
 
 #define AFRESMON_BUFSIZE 100
 
+/** Each power of two is split in this many histogram buckets (i.e., relative
+ *  resolution of quantiles is about 19%). Buckets start at 1 us and cover up
+ *  to 2^32 us, which is more than one hour.
+ */
+#define AFRESMON_HIST_BUCKETS_PER_OCTAVE 4
+#define AFRESMON_HIST_NBUCKETS (32*AFRESMON_HIST_BUCKETS_PER_OCTAVE)
+
+/** Maximum number of distinct phases: further phases are accounted together.
+ */
+#define AFRESMON_MAX_PHASES 20
+
 namespace af {
 
   /** Structure to hold timings.
@@ -48,15 +62,14 @@ namespace af {
       res_timing_t &get_delta_timing();
       res_timing_t &get_cumul_timing();
       res_mem_t    &get_mem_usage();
+      static double get_wall_sec();
 
     private:
 
-      double get_wall_sec();
       bool fetch_cpu_timing(res_timing_t &rt);
       res_timing_t &get_delta_timing_ref(res_timing_t &ref);
 
       //struct timespec buf_ts;
-      struct timeval buf_tv;
       struct rusage buf_ru;
       char buf[AFRESMON_BUFSIZE];
       std::string procfn;
@@ -68,6 +81,79 @@ namespace af {
 
   };
 
+  /** Histogram of durations with logarithmic buckets. Quantiles are estimated
+   *  with the upper edge of the bucket they fall in. Any positive quantity
+   *  between 1e-6 and about 4e3 can be accounted for, not only durations.
+   */
+  class phaseHist {
+
+    public:
+      phaseHist();
+      void fill(double sec);
+      double get_quantile(double q) const;
+      inline unsigned long get_count() const { return count; };
+      inline double get_sum_sec() const { return sum_sec; };
+      inline double get_max_sec() const { return max_sec; };
+      inline double get_loop_sec() const { return loop_sec; };
+      inline unsigned long get_loop_count() const { return loop_count; };
+      inline void new_loop() { loop_sec = 0.; loop_count = 0; };
+      void add(const phaseHist &other);
+      void reset();
+
+    private:
+      unsigned long buckets[AFRESMON_HIST_NBUCKETS];
+      unsigned long count;
+      double        sum_sec;
+      double        max_sec;
+      double        loop_sec;
+      unsigned long loop_count;
+
+  };
+
+  /** A set of histograms, one per named phase.
+   */
+  class phaseStats {
+
+    public:
+      phaseStats();
+      phaseHist &get(const char *phase_name);
+      void log_summary(log_level_t level);
+      void new_loop();
+      inline unsigned int get_n_phases() const { return n_phases; };
+      inline const char *get_name(unsigned int i) const { return names[i]; };
+      inline const phaseHist &get_hist(unsigned int i) const {
+        return hists[i];
+      };
+
+    private:
+      unsigned int n_phases;
+      const char  *names[AFRESMON_MAX_PHASES+1];
+      phaseHist    hists[AFRESMON_MAX_PHASES+1];
+
+  };
+
+  /** Measures the time spent from its construction to its destruction (or to
+   *  the first call to stop()), and fills the given histogram with it.
+   */
+  class scopedTimer {
+
+    public:
+      scopedTimer(phaseHist &_hist) :
+        hist(_hist), start_sec(resMon::get_wall_sec()), running(true) {};
+      ~scopedTimer() { stop(); };
+      inline void stop() {
+        if (!running) return;
+        hist.fill( resMon::get_wall_sec() - start_sec );
+        running = false;
+      };
+
+    private:
+      phaseHist &hist;
+      double     start_sec;
+      bool       running;
+
+  };
+
 };
 
 #endif // AFRESMON_H
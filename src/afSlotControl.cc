@@ -0,0 +1,142 @@
+/**
+ * afSlotControl.cc -- by Dario Berzano <dario.berzano@cern.ch>
+ *
+ * This file is part of afdsmgrd -- see http://code.google.com/p/afdsmgrd
+ *
+ * See header file for a description of the class.
+ */
+
+#include "afSlotControl.h"
+
+using namespace af;
+
+/** Constructor: disabled, with a single slot.
+ */
+slotControl::slotControl() : enabled(false), min_slots(1), max_slots(1),
+  slots(1.), saturated(false), latency_avg(0.), latency_per_mb(false),
+  last_update_sec(-1.), loops_since_decrease(0) {
+  snprintf(reason, AF_SLOTCONTROL_REASON_SIZE, "initial value");
+}
+
+/** Sets the range of slots. The current number of slots is moved within the
+ *  new range if needed.
+ */
+void slotControl::set_range(unsigned int _min_slots,
+  unsigned int _max_slots) {
+  max_slots = (_max_slots > 0) ? _max_slots : 1;
+  min_slots = (_min_slots > 0) ? _min_slots : 1;
+  if (min_slots > max_slots) min_slots = max_slots;
+  clamp();
+}
+
+/** Turns control on or off. When turned on, it starts from the maximum number
+ *  of slots, as if it were off, and statistics are collected anew.
+ */
+void slotControl::set_enabled(bool _enabled) {
+  if (_enabled == enabled) return;
+  enabled = _enabled;
+  slots = max_slots;
+  latency_avg = 0.;
+  last_update_sec = -1.;
+  loops_since_decrease = 0;
+  snprintf(reason, AF_SLOTCONTROL_REASON_SIZE, "control turned %s",
+    enabled ? "on" : "off");
+}
+
+/** Returns the number of slots to use: the maximum if control is off.
+ */
+unsigned int slotControl::get_slots() const {
+  if (!enabled) return max_slots;
+  return (unsigned int)slots;
+}
+
+/** Keeps the number of slots within range.
+ */
+void slotControl::clamp() {
+  if (slots < min_slots) slots = min_slots;
+  else if (slots > max_slots) slots = max_slots;
+}
+
+/** Feeds the controller with the transfers finished since the last call: the
+ *  number of successes and failures and the sum of their durations, plus the
+ *  durations and the total size of the successful transfers whose size is
+ *  known. It must be called once per loop. Returns true if the number of slots
+ *  changed: in such a case, get_reason() tells why.
+ */
+bool slotControl::update(unsigned int n_ok, unsigned int n_fail,
+  double stage_sec_sum, double sized_sec_sum,
+  unsigned long long sized_bytes_sum) {
+
+  if (!enabled) return false;
+
+  double now = resMon::get_wall_sec();
+  double elapsed_sec = (last_update_sec < 0.) ? 0. : now - last_update_sec;
+  last_update_sec = now;
+  loops_since_decrease++;
+
+  unsigned int n_done = n_ok + n_fail;
+  unsigned int prev_slots = get_slots();
+  double rate = (elapsed_sec > 0.) ? n_done / elapsed_sec : 0.;
+
+  if (n_done >= AF_SLOTCONTROL_MIN_SAMPLES) {
+
+    // Seconds per MB do not depend on the file sizes: seconds per transfer are
+    // used only if no size is known. The average restarts when units change
+    bool per_mb = (sized_bytes_sum > 0) && (sized_sec_sum > 0.);
+    double latency = per_mb ? sized_sec_sum / (sized_bytes_sum / 1e6) :
+      stage_sec_sum / n_done;
+    const char *unit = per_mb ? "s/MB" : "s";
+    if (per_mb != latency_per_mb) {
+      latency_per_mb = per_mb;
+      latency_avg = 0.;
+    }
+
+    double fail_ratio = (double)n_fail / n_done;
+    double latency_ratio = (latency_avg > 0.) ? latency / latency_avg : 1.;
+    bool trouble = (fail_ratio > AF_SLOTCONTROL_MAX_FAIL_RATIO) ||
+      (latency_ratio > AF_SLOTCONTROL_MAX_LATENCY_RATIO);
+
+    // On troubles the reference follows slowly, so that a lasting shift of the
+    // latency does not keep the slots at the minimum forever
+    double prev_avg = latency_avg;
+    if (latency_avg <= 0.) latency_avg = latency;
+    else {
+      latency_avg += (trouble ? AF_SLOTCONTROL_LATENCY_ALPHA_TROUBLE :
+        AF_SLOTCONTROL_LATENCY_ALPHA) * (latency - latency_avg);
+    }
+
+    if (trouble) {
+
+      // Decrease at most every other loop, to see the effect of the former:
+      // never increase meanwhile
+      if (loops_since_decrease <= 1) return false;
+
+      slots *= AF_SLOTCONTROL_DECREASE;
+      clamp();
+      loops_since_decrease = 0;
+
+      if (fail_ratio > AF_SLOTCONTROL_MAX_FAIL_RATIO) {
+        snprintf(reason, AF_SLOTCONTROL_REASON_SIZE, "%u/%u transfers failed "
+          "(%.2lf per second)", n_fail, n_done, rate);
+      }
+      else {
+        snprintf(reason, AF_SLOTCONTROL_REASON_SIZE, "stage latency %.2lf %s, "
+          "average %.2lf %s (%.2lf per second)", latency, unit, prev_avg, unit,
+          rate);
+      }
+
+      return (get_slots() != prev_slots);
+    }
+
+  }
+
+  if ((saturated) && (n_done > 0)) {
+    slots += AF_SLOTCONTROL_INCREASE;
+    clamp();
+    snprintf(reason, AF_SLOTCONTROL_REASON_SIZE, "all slots busy with files "
+      "waiting (%.2lf per second)", rate);
+    return (get_slots() != prev_slots);
+  }
+
+  return false;
+}
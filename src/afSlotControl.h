@@ -0,0 +1,73 @@
+/**
+ * afSlotControl.h -- by Dario Berzano <dario.berzano@cern.ch>
+ *
+ * This file is part of afdsmgrd -- see http://code.google.com/p/afdsmgrd
+ *
+ * Adaptive control of the number of concurrent staging commands, between a
+ * minimum and a maximum, with an AIMD (additive increase, multiplicative
+ * decrease) policy. Slots are decreased when the failure rate or the stage
+ * latency (compared to its moving average) grow, and increased when all slots
+ * are busy and files are still waiting. Latency is measured in seconds per MB
+ * when file sizes are known, so that it does not depend on the size mix.
+ */
+
+#ifndef AFSLOTCONTROL_H
+#define AFSLOTCONTROL_H
+
+#define AF_SLOTCONTROL_INCREASE 1.
+#define AF_SLOTCONTROL_DECREASE 0.75
+#define AF_SLOTCONTROL_MIN_SAMPLES 3
+#define AF_SLOTCONTROL_MAX_FAIL_RATIO 0.3
+#define AF_SLOTCONTROL_MAX_LATENCY_RATIO 1.5
+#define AF_SLOTCONTROL_LATENCY_ALPHA 0.1
+#define AF_SLOTCONTROL_LATENCY_ALPHA_TROUBLE 0.02
+#define AF_SLOTCONTROL_REASON_SIZE 200
+
+#include <stdio.h>
+
+#include "afResMon.h"
+
+namespace af {
+
+  /** The main class of this file.
+   */
+  class slotControl {
+
+    public:
+
+      slotControl();
+
+      void set_range(unsigned int _min_slots, unsigned int _max_slots);
+      void set_enabled(bool _enabled);
+      inline bool is_enabled() const { return enabled; };
+      inline void set_saturated(bool _saturated) { saturated = _saturated; };
+
+      bool update(unsigned int n_ok, unsigned int n_fail,
+        double stage_sec_sum, double sized_sec_sum,
+        unsigned long long sized_bytes_sum);
+
+      unsigned int get_slots() const;
+      inline unsigned int get_min_slots() const { return min_slots; };
+      inline unsigned int get_max_slots() const { return max_slots; };
+      inline const char *get_reason() const { return reason; };
+
+    private:
+
+      void clamp();
+
+      bool         enabled;
+      unsigned int min_slots;
+      unsigned int max_slots;
+      double       slots;
+      bool         saturated;         // files left waiting in the last loop
+      double       latency_avg;       // moving average, 0 if unknown
+      bool         latency_per_mb;    // average in s/MB, or s per transfer
+      double       last_update_sec;
+      unsigned int loops_since_decrease;
+      char         reason[AF_SLOTCONTROL_REASON_SIZE];
+
+  };
+
+};
+
+#endif // AFSLOTCONTROL_H
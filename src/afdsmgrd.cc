@@ -12,6 +12,7 @@
 #include <unistd.h>
 #include <libgen.h>
 #include <signal.h>
+#include <limits.h>
 //#include <pwd.h>
 //#include <grp.h>
 
@@ -19,6 +20,7 @@
 #include <sstream>
 #include <memory>
 #include <list>
+#include <vector>
 
 #include "afLog.h"
 #include "afConfig.h"
@@ -27,8 +29,14 @@
 #include "afExtCmd.h"
 #include "afOpQueue.h"
 #include "afNotify.h"
+#include "afNotifyDispatch.h"
 #include "afOptions.h"
 #include "afResMon.h"
+#include "afEventLog.h"
+#include "afEndpoint.h"
+#include "afSlotControl.h"
+#include "afFairShare.h"
+#include "afDsIndex.h"
 
 #define AF_ERR_LOG 1
 #define AF_ERR_CONFIG 2
@@ -51,6 +59,15 @@
  */
 #define AF_PROG_NAME "afdsmgrd"
 
+/** Maximum number of messages per second about failures of single files.
+ */
+#define AF_MAX_FAIL_MSGS_PER_SEC 20
+
+/** Size-aware timeouts of staging commands are this many times the expected
+ *  duration of the transfer.
+ */
+#define AF_STAGE_TIMEOUT_FACTOR 2.
+
 /** Set of variables in configuration file.
  */
 typedef struct {
@@ -58,13 +75,36 @@ typedef struct {
   long sleep_secs;           // dsmgrd.sleepsecs
   long scan_ds_every_loops;  // dsmgrd.scandseveryloops
   long max_concurrent_xfrs;  // dsmgrd.parallelxfrs
+  long min_concurrent_xfrs;  // dsmgrd.minparallelxfrs
+  bool adaptive_xfrs;        // dsmgrd.adaptivexfrs
+  std::string endpoint_slots;  // dsmgrd.endpointslots
+  std::string share_weights;   // dsmgrd.shareweights
   long max_stage_retries;    // dsmgrd.corruptafterfails
+  long retry_delay_secs;     // dsmgrd.retrydelaysecs
+  long retry_max_delay_secs; // dsmgrd.retrymaxdelaysecs
+  long breaker_fails;        // dsmgrd.breakerfails
+  long breaker_probe_secs;   // dsmgrd.breakerprobesecs
   long cmd_timeout_secs;     // dsmgrd.cmdtimeoutsecs
+  long min_cmd_timeout_secs; // dsmgrd.cmdmintimeoutsecs
   bool purge_noop_ds;        // dsmgrd.purgenoopds
   std::string stage_cmd;     // dsmgrd.stagecmd
+  long log_ring_size;        // dsmgrd.asynclog
+  bool log_ring_block;       // dsmgrd.asynclogblock
+  long log_rotate_secs;      // dsmgrd.logrotatesecs
+  long log_rotate_mib;       // dsmgrd.logrotatemib
+  std::string event_log;     // dsmgrd.eventlog
+  std::string ds_index;      // dsmgrd.dsindex
+  double notify_rate;        // dsmgrd.notifyrate
+  long notify_burst;         // dsmgrd.notifyburst
   af::regex **url_regexs;    // dsmgrd.urlregex[n]
   unsigned int n_url_regexs;
   af::notify *notif;
+  af::eventLog *evlog;
+  af::dsIndex *dsidx;
+  af::phaseStats *phases;
+  af::endpointList *endpoints;
+  af::slotControl *slots;
+  af::fairShare *shares;
 
 } afdsmgrd_vars_t;
 
@@ -82,7 +122,9 @@ typedef std::list<af::extCmd *> cmdq_t;
 
 /** Global variables.
  */
-bool quit_requested = false;
+volatile sig_atomic_t quit_requested = 0;
+volatile sig_atomic_t quit_signal = 0;
+volatile sig_atomic_t dump_requested = 0;
 
 /** Returns an instance of the log facility based on the given logfile. In case
  *  the logfile can't be opened, it returns NULL.
@@ -127,11 +169,19 @@ bool write_pidfile(pid_t pid, const char *pid_file) {
   return true;
 }
 
-/** Handles a typical quit signal (see signal()).
+/** Handles a typical quit signal (see signal()): the main loop logs it. Only
+ *  async-signal-safe operations are allowed here, logging is not.
  */
 void signal_quit_callback(int signum) {
-  af::log::info(af::log_level_urgent, "Quit requested with signal %d", signum);
-  quit_requested = true;
+  quit_signal = signum;
+  quit_requested = 1;
+}
+
+/** Handles the signal requesting a dump of the storage endpoints statistics:
+ *  the dump is written by the main loop.
+ */
+void signal_dump_callback(int signum) {
+  dump_requested = 1;
 }
 
 /** Callback called when directive dsmgrd.urlregex changes. Remember that val is
@@ -206,7 +256,9 @@ void config_callback_datasetsrc(const char *name, const char *val, void *args) {
 
 /** Callback called when directive dsmgrd.notify changes: it loads and unloads
  *  external libraries for notification. Remember that val is NULL if no value
- *  was specified (i.e., directive is missing).
+ *  was specified (i.e., directive is missing). Plugins are not called directly
+ *  by the daemon, but through the dispatcher: *notif points to the dispatcher
+ *  if a plugin is loaded, and it is NULL otherwise.
  */
 void config_callback_notify(const char *name, const char *val, void *args) {
 
@@ -214,22 +266,26 @@ void config_callback_notify(const char *name, const char *val, void *args) {
 
   af::notify **notif = (af::notify **)args_array[0];
   af::config *cfg = (af::config *)args_array[1];
+  af::notifyDispatch *dispatch = (af::notifyDispatch *)args_array[2];
 
   // Since directive is called only if something has changed, let's delete
   // any previously loaded library, if present
-  if (*notif) {
-    af::notify::unload(*notif);
-    *notif = NULL;
+  af::notify *prev_plugin = dispatch->set_plugin(NULL);
+  *notif = NULL;
+  if (prev_plugin) {
+    af::notify::unload(prev_plugin);
     af::log::info(af::log_level_high, "Notification plugin unloaded");
   }
 
   // Then, if a right value is specified, load a new one and report status
   if (!val) return;
 
-  *notif = af::notify::load(val, *cfg);
-  if (*notif) {
+  af::notify *plugin = af::notify::load(val, *cfg);
+  if (plugin) {
+    dispatch->set_plugin(plugin);
+    *notif = dispatch;
     af::log::ok(af::log_level_high, "Plugin loaded: %s (%s)",
-      val, (*notif)->whoami());
+      val, plugin->whoami());
   }
   else {
     af::log::error(af::log_level_high, "Can't load notification plugin: %s",
@@ -238,14 +294,65 @@ void config_callback_notify(const char *name, const char *val, void *args) {
 
 }
 
-/** Transfer queue is processed: check if slots are freed, then insert elements
- *  from opq in free slots of cmdq. Handle successes and failures by syncing
- *  info between cmdq and opq
+/** Reports on the log a change of state of the circuit breaker of the given
+ *  storage endpoint. The notifier gets the state of every endpoint once per
+ *  loop, together with their statistics.
  */
-void process_transfer_queue(af::opQueue &opq, cmdq_t &cmdq,
+void report_breaker(const std::string &host, const af::endpoint &ep,
   afdsmgrd_vars_t &vars) {
 
-  const af::queueEntry *qent;
+  switch (ep.get_breaker()) {
+    case af::breaker_open:
+      af::log::error(af::log_level_urgent, "Circuit breaker of endpoint %s "
+        "open after %u failures in a row: no transfers for %ld s",
+        host.c_str(), ep.get_n_consec_fail(), vars.breaker_probe_secs);
+    break;
+    case af::breaker_half_open:
+      af::log::warning(af::log_level_high, "Circuit breaker of endpoint %s "
+        "half-open: probing with a single transfer", host.c_str());
+    break;
+    case af::breaker_closed:
+      af::log::ok(af::log_level_urgent, "Circuit breaker of endpoint %s "
+        "closed: transfers resume", host.c_str());
+    break;
+  }
+
+}
+
+/** Returns the timeout of the staging command of the given entry. If
+ *  size-aware timeouts are on, it is computed from the size of the file (as
+ *  known from the dataset, or as read during the previous attempt) and from
+ *  the throughput of its storage endpoint, between dsmgrd.cmdmintimeoutsecs
+ *  and dsmgrd.cmdtimeoutsecs (if set). Otherwise, or if either the size or the
+ *  throughput is unknown, it is dsmgrd.cmdtimeoutsecs (0 means no timeout).
+ */
+unsigned long stage_timeout_secs(const af::queueEntry *qent,
+  afdsmgrd_vars_t &vars) {
+
+  unsigned long max_secs = (unsigned long)vars.cmd_timeout_secs;
+  if (vars.min_cmd_timeout_secs <= 0) return max_secs;
+
+  unsigned long long size_bytes = qent->get_expected_bytes();
+  if (qent->get_read_bytes() > size_bytes) size_bytes = qent->get_read_bytes();
+  if (size_bytes == 0) return max_secs;
+
+  double expected_secs =
+    vars.endpoints->get(qent->get_main_url()).get_expected_secs(size_bytes);
+  if (expected_secs < 0.) return max_secs;
+
+  double secs = AF_STAGE_TIMEOUT_FACTOR * expected_secs;
+  if (secs < vars.min_cmd_timeout_secs) secs = vars.min_cmd_timeout_secs;
+  if ((max_secs > 0) && (secs > max_secs)) secs = max_secs;
+
+  return (unsigned long)secs;
+}
+
+/** Launches the staging command for the given queued entry, turning it to
+ *  "running" and appending the command to cmdq. Returns true on success, false
+ *  if the command could not be launched (the entry stays in queue).
+ */
+bool start_staging(af::opQueue &opq, cmdq_t &cmdq, afdsmgrd_vars_t &vars,
+  const af::queueEntry *qent) {
 
   // Variables to substitute in stage command
   static af::varmap_t stagecmd_vars;
@@ -254,18 +361,98 @@ void process_transfer_queue(af::opQueue &opq, cmdq_t &cmdq,
     stagecmd_vars.insert( af::varpair_t("TREENAME", "") );
   }
 
+  // Prepare command
+
+  af::varmap_iter_t it;
+
+  it = stagecmd_vars.find("URLTOSTAGE");
+  it->second = qent->get_main_url();  // it is the translated (redir) one
+
+  it = stagecmd_vars.find("TREENAME");
+  const char *def_tree = qent->get_tree_name();
+  it->second = def_tree ? def_tree : "";
+
+  std::string url_cmd = af::regex::dollar_subst(vars.stage_cmd.c_str(),
+    stagecmd_vars);
+
+  AF_LOG(info, af::log_level_debug, "Preparing staging command: %s",
+    url_cmd.c_str());
+
+  // Launch command
+
+  af::extCmd *ext_stage_cmd = new af::extCmd(url_cmd.c_str(),
+    qent->get_instance_id());
+  unsigned long timeout_secs = stage_timeout_secs(qent, vars);
+  ext_stage_cmd->set_timeout_secs(timeout_secs);
+  int r = ext_stage_cmd->run();
+  if (r == 0) {
+
+    // Command started successfully
+    af::log::ok(af::log_level_normal, "Staging started: %s "
+      "(uiid=%u, tree=%s, timeout=%lu s)", qent->get_main_url(),
+      qent->get_instance_id(), qent->get_tree_name(), timeout_secs);
+
+    // Turn status to "running"
+    opq.set_status(qent->get_main_url(), af::qstat_running);
+
+    vars.evlog->transition("started", qent->get_main_url(),
+      qent->get_instance_id(), qent->get_n_failures()+1);
+
+    // Enqueue in command queue
+    cmdq.push_back(ext_stage_cmd);
+
+    return true;
+  }
+
+  AF_LOG_RATE(error, af::log_level_high, AF_MAX_FAIL_MSGS_PER_SEC,
+    "Error running staging command, wrapper returned %d: check "
+    "permissions on %s. Command issued: %s",
+    r, af::extCmd::get_temp_path(), url_cmd.c_str());
+
+  vars.evlog->transition("launchfailed", qent->get_main_url(),
+    qent->get_instance_id(), qent->get_n_failures()+1, 0, 0,
+    "wrapper error");
+
+  delete ext_stage_cmd;
+  return false;
+}
+
+/** Transfer queue is processed: check if slots are freed, then insert elements
+ *  from opq in free slots of cmdq. Handle successes and failures by syncing
+ *  info between cmdq and opq
+ */
+void process_transfer_queue(af::opQueue &opq, cmdq_t &cmdq,
+  afdsmgrd_vars_t &vars) {
+
+  const af::queueEntry *qent;
+
   af::log::info(af::log_level_normal, "*** Processing transfer queue ***");
 
+  // Resources used by the staging commands finished during this loop
+  af::ext_res_sum_t cmds_res;
+  memset(&cmds_res, 0, sizeof(cmds_res));
+
+  // Outcome of the staging commands finished during this loop
+  unsigned int n_done_ok = 0;
+  unsigned int n_done_fail = 0;
+  double stage_sec_sum = 0.;
+  double sized_sec_sum = 0.;  // successful, with known size
+  unsigned long long sized_bytes_sum = 0;
+
   opq.set_max_failures((unsigned int)vars.max_stage_retries);
+  opq.set_backoff((double)vars.retry_delay_secs,
+    (double)vars.retry_max_delay_secs);
 
   //
   // Query on "running" to update their status if needed
   //
 
+  af::scopedTimer timer_r(vars.phases->get("queue_running"));
+
   opq.init_query_by_status(af::qstat_running);
   while ( qent = opq.next_query_by_status() ) {
 
-    af::log::info(af::log_level_debug, "Searching in command queue for uiid=%u",
+    AF_LOG(info, af::log_level_debug, "Searching in command queue for uiid=%u",
       qent->get_instance_id());
 
     // Check status in transfer queue
@@ -273,19 +460,46 @@ void process_transfer_queue(af::opQueue &opq, cmdq_t &cmdq,
 
       if ( (*it)->get_id() == qent->get_instance_id() ) {
 
-        af::log::ok(af::log_level_debug, "Found uuid=%u in command queue",
+        AF_LOG(ok, af::log_level_debug, "Found uuid=%u in command queue",
           qent->get_instance_id());
 
         if ((*it)->is_running()) {
-          af::log::info(af::log_level_debug, "Still downloading: %s (uiid=%u)",
-            qent->get_main_url(), qent->get_instance_id());
+          unsigned long long rchar = 0;
+          (*it)->get_live_read_chars(rchar);
+          AF_LOG(info, af::log_level_debug, "Still downloading: %s (uiid=%u, "
+            "read=%llu bytes)", qent->get_main_url(), qent->get_instance_id(),
+            rchar);
           break;
         }
 
+        // Resources used are written right after the end of the command: if
+        // they are not there yet, the command is handled on a later loop
+        if (!(*it)->resources_ready()) break;
+
         // Download has finished
 
         (*it)->get_output();
 
+        // Times are known only if the start was recorded by this daemon
+        double now = af::opQueue::now_sec();
+        double wait_sec = -1.;
+        double stage_sec = -1.;
+        if (qent->get_started_at() > 0.) {
+          stage_sec = now - qent->get_started_at();
+          if (qent->get_enqueued_at() > 0.)
+            wait_sec = qent->get_started_at() - qent->get_enqueued_at();
+        }
+        std::string host = af::endpointList::get_host(qent->get_main_url());
+        af::endpoint &ep = vars.endpoints->get_by_host(host);
+        if (stage_sec > 0.) stage_sec_sum += stage_sec;
+
+        const af::ext_res_t &res = (*it)->add_resources(cmds_res);
+        if (res.valid) {
+          opq.set_resources(qent->get_main_url(),
+            res.cpu_user_sec + res.cpu_sys_sec, res.max_rss_kib,
+            res.read_chars);
+        }
+
         if ( (*it)->is_ok() ) {
           
           //
@@ -298,12 +512,24 @@ void process_transfer_queue(af::opQueue &opq, cmdq_t &cmdq,
           // mandatory for the external command, thus they might be NULL or 0!
           const char *tree_name = (*it)->get_field_text("Tree");
           const char *endp_url = (*it)->get_field_text("EndpointUrl");
-          unsigned int size_bytes = (*it)->get_field_uint("Size");
+          unsigned long long size_bytes = (*it)->get_field_ull("Size");
           unsigned int n_events = (*it)->get_field_uint("Events");
 
           opq.success(qent->get_main_url(), endp_url, tree_name, n_events,
             size_bytes);
 
+          vars.evlog->transition("success", qent->get_main_url(),
+            qent->get_instance_id(), qent->get_n_failures()+1, size_bytes,
+            n_events);
+
+          if (ep.done(true, wait_sec, stage_sec, size_bytes, now))
+            report_breaker(host, ep, vars);
+          n_done_ok++;
+          if ((stage_sec > 0.) && (size_bytes > 0)) {
+            sized_sec_sum += stage_sec;
+            sized_bytes_sum += size_bytes;
+          }
+
         }
         else {
 
@@ -314,14 +540,47 @@ void process_transfer_queue(af::opQueue &opq, cmdq_t &cmdq,
           // Check if it was staged nevertheless
           bool was_staged = (*it)->get_field_uint("Staged");
           const char *reason = (*it)->get_field_text("Reason");
+          if ((!reason) && ((*it)->is_timed_out())) reason = "timeout";
 
           // Stage command reported a failure
-          af::log::error(af::log_level_high, "Failed: %s "
-            "(reason: %s, staged: %s)",
+          AF_LOG_RATE(error, af::log_level_high, AF_MAX_FAIL_MSGS_PER_SEC,
+            "Failed: %s (reason: %s, staged: %s)",
             qent->get_main_url(), (reason ? reason : "unknown"),
             (was_staged ? "yes" : "no"));
 
-          opq.failed(qent->get_main_url(), was_staged);
+          unsigned int attempt = qent->get_n_failures()+1;
+
+          if (ep.get_breaker() == af::breaker_open) {
+
+            // The endpoint is already known to be failing: the file is held
+            // in queue without spending its failure budget. A failed probe
+            // (half-open breaker) is charged instead, or the same file would
+            // probe the endpoint forever
+            opq.set_status(qent->get_main_url(), af::qstat_queue);
+
+            vars.evlog->transition("held", qent->get_main_url(),
+              qent->get_instance_id(), attempt, 0, 0,
+              (reason ? reason : "unknown"), was_staged, false);
+
+          }
+          else {
+
+            opq.failed(qent->get_main_url(), was_staged);
+
+            // Failure is final if the file is marked as corrupted (status F)
+            // instead of being put back in queue
+            bool final = ((vars.max_stage_retries > 0) &&
+              (attempt >= (unsigned int)vars.max_stage_retries));
+
+            vars.evlog->transition("failed", qent->get_main_url(),
+              qent->get_instance_id(), attempt, 0, 0,
+              (reason ? reason : "unknown"), was_staged, final);
+
+          }
+
+          if (ep.done(false, wait_sec, stage_sec, 0, now))
+            report_breaker(host, ep, vars);
+          n_done_fail++;
 
         }
 
@@ -339,74 +598,117 @@ void process_transfer_queue(af::opQueue &opq, cmdq_t &cmdq,
 
   }
   opq.free_query_by_status();
+  timer_r.stop();
 
   //
-  // Query on "queued", limited to the number of free download slots
+  // Query on "queued", limited to the number of free download slots, shared
+  // amongst storage endpoints
   //
 
-  int free_cmd_slots = vars.max_concurrent_xfrs - cmdq.size();
-  af::log::info(af::log_level_debug, "Staging slots free: %d", free_cmd_slots);
+  af::scopedTimer timer_q(vars.phases->get("queue_queued"));
 
-  if (free_cmd_slots > 0) {
+  if (vars.slots->update(n_done_ok, n_done_fail, stage_sec_sum, sized_sec_sum,
+    sized_bytes_sum)) {
+    af::log::info(af::log_level_normal, "Staging slots changed to %u "
+      "(range: %u-%u): %s", vars.slots->get_slots(),
+      vars.slots->get_min_slots(), vars.slots->get_max_slots(),
+      vars.slots->get_reason());
+  }
 
-    opq.init_query_by_status(af::qstat_queue, free_cmd_slots);
+  // Failed files waiting for their retry are queued again when due
+  unsigned int n_due = opq.requeue_due();
+  if (n_due > 0) {
+    af::log::info(af::log_level_low, "Failed files to retry now: %u", n_due);
+  }
 
-    while ( qent = opq.next_query_by_status() ) {
+  int free_cmd_slots = (int)vars.slots->get_slots() - (int)cmdq.size();
+  AF_LOG(info, af::log_level_debug, "Staging slots free: %d", free_cmd_slots);
 
-      // Prepare command
+  if (free_cmd_slots > 0) {
 
-      af::varmap_iter_t it;
+    // Storage endpoints with waiting files, the one with the oldest first: in
+    // turn, each one starts as many files as its weight, within its own limit,
+    // until slots are over or no endpoint can start more
+    std::vector<std::string> hosts;
+    opq.get_endp_hosts(af::qstat_queue, hosts);
+    std::vector<bool> exhausted(hosts.size(), false);
+    bool progress = true;
 
-      it = stagecmd_vars.find("URLTOSTAGE");
-      it->second = qent->get_main_url();  // it is the translated (redir) one
+    while ((free_cmd_slots > 0) && (progress)) {
 
-      it = stagecmd_vars.find("TREENAME");
-      const char *def_tree = qent->get_tree_name();
-      it->second = def_tree ? def_tree : "";
+      progress = false;
 
-      std::string url_cmd = af::regex::dollar_subst(vars.stage_cmd.c_str(),
-        stagecmd_vars);
+      for (size_t i=0; (i<hosts.size()) && (free_cmd_slots>0); i++) {
 
-      af::log::info(af::log_level_debug, "Preparing staging command: %s",
-        url_cmd.c_str());
+        if (exhausted[i]) continue;
 
-      // Launch command
+        af::endpoint &ep = vars.endpoints->get_by_host(hosts[i]);
+        if (ep.check_breaker(af::opQueue::now_sec()))
+          report_breaker(hosts[i], ep, vars);
 
-      af::extCmd *ext_stage_cmd = new af::extCmd(url_cmd.c_str(),
-        qent->get_instance_id());
-      ext_stage_cmd->set_timeout_secs( (unsigned long)vars.cmd_timeout_secs );
-      int r = ext_stage_cmd->run();
-      if (r == 0) {
+        unsigned int n_turn = ep.get_weight();
+        if (n_turn > ep.get_free_slots()) n_turn = ep.get_free_slots();
+        if (n_turn > (unsigned int)free_cmd_slots) n_turn = free_cmd_slots;
 
-        // Command started successfully
-        af::log::ok(af::log_level_normal, "Staging started: %s "
-          "(uiid=%u, tree=%s)", qent->get_main_url(), qent->get_instance_id(),
-          qent->get_tree_name());
+        if (n_turn == 0) {
+          exhausted[i] = true;
+          continue;
+        }
 
-        // Turn status to "running"
-        opq.set_status(qent->get_main_url(), af::qstat_running);
+        // Within the turn, files are taken one by one from the share chosen
+        // by the fair share scheduler, amongst the first file of each share
+        std::vector<std::string> shares;
+        std::vector<int> prios;
+        opq.get_shares(af::qstat_queue, hosts[i].c_str(), shares);
+
+        while ((n_turn > 0) && (!exhausted[i])) {
+
+          prios.clear();
+          for (size_t j=0; j<shares.size(); j++) {
+            opq.init_query_by_status(af::qstat_queue, 1, hosts[i].c_str(),
+              shares[j].c_str());
+            qent = opq.next_query_by_status();
+            prios.push_back( qent ? qent->get_priority() : 0 );
+            opq.free_query_by_status();
+          }
 
-        // Enqueue in command queue
-        cmdq.push_back(ext_stage_cmd);
+          int k = vars.shares->pick(shares, prios);
+          if (k < 0) {
+            exhausted[i] = true;
+            break;
+          }
+
+          opq.init_query_by_status(af::qstat_queue, 1, hosts[i].c_str(),
+            shares[k].c_str());
+          qent = opq.next_query_by_status();
+
+          if (!qent) shares.erase(shares.begin()+k);  // no more files
+          else if (start_staging(opq, cmdq, vars, qent)) {
+            vars.shares->charge(shares[k]);
+            ep.started();
+            free_cmd_slots--;
+            n_turn--;
+            progress = true;
+          }
+          else exhausted[i] = true;  // do not insist during this loop
+
+          opq.free_query_by_status();
+        }
 
-      }
-      else {
-        af::log::error(af::log_level_high, "Error running staging command, "
-          "wrapper returned %d: check permissions on %s. Command issued: %s",
-          r, af::extCmd::get_temp_path(), url_cmd.c_str());
       }
 
     }
-    opq.free_query_by_status();
 
   }
 
+  timer_q.stop();
+
   //
   // Summary (also notification)
   //
 
-  unsigned int n_queued, n_runn, n_success, n_fail, n_total;
-  opq.summary(n_queued, n_runn, n_success, n_fail);
+  unsigned int n_queued, n_runn, n_success, n_fail, n_total, n_eligible;
+  opq.summary(n_queued, n_runn, n_success, n_fail, &n_eligible);
   n_total = n_queued + n_runn + n_success + n_fail;
   af::log::info(af::log_level_normal, "Total elements in queue: %u || "
     "Queued: %u | Downloading: %u | Success: %u | Failed: %u",
@@ -414,6 +716,25 @@ void process_transfer_queue(af::opQueue &opq, cmdq_t &cmdq,
   if (vars.notif)
     vars.notif->queue(n_queued, n_runn, n_success, n_fail, n_total);
 
+  // Slots are increased only if they were not enough to start waiting files:
+  // files delayed after a failure could not be started anyway
+  vars.slots->set_saturated((n_eligible > 0) &&
+    (cmdq.size() >= vars.slots->get_slots()));
+  if (vars.notif) {
+    vars.notif->slots(vars.slots->get_slots(), vars.slots->get_min_slots(),
+      vars.slots->get_max_slots(), vars.slots->get_reason());
+  }
+
+  if (cmds_res.n_cmds > 0) {
+    af::log::info(af::log_level_normal, "Staging commands finished: %u || "
+      "CPU: %.2lf s | Max RSS: %lu KiB | Read: %llu bytes", cmds_res.n_cmds,
+      cmds_res.cpu_sec, cmds_res.max_rss_kib, cmds_res.read_chars);
+  }
+  if (vars.notif) {
+    vars.notif->commands(cmds_res.n_cmds, cmds_res.cpu_sec,
+      cmds_res.max_rss_kib, cmds_res.read_chars);
+  }
+
   //af::log::info(af::log_level_normal, "========== Begin Of Queue ==========");
   //opq.dump(true);
   //af::log::info(af::log_level_normal, "========== End Of Queue ==========");
@@ -435,12 +756,32 @@ void process_datasets(af::opQueue &opq, af::dataSetList &dsm,
   unsigned int count_ds = 0;
   unsigned int deleted_ds = 0;
 
+  vars.dsidx->begin_pass();
+
   while (ds = dsm.next_dataset()) {
 
-    af::log::info(af::log_level_low, "Scanning dataset %s", ds);
+    AF_LOG(info, af::log_level_low, "Scanning dataset %s", ds);
+
+    // Dataset file is checked before reading it, for the dataset index
+    std::string ds_file;
+    struct stat ds_st;
+    bool ds_st_ok = false;
+    if ((vars.dsidx->is_open()) && (dsm.get_datasets_path())) {
+      ds_file = dsm.get_datasets_path();
+      ds_file += ds;
+      ds_file += ".root";
+      ds_st_ok = af::dsIndex::stat_file(ds_file.c_str(), &ds_st);
+    }
 
     TFileInfo *fi;
-    dsm.fetch_files(NULL, "sc");  // sc == not staged AND not corrupted
+    af::scopedTimer timer_fetch(vars.phases->get("datasets_fetch"));
+    bool fetch_ok = dsm.fetch_files(NULL, "sc");  // not staged AND not corr.
+    timer_fetch.stop();
+    if (!fetch_ok) {
+      af::log::error(af::log_level_high, "Can not read dataset %s", ds);
+    }
+    std::string share = af::fairShare::get_share(ds);
+    int priority = dsm.get_priority();
     int count_changes = 0;
     int count_files = 0;
 
@@ -476,7 +817,7 @@ void process_datasets(af::opQueue &opq, af::dataSetList &dsm,
 
         switch (dsm.del_urls_but_last(2)) {
           case af::ds_manip_err_ok_mod:
-            //af::log::info(af::log_level_low, "del_urls_but_last(2)");
+            //AF_LOG(info, af::log_level_low, "del_urls_but_last(2)");
             count_changes++;
           break;
           case af::ds_manip_err_ok_noop:
@@ -504,7 +845,7 @@ void process_datasets(af::opQueue &opq, af::dataSetList &dsm,
           break;
           case af::ds_manip_err_ok_noop:
             // OK but nothing changed
-            af::log::ok(af::log_level_debug, "In dataset %s at entry %s: "
+            AF_LOG(ok, af::log_level_debug, "In dataset %s at entry %s: "
               "last URL not removed", ds, inp_url);
           break;
           case af::ds_manip_err_fail:
@@ -520,7 +861,7 @@ void process_datasets(af::opQueue &opq, af::dataSetList &dsm,
         if ( fi->AddUrl(out_url, true) ) count_changes++;
         else {
           // URL already in the list: duplicates are not allowed
-          af::log::warning(af::log_level_debug,
+          AF_LOG(warning, af::log_level_debug,
             "In dataset %s: at entry %s, AddUrl() failed while adding "
               "redirector URL %s", ds, inp_url, out_url);
         }
@@ -532,20 +873,24 @@ void process_datasets(af::opQueue &opq, af::dataSetList &dsm,
       //
 
       unsigned int unique_id;
-      qent = opq.cond_insert(out_url, dsm.get_default_tree(), &unique_id);
+      qent = opq.cond_insert(out_url, dsm.get_default_tree(), &unique_id,
+        0x0, af::endpointList::get_host(out_url).c_str(), share.c_str(),
+        priority, (fi->GetSize() > 0) ? (unsigned long long)fi->GetSize() : 0);
         // NULL value for get_default_tree() is accepted
 
       if (!qent) {
 
         // URL is not yet in queue: cond_insert() has already appended it
-        af::log::ok(af::log_level_low, "Queued: %s (id=%u)", out_url,
+        AF_LOG(ok, af::log_level_low, "Queued: %s (id=%u)", out_url,
           unique_id);
 
+        vars.evlog->transition("queued", out_url, unique_id);
+
       }
       else {
 
         // URL already in queue
-        af::log::info(af::log_level_debug, "Already queued "
+        AF_LOG(info, af::log_level_debug, "Already queued "
           "(status=%c, failures=%u): %s", qent->get_status(),
           qent->get_n_failures(), out_url);
 
@@ -567,7 +912,7 @@ void process_datasets(af::opQueue &opq, af::dataSetList &dsm,
           // Add endpoint URL
           if (qent->get_endp_url()) {
             if (!fi->AddUrl(qent->get_endp_url(), true)) {
-              af::log::warning(af::log_level_debug, "In dataset %s, "
+              AF_LOG(warning, af::log_level_debug, "In dataset %s, "
                 "endpoint URL %s is a duplicate", ds,
                 qent->get_endp_url());
             }
@@ -590,7 +935,7 @@ void process_datasets(af::opQueue &opq, af::dataSetList &dsm,
             // Sets size
             fi->SetSize(qent->get_size_bytes());
 
-            af::log::ok(af::log_level_debug, "URL in opq %s claimed by %s",
+            AF_LOG(ok, af::log_level_debug, "URL in opq %s claimed by %s",
               out_url, ds);
 
             count_changes++;
@@ -648,30 +993,40 @@ void process_datasets(af::opQueue &opq, af::dataSetList &dsm,
 
     if (count_changes > 0) {
 
+      af::scopedTimer timer_save(vars.phases->get("datasets_save"));
       bool save_ok = dsm.save_dataset();
+      timer_save.stop();
 
       if (save_ok) {
         af::log::ok(af::log_level_high,
           "Dataset %s saved: %d entries considered", ds, count_files);
+        if (ds_st_ok) {
+          ds_st_ok = af::dsIndex::stat_file(ds_file.c_str(), &ds_st);
+        }
       }
       else {
         af::log::error(af::log_level_high,
           "Dataset %s not saved: check permissions", ds);
+        ds_st_ok = false;  // file on disk does not match what is in memory
       }
 
       nothing_done = false;
     }
-    else if ((vars.purge_noop_ds) && (count_files == 0)) {
+    else if ((fetch_ok) && (vars.purge_noop_ds) && (count_files == 0)) {
 
       // If there's at least one corrupted file, don't delete dataset
       dsm.free_files();  // free prev resources: we allocate new ones
-      dsm.fetch_files(NULL, "C");
-      if (dsm.next_file() == NULL) {
+      fetch_ok = dsm.fetch_files(NULL, "C");
+      if (!fetch_ok) {
+        af::log::error(af::log_level_high, "Can not read dataset %s", ds);
+      }
+      else if (dsm.next_file() == NULL) {
         // No corrupted files
-        af::log::info(af::log_level_debug, "Dataset %s is condemned", ds);
+        AF_LOG(info, af::log_level_debug, "Dataset %s is condemned", ds);
         if (dsm.remove_dataset(ds)) {
-          af::log::ok(af::log_level_low, "Dataset %s deleted", ds);
+          AF_LOG(ok, af::log_level_low, "Dataset %s deleted", ds);
           deleted_ds++;
+          ds_st_ok = false;
         }
         else {
           af::log::error(af::log_level_high, "Failed to delete dataset %s", ds);
@@ -679,44 +1034,49 @@ void process_datasets(af::opQueue &opq, af::dataSetList &dsm,
         nothing_done = false;
       }
       else {
-        af::log::info(af::log_level_debug,
+        AF_LOG(info, af::log_level_debug,
           "Dataset %s has corrupted files: not deleted", ds);
       }
     }
 
     if (nothing_done) {
-      af::log::info(af::log_level_low,
+      AF_LOG(info, af::log_level_low,
         "Dataset %s not modified: %d entries were considered",
         ds, count_files);
     }
 
-    if (vars.notif) {
-      const TFileCollection *fc = dsm.get_fc();
-      const char *tree_name = dsm.get_default_tree();
-      int n_events;
-      long long total_size = fc->GetTotalSize();
-
-      if (tree_name) {
-        n_events = fc->GetTotalEntries(tree_name);
-        if (n_events < 0) n_events = 0;
-      }
-      else {
-        tree_name = "";
-        n_events = 0;
-      }
+    // Nothing is known about a dataset which could not be read
+    if (!fetch_ok) {
+      dsm.free_files();
+      count_ds++;
+      continue;
+    }
 
-      if (total_size < 0LL) total_size = 0LL;
+    // Summary of the dataset, for the notification plugin and the index
+    af::ds_summary_t summary;
+    if ((vars.notif) || (ds_st_ok)) {
+      af::dsIndex::get_summary(dsm.get_fc(), dsm.get_default_tree(), summary);
+    }
 
+    // The notification interface keeps events as int
+    if (vars.notif) {
+      int n_events = (summary.n_events > INT_MAX) ? INT_MAX :
+        (int)summary.n_events;
       vars.notif->dataset(
-        ds,                             // const char *ds_name
-        (int)fc->GetNFiles(),           // int n_files
-        (int)fc->GetNStagedFiles(),     // int n_taged
-        (int)fc->GetNCorruptFiles(),    // int n_corrupted
-        (char *)tree_name,              // const char *tree_name
-        n_events,                       // int n_events
-        (unsigned long long)total_size  // unsigned ll total_size_bytes
+        ds,                                     // const char *ds_name
+        summary.n_files,                        // int n_files
+        summary.n_staged,                       // int n_taged
+        summary.n_corrupted,                    // int n_corrupted
+        (char *)summary.tree_name.c_str(),      // const char *tree_name
+        n_events,                               // int n_events
+        summary.total_size_bytes                // unsigned ll total_size_bytes
       );
+    }
 
+    // Datasets not indexed now are removed from the index at the end
+    if (ds_st_ok) {
+      af::scopedTimer timer_index(vars.phases->get("datasets_index"));
+      vars.dsidx->update(ds, ds_file.c_str(), dsm.get_fc(), summary, &ds_st);
     }
 
     dsm.free_files();
@@ -726,7 +1086,13 @@ void process_datasets(af::opQueue &opq, af::dataSetList &dsm,
 
   dsm.free_datasets();
 
-  af::log::info(af::log_level_low,
+  unsigned int n_unindexed = vars.dsidx->end_pass();
+  if (n_unindexed > 0) {
+    AF_LOG(info, af::log_level_low,
+      "Datasets removed from the dataset index: %u", n_unindexed);
+  }
+
+  AF_LOG(info, af::log_level_low,
     "Number of datasets processed: %u (deleted: %u)",
     count_ds, deleted_ds);
 
@@ -743,7 +1109,7 @@ void process_datasets(af::opQueue &opq, af::dataSetList &dsm,
 /** The main loop. The loop breaks when the external variable quit_requested is
  *  set to true.
  */
-void main_loop(af::config &config) {
+void main_loop(af::config &config, af::log &log) {
 
   // Resources monitoring facility
   af::resMon resmon;
@@ -763,16 +1129,49 @@ void main_loop(af::config &config) {
   // The staging queue, used by process_transfer_queue() only
   cmdq_t cmdq;
 
+  // Machine-readable log of queue transitions (discards records if no file)
+  af::eventLog evlog;
+
+  // Persistent index of the dataset repository (nothing is kept if no file)
+  af::dsIndex dsidx;
+
+  // Timing of the phases of the loop
+  af::phaseStats phases;
+
+  // Transfer statistics per storage endpoint
+  af::endpointList endpoints;
+
+  // Number of concurrent staging commands
+  af::slotControl slots;
+
+  // Fair share of the staging slots amongst groups of datasets
+  af::fairShare shares;
+
   // Variables in configuration files in a handy struct
   afdsmgrd_vars_t vars;
   vars.sleep_secs = 0;
   vars.scan_ds_every_loops = 0;
   vars.max_concurrent_xfrs = 0;
+  vars.min_concurrent_xfrs = 0;
+  vars.adaptive_xfrs = false;
   vars.max_stage_retries = 0;
+  vars.retry_delay_secs = 0;
+  vars.retry_max_delay_secs = 0;
+  vars.breaker_fails = 0;
+  vars.breaker_probe_secs = 0;
   vars.notif = NULL;
+  vars.evlog = &evlog;
+  vars.dsidx = &dsidx;
+  vars.phases = &phases;
+  vars.endpoints = &endpoints;
+  vars.slots = &slots;
+  vars.shares = &shares;
+
+  // Notifications are sent to the plugin by a separate thread
+  af::notifyDispatch dispatch(config);
 
   // Variables for the notify plugin loader/unloader (through callback)
-  void *notif_cbk_args[] = { &vars.notif, &config };
+  void *notif_cbk_args[] = { &vars.notif, &config, &dispatch };
 
   // Bind directives to either variables or special callbacks
   config.bind_callback("xpd.datasetsrc", &config_callback_datasetsrc,
@@ -782,14 +1181,41 @@ void main_loop(af::config &config) {
   config.bind_int("dsmgrd.scandseveryloops", &vars.scan_ds_every_loops, 10, 1,
     AF_INT_MAX);
   config.bind_int("dsmgrd.parallelxfrs", &vars.max_concurrent_xfrs, 8, 1, 1000);
+  config.bind_int("dsmgrd.minparallelxfrs", &vars.min_concurrent_xfrs, 1, 1,
+    1000);
+  config.bind_bool("dsmgrd.adaptivexfrs", &vars.adaptive_xfrs, false);
+  config.bind_text("dsmgrd.endpointslots", &vars.endpoint_slots, "");
+  config.bind_text("dsmgrd.shareweights", &vars.share_weights, "");
   config.bind_text("dsmgrd.stagecmd", &vars.stage_cmd, "/bin/false");
   config.bind_int("dsmgrd.corruptafterfails", &vars.max_stage_retries, 0, 0,
     1000);
+  config.bind_int("dsmgrd.retrydelaysecs", &vars.retry_delay_secs, 60, 0,
+    AF_INT_MAX);  // 0 == retry immediately
+  config.bind_int("dsmgrd.retrymaxdelaysecs", &vars.retry_max_delay_secs,
+    3600, 0, AF_INT_MAX);
+  config.bind_int("dsmgrd.breakerfails", &vars.breaker_fails, 10, 0,
+    AF_INT_MAX);  // 0 == circuit breaker off
+  config.bind_int("dsmgrd.breakerprobesecs", &vars.breaker_probe_secs, 300,
+    1, AF_INT_MAX);
   config.bind_int("dsmgrd.cmdtimeoutsecs", &vars.cmd_timeout_secs, 0, 1,
     AF_INT_MAX);  // 0 == timeout off
+  config.bind_int("dsmgrd.cmdmintimeoutsecs", &vars.min_cmd_timeout_secs, 0,
+    1, AF_INT_MAX);  // 0 == size-aware timeouts off
   config.bind_callback("dsmgrd.notifyplugin", &config_callback_notify,
     notif_cbk_args);
   config.bind_bool("dsmgrd.purgenoopds", &vars.purge_noop_ds, false);
+  config.bind_int("dsmgrd.asynclog", &vars.log_ring_size, 0, 0,
+    AF_LOG_MAX_RING_SIZE);
+  config.bind_bool("dsmgrd.asynclogblock", &vars.log_ring_block, false);
+  config.bind_int("dsmgrd.logrotatesecs", &vars.log_rotate_secs, 43200, 60,
+    AF_INT_MAX);
+  config.bind_int("dsmgrd.logrotatemib", &vars.log_rotate_mib, 0, 0,
+    AF_INT_MAX);  // 0 == no size-based rotation
+  config.bind_text("dsmgrd.eventlog", &vars.event_log, "");
+  config.bind_text("dsmgrd.dsindex", &vars.ds_index, "");
+  config.bind_real("dsmgrd.notifyrate", &vars.notify_rate, 20., 0.,
+    AF_REAL_MAX);  // 0 == no pacing
+  config.bind_int("dsmgrd.notifyburst", &vars.notify_burst, 50, 1, 100000);
 
   // Initializes regular expression objects for URL substitutions and their
   // respective callbacks
@@ -816,6 +1242,7 @@ void main_loop(af::config &config) {
 
   // Initial value for timeout ("manual" callback, see later on)
   vars.cmd_timeout_secs = 0;
+  vars.min_cmd_timeout_secs = 0;
 
   // The loop counter
   long count_loops = -1;
@@ -830,17 +1257,83 @@ void main_loop(af::config &config) {
     //
 
     long prev_to = vars.cmd_timeout_secs;
+    af::scopedTimer timer_config(phases.get("config"));
+
+    // Plugins react to configuration changes from this thread
+    dispatch.suspend();
 
     if (config.update()) {
       af::log::info(af::log_level_high, "Config file modified");
 
-      // "Manual" callback for timeouts
-      if (vars.cmd_timeout_secs != prev_to) {
+      // "Manual" callback for timeouts: size-aware ones are kept as computed
+      // when the command started
+      if ((vars.cmd_timeout_secs != prev_to) &&
+        (vars.min_cmd_timeout_secs <= 0)) {
         for (cmdq_t::iterator it=cmdq.begin(); it!=cmdq.end(); it++) {
           (*it)->set_timeout_secs( (unsigned long)vars.cmd_timeout_secs );
         }
       }
 
+      // "Manual" callback for asynchronous logging
+      if (log.set_async((unsigned int)vars.log_ring_size,
+        vars.log_ring_block ? af::log_overflow_block : af::log_overflow_drop)) {
+        if (vars.log_ring_size > 0) {
+          af::log::info(af::log_level_normal, "Asynchronous logging with a "
+            "ring buffer of %ld messages (%s when full)", vars.log_ring_size,
+            vars.log_ring_block ? "wait" : "drop");
+        }
+      }
+
+      // "Manual" callback for log rotation thresholds
+      log.set_rotate_secs( (double)vars.log_rotate_secs );
+      log.set_rotate_bytes( (unsigned long)vars.log_rotate_mib * 1048576UL );
+
+      // "Manual" callback for staging slots
+      slots.set_range((unsigned int)vars.min_concurrent_xfrs,
+        (unsigned int)vars.max_concurrent_xfrs);
+      if (slots.is_enabled() != vars.adaptive_xfrs) {
+        slots.set_enabled(vars.adaptive_xfrs);
+        af::log::info(af::log_level_normal, "Adaptive staging slots %s",
+          vars.adaptive_xfrs ? "enabled" : "disabled");
+      }
+
+      // "Manual" callback for limits of storage endpoints
+      if (endpoints.set_limits(vars.endpoint_slots.c_str()) &&
+        !vars.endpoint_slots.empty()) {
+        af::log::ok(af::log_level_normal, "Staging slots per endpoint: %s",
+          vars.endpoint_slots.c_str());
+      }
+
+      // "Manual" callback for circuit breakers of storage endpoints
+      endpoints.set_breaker((unsigned int)vars.breaker_fails,
+        (double)vars.breaker_probe_secs);
+
+      // "Manual" callback for weights of dataset shares
+      if (shares.set_weights(vars.share_weights.c_str()) &&
+        !vars.share_weights.empty()) {
+        af::log::ok(af::log_level_normal, "Weights of dataset shares: %s",
+          vars.share_weights.c_str());
+      }
+
+      // "Manual" callback for notifications pace
+      dispatch.set_rate(vars.notify_rate, (unsigned int)vars.notify_burst);
+
+      // "Manual" callback for the event log: reopened only if file changed
+      if (vars.event_log != evlog.get_file_name()) {
+        if (evlog.open(vars.event_log.c_str()) && evlog.is_open()) {
+          af::log::ok(af::log_level_normal, "Queue events written to %s",
+            evlog.get_file_name());
+        }
+      }
+
+      // "Manual" callback for the dataset index: reopened only if file changed
+      if (vars.ds_index != dsidx.get_file_name()) {
+        if (dsidx.open(vars.ds_index.c_str()) && dsidx.is_open()) {
+          af::log::ok(af::log_level_normal, "Dataset index kept in %s",
+            dsidx.get_file_name());
+        }
+      }
+
       // Manual callback for dataset repository
       std::string *dsm_new_path;
       bool dsm_from_stgreq = false;
@@ -881,6 +1374,8 @@ void main_loop(af::config &config) {
     }
     else af::log::info(af::log_level_low, "Config file unmodified");
 
+    dispatch.resume();
+
     //
     // Loop counter: we do not use MOD operator to take into account config
     // file modifications of directive dsmgrd.scandseveryloops
@@ -895,6 +1390,8 @@ void main_loop(af::config &config) {
     // Transfer queue
     //
 
+    timer_config.stop();
+
     process_transfer_queue(opq, cmdq, vars);
 
     //
@@ -902,6 +1399,7 @@ void main_loop(af::config &config) {
     //
 
     if (count_loops == 0) {
+      af::scopedTimer timer_ds(phases.get("datasets"));
       process_datasets(opq, dsm, vars);
     }
     else {
@@ -917,9 +1415,44 @@ void main_loop(af::config &config) {
     }
 
     //
-    // Report resources and sleep until next loop
+    // Report phase timings, resources, and sleep until next loop
     //
 
+    phases.log_summary(af::log_level_low);
+
+    if (vars.notif) {
+      for (unsigned int i=0; i<phases.get_n_phases(); i++) {
+        const af::phaseHist &h = phases.get_hist(i);
+        if (h.get_loop_count() == 0) continue;
+        vars.notif->phase(phases.get_name(i), h.get_loop_sec());
+        vars.notif->phase_stats(phases.get_name(i), h.get_count(),
+          h.get_sum_sec(), h.get_quantile(.5), h.get_quantile(.95),
+          h.get_max_sec());
+      }
+    }
+
+    phases.new_loop();
+
+    if (vars.notif) {
+      af::phaseHist wait, stage, mbps;
+      for (af::endpoint_map_t::const_iterator it=endpoints.begin();
+        it!=endpoints.end(); it++) {
+        it->second.get_wait(wait);
+        it->second.get_stage(stage);
+        it->second.get_mbps(mbps);
+        vars.notif->endpoint_stats(it->first.c_str(), it->second.get_n_ok(),
+          it->second.get_n_fail(), wait.get_quantile(.5),
+          wait.get_quantile(.95), stage.get_quantile(.5),
+          stage.get_quantile(.95), mbps.get_quantile(.5),
+          mbps.get_quantile(.05));
+        if (vars.breaker_fails > 0) {
+          vars.notif->endpoint_breaker(it->first.c_str(),
+            it->second.get_breaker_str(), it->second.get_n_consec_fail(),
+            it->second.get_n_trips());
+        }
+      }
+    }
+
     af::res_timing_t &rtd = resmon.get_delta_timing();
     af::res_timing_t &rtc = resmon.get_cumul_timing();
     af::res_mem_t    &rm  = resmon.get_mem_usage();
@@ -942,6 +1475,12 @@ void main_loop(af::config &config) {
           (float)rtd.real_sec, (float)rtd.user_sec, (float)rtd.sys_sec
         );
         vars.notif->commit();
+
+        unsigned long n_coalesced = dispatch.get_n_coalesced();
+        if (n_coalesced > 0) {
+          AF_LOG(info, af::log_level_low, "%lu dataset notification(s) "
+            "superseded before being sent", n_coalesced);
+        }
       }
     }
     else {
@@ -949,13 +1488,31 @@ void main_loop(af::config &config) {
         "Can't fetch daemon resources usage");
     }
 
+    // Pending events are written once per loop
+    evlog.flush();
+
     if (!quit_requested) {
       af::log::info(af::log_level_low, "Sleeping %ld seconds", vars.sleep_secs);
-      sleep(vars.sleep_secs);
+
+      // Sleep is interrupted by signals: dump if requested, then resume it
+      unsigned int left = (unsigned int)vars.sleep_secs;
+      while ((left > 0) && (!quit_requested)) {
+        left = sleep(left);
+        if (dump_requested) {
+          dump_requested = 0;
+          endpoints.log_dump(af::log_level_urgent);
+          shares.log_dump(af::log_level_urgent);
+        }
+      }
     }
 
   }
 
+  if (quit_signal) {
+    af::log::info(af::log_level_urgent, "Quit requested with signal %d",
+      (int)quit_signal);
+  }
+
   // Delete URL regexs
   for (unsigned int i=0; i<vars.n_url_regexs; i++) delete vars.url_regexs[i];
   delete [] vars.url_regexs;
@@ -1090,8 +1647,11 @@ int main(int argc, char *argv[]) {
   signal(SIGTERM, signal_quit_callback);
   signal(SIGINT, signal_quit_callback);
 
+  // Statistics of the storage endpoints are written on the log upon request
+  signal(SIGUSR1, signal_dump_callback);
+
   // All the processing goes here
-  main_loop(config);
+  main_loop(config, *log);
 
   return 0;
 
@@ -8,6 +8,11 @@
  * of the current process, and before yielding the execution to the external
  * command it writes the current PID to an external file, and redirects stdout
  * and stderr.
+ *
+ * With -r, the helper does not yield the execution: it stays in background as
+ * the parent of the external command and, when the command terminates, writes
+ * on the given file its exit status and the resources it used, as a single
+ * line of space-separated fields.
  */
  
 #include <iostream>
@@ -16,6 +21,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 
 /** Sets the specified environment variable.
  */
@@ -32,6 +43,73 @@ bool set_env_var(char *keyval) {
   return false;
 }
 
+/** Reads the I/O counters of the given process from /proc/<pid>/io: they
+ *  include the descendants waited for by that process. Counters which can not
+ *  be read are set to zero.
+ */
+void read_proc_io(pid_t pid, unsigned long long &rchar,
+  unsigned long long &wchar, unsigned long long &read_bytes) {
+
+  rchar = wchar = read_bytes = 0;
+
+  char buf[100];
+  snprintf(buf, sizeof(buf), "/proc/%d/io", (int)pid);
+  FILE *fp = fopen(buf, "r");
+  if (!fp) return;
+
+  unsigned long long val;
+  while (fscanf(fp, "%99[^:]: %llu\n", buf, &val) == 2) {
+    if (strcmp(buf, "rchar") == 0) rchar = val;
+    else if (strcmp(buf, "wchar") == 0) wchar = val;
+    else if (strcmp(buf, "read_bytes") == 0) read_bytes = val;
+  }
+
+  fclose(fp);
+}
+
+/** Waits for the given child to terminate, then writes its resources usage on
+ *  res_fn. The file is written under a temporary name and renamed, so that it
+ *  is never read partially. Returns the exit code of the wrapper.
+ */
+int reap(pid_t child_pid, const char *res_fn) {
+
+  // Wait for termination without reaping: /proc/<pid>/io is still readable
+  siginfo_t info;
+  while (waitid(P_PID, child_pid, &info, WEXITED|WNOWAIT) != 0) {
+    if (errno != EINTR) return 10;
+  }
+
+  unsigned long long rchar, wchar, read_bytes;
+  read_proc_io(child_pid, rchar, wchar, read_bytes);
+
+  int status;
+  struct rusage ru;
+  while (wait4(child_pid, &status, 0, &ru) < 0) {
+    if (errno != EINTR) return 10;
+  }
+
+  int exit_code = WIFEXITED(status) ? WEXITSTATUS(status) :
+    128 + WTERMSIG(status);
+
+  std::string tmp_fn = res_fn;
+  tmp_fn += ".tmp";
+
+  FILE *fp = fopen(tmp_fn.c_str(), "w");
+  if (!fp) return 11;
+
+  fprintf(fp, "RES ExitCode: %d CpuUserSec: %.3lf CpuSysSec: %.3lf "
+    "MaxRssKiB: %ld ReadChars: %llu WriteChars: %llu ReadBytes: %llu\n",
+    exit_code,
+    (double)ru.ru_utime.tv_sec + (double)ru.ru_utime.tv_usec / 1000000.,
+    (double)ru.ru_stime.tv_sec + (double)ru.ru_stime.tv_usec / 1000000.,
+    ru.ru_maxrss, rchar, wchar, read_bytes);
+  fclose(fp);
+
+  if (rename(tmp_fn.c_str(), res_fn) != 0) return 11;
+
+  return 0;
+}
+
 /** Entry point.
  */
 int main(int argc, char *argv[]) {
@@ -43,8 +121,9 @@ int main(int argc, char *argv[]) {
   const char *pid_fn = NULL;
   const char *out_fn = NULL;
   const char *err_fn = NULL;
+  const char *res_fn = NULL;
 
-  while ((c = getopt(argc, argv, "+:p:o:e:E:")) != -1) {
+  while ((c = getopt(argc, argv, "+:p:o:e:E:r:")) != -1) {
     switch (c) {
       case 'p':
         pid_fn = optarg;
@@ -58,6 +137,10 @@ int main(int argc, char *argv[]) {
         err_fn = optarg;
       break;
 
+      case 'r':
+        res_fn = optarg;
+      break;
+
       case 'E':
         if (!set_env_var(optarg)) {
           printf("Setting environment failed for: %s\n", optarg);
@@ -117,15 +200,39 @@ int main(int argc, char *argv[]) {
     exit(8);
   }
 
-  // Assemble the command line
-  std::ofstream pid_file(pid_fn);
-  if (pid_file) {
-    pid_file << getpid() << std::endl;
-    pid_file.close();
+  // In reaper mode, fork again: the command runs in the child, and this
+  // process waits for it
+  pid_t cmd_pid = getpid();
+
+  if (res_fn) {
+    cmd_pid = fork();
+    if (cmd_pid < 0) {
+      printf("Fatal: cannot fork\n");
+      exit(8);
+    }
   }
-  else {
-    printf("Can't write on PID file %s\n", pid_fn);
-    return 5;
+
+  if (cmd_pid > 0) {
+
+    // PID of the command (not of the reaper) is the one which can be stopped
+    std::ofstream pid_file(pid_fn);
+    if (pid_file) {
+      pid_file << cmd_pid << std::endl;
+      pid_file.close();
+    }
+    else {
+      printf("Can't write on PID file %s\n", pid_fn);
+      if (res_fn) kill(cmd_pid, SIGKILL);
+      return 5;
+    }
+
+    if (res_fn) {
+      fclose(stdin);
+      fclose(stdout);
+      fclose(stderr);
+      return reap(cmd_pid, res_fn);
+    }
+
   }
 
   if (freopen(err_fn, "w", stderr) == NULL) {
@@ -17,6 +17,9 @@
 #include <fstream>
 #include <memory>
 #include <list>
+#include <vector>
+#include <set>
+#include <algorithm>
 
 #include <TError.h>
 
@@ -29,6 +32,7 @@
 #include "afOptions.h"
 #include "afResMon.h"
 #include "afOptions.h"
+#include "afFingerprintSet.h"
 
 #define AF_ERR_CONFIG 2
 #define AF_ERR_LOGLEVEL 4
@@ -41,19 +45,32 @@
  */
 #define AF_PROG_NAME "afverifier"
 
+/** Maximum number of messages per second about failures of single files.
+ */
+#define AF_MAX_FAIL_MSGS_PER_SEC 20
+
+/** Timeout of a batch verification command: it grows with the number of URLs
+ *  in the batch, up to a maximum.
+ */
+#define AF_BATCH_TIMEOUT_SECS_PER_URL 1000
+#define AF_BATCH_TIMEOUT_SECS_MAX 21600
+
 /** Set of variables in configuration file.
  */
 typedef struct {
 
   long sleep_secs;           // verifier.sleepsecs
-  long scan_ds_every_loops;  // verifier.scandseveryloops
+  long files_in_flight;      // verifier.filesinflight
   long parallel_verifies;    // verifier.parallelverifies
+  long verify_batch;         // verifier.verifybatch
   long max_failures;         // verifier.maxfailures
   std::string verify_cmd;    // verifier.verifycmd
   std::string erase_cmd;     // verifier.erasecmd
+  long log_ring_size;        // verifier.asynclog
   af::regex **url_regexs;    // verifier.urlregex[n]
   unsigned int n_url_regexs;
   std::string *ds_path;
+  af::phaseStats *phases;
 
 } verifier_vars_t;
 
@@ -68,18 +85,43 @@ typedef struct {
 
 } verifier_options_t;
 
+/** A dataset whose files are being verified, from when its files are enqueued
+ *  until the results are saved back: the dataset is read again when saving,
+ *  so that changes made meanwhile by others are not lost.
+ */
+typedef struct {
+
+  std::string name;
+  unsigned int id;       // in the operations queue
+  unsigned int n_files;  // enqueued files
+
+} ds_in_flight_t;
+
+/** Datasets flowing through the verifier: waiting to be enqueued, then in
+ *  flight, then saved back and forgotten.
+ */
+typedef struct {
+
+  std::vector<std::string> pending;
+  size_t next_pending;
+  std::list<ds_in_flight_t> in_flight;
+  unsigned long n_files_in_flight;  // enqueued by the datasets in flight
+
+} verifier_pipeline_t;
+
 /** Global variables.
  */
-bool quit_requested = false;
+volatile sig_atomic_t quit_requested = 0;
+volatile sig_atomic_t quit_signal = 0;
 unsigned long total_files = 0;
 unsigned long total_saved_back = 0;
 
-/** Handles a typical quit signal (see signal()).
+/** Handles a typical quit signal (see signal()): the main loop logs it. Only
+ *  async-signal-safe operations are allowed here, logging is not.
  */
 void signal_quit_callback(int signum) {
-  af::log::warning(af::log_level_urgent, "Quit requested with signal %d",
-    signum);
-  quit_requested = true;
+  quit_signal = signum;
+  quit_requested = 1;
 }
 
 /** Callback called when directive dsmgrd.urlregex changes. Remember that val is
@@ -182,32 +224,116 @@ void config_callback_datasetsrc(const char *name, const char *val, void *args) {
 
 }
 
-/** All datasets are scanned for staged and uncorrupted files: for these
- *  entries:
+/** Fixes the URLs of the current entry (fi) of the given dataset: only the
+ *  originating URL (the last one) is kept, and the redirector URL regenerated
+ *  from it is added in front. Changes are counted in count_changes. Returns the
+ *  redirector URL, valid until the next call, or NULL if the originating URL
+ *  is not supported.
+ */
+const char *fix_entry_urls(af::dataSetList &dsm, TFileInfo *fi,
+  verifier_vars_t &vars, const char *ds, int &count_changes) {
+
+  // Originating URL is the last one; redirector URL is the last but one
+  TUrl *orig_url = dsm.get_url(-1);
+
+  if (!orig_url) return NULL;  // no URLs in entry (should not happen)
+
+  const char *inp_url = orig_url->GetUrl();
+  const char *out_url = NULL;
+
+  // Find the first matching regex for URL substitution
+  for (unsigned int i=0; i<vars.n_url_regexs; i++) {
+    out_url = vars.url_regexs[i]->subst(inp_url);
+    if (out_url) break;
+  }
+
+  // If no regex is found, orig URL is unsupported: skip it
+  if (!out_url) return NULL;
+
+  //
+  // Redirector's URL is re-added
+  //
+
+  // Conserve only last URL of the given entry
+  switch (dsm.del_urls_but_last()) {
+    case af::ds_manip_err_ok_mod:
+      // OK and modified
+      count_changes++;
+    break;
+    case af::ds_manip_err_ok_noop:
+      // OK but nothing changed
+      AF_LOG(ok, af::log_level_debug, "In dataset %s at entry %s: "
+        "last URL not removed", ds, inp_url);
+    break;
+    case af::ds_manip_err_fail:
+      // Should not happen, except for bugs (maybe there is one)
+      af::log::error(af::log_level_normal,
+        "In dataset %s at entry %s (last URL): problems when pruning "
+          "all URLs but last", ds, inp_url);
+    break;
+  }
+
+  // Add redirector URL: AddUrl() fails (returns false) if the same
+  // URL is already in the list
+  if ( fi->AddUrl(out_url, true) ) count_changes++;
+  else {
+    // URL already in the list: duplicates are not allowed
+    AF_LOG(warning, af::log_level_debug,
+      "In dataset %s: at entry %s, AddUrl() failed while adding "
+        "redirector URL %s", ds, inp_url, out_url);
+  }
+
+  return out_url;
+}
+
+/** Datasets are read one at a time, as long as less than the configured
+ *  number of files are in flight (at least one dataset is always read), and
+ *  their staged and uncorrupted files are scanned: for these entries:
  *
  *   - the originating URL is considered;
  *   - the redirector URL is regenerated;
  *   - the endpoint URL is eliminated.
  *
- * After that, the redirector's URL is put into the processing queue.
+ * After that, the redirector's URL is put into the processing queue, and the
+ * dataset is kept in memory until all of its files are verified: see
+ * process_datasets_save().
  */
 void process_datasets_enqueue(af::opQueue &opq, af::dataSetList &dsm,
-  verifier_vars_t &vars, verifier_options_t &opts) {
+  verifier_pipeline_t &pipe, verifier_vars_t &vars,
+  verifier_options_t &opts) {
+
+  if ((pipe.next_pending >= pipe.pending.size()) ||
+    (pipe.n_files_in_flight >= (unsigned long)vars.files_in_flight)) return;
 
   af::log::info(af::log_level_high,
     "*** Scanning datasets for files to verify and fixing URLs ***");
 
   const af::queueEntry *qent;
-  const char *ds;
-  dsm.fetch_datasets();
   unsigned int count_ds = 0;
 
-  while (ds = dsm.next_dataset()) {
+  while ((pipe.next_pending < pipe.pending.size()) &&
+    (pipe.n_files_in_flight < (unsigned long)vars.files_in_flight)) {
+
+    const char *ds = pipe.pending[pipe.next_pending++].c_str();
 
     af::log::info(af::log_level_normal, "Scanning dataset %s", ds);
 
     TFileInfo *fi;
-    dsm.fetch_files(NULL, opts.filter);  // every file
+    af::scopedTimer timer_fetch(vars.phases->get("datasets_fetch"));
+    bool fetch_ok = dsm.fetch_files(ds, opts.filter);
+    timer_fetch.stop();
+
+    if (!fetch_ok) {
+      af::log::error(af::log_level_high, "Can not read dataset %s", ds);
+      continue;
+    }
+
+    pipe.in_flight.push_back(ds_in_flight_t());
+    ds_in_flight_t &dif = pipe.in_flight.back();
+    dif.name = ds;
+    dif.id = opq.add_dataset();
+    dif.n_files = 0;
+
     int count_changes = 0;
     int count_files = 0;
 
@@ -216,56 +342,8 @@ void process_datasets_enqueue(af::opQueue &opq, af::dataSetList &dsm,
       count_files++;
       total_files++;
 
-      // Originating URL is the last one; redirector URL is the last but one
-      TUrl *orig_url = dsm.get_url(-1);
-      TUrl *redir_url = dsm.get_url(-2);
-
-      if (!orig_url) continue;  // no URLs in entry (should not happen)
-
-      const char *inp_url = orig_url->GetUrl();
-      const char *out_url = NULL;
-
-      // Find the first matching regex for URL substitution
-      for (unsigned int i=0; i<vars.n_url_regexs; i++) {
-        out_url = vars.url_regexs[i]->subst(inp_url);
-        if (out_url) break;
-      }
-
-      // If no regex is found, orig URL is unsupported: skip it
-      if (!out_url) continue;
-
-      //
-      // Redirector's URL is re-added
-      //
-
-      // Conserve only last URL of the given entry
-      switch (dsm.del_urls_but_last()) {
-        case af::ds_manip_err_ok_mod:
-          // OK and modified
-          count_changes++;
-        break;
-        case af::ds_manip_err_ok_noop:
-          // OK but nothing changed
-          af::log::ok(af::log_level_debug, "In dataset %s at entry %s: "
-            "last URL not removed", ds, inp_url);
-        break;
-        case af::ds_manip_err_fail:
-          // Should not happen, except for bugs (maybe there is one)
-          af::log::error(af::log_level_normal,
-            "In dataset %s at entry %s (last URL): problems when pruning "
-              "all URLs but last", ds, inp_url);
-        break;
-      }
-
-      // Add redirector URL: AddUrl() fails (returns false) if the same
-      // URL is already in the list
-      if ( fi->AddUrl(out_url, true) ) count_changes++;
-      else {
-        // URL already in the list: duplicates are not allowed
-        af::log::warning(af::log_level_debug,
-          "In dataset %s: at entry %s, AddUrl() failed while adding "
-            "redirector URL %s", ds, inp_url, out_url);
-      }
+      const char *out_url = fix_entry_urls(dsm, fi, vars, ds, count_changes);
+      if (!out_url) continue;  // unsupported URL
 
       //
       // Enqueue redirector's URL (cond_insert treats duplicates kindly)
@@ -281,53 +359,129 @@ void process_datasets_enqueue(af::opQueue &opq, af::dataSetList &dsm,
 
       if (!qent) {
         // URL is not yet in queue: cond_insert() has already appended it
-        af::log::ok(af::log_level_low, "Queued: %s (id=%u)", out_url,
+        AF_LOG(ok, af::log_level_low, "Queued: %s (id=%u)", out_url,
           unique_id);
       }
       else {
         // URL is not yet in queue: cond_insert() has already appended it
-        af::log::info(af::log_level_low, "Already queued: %s", out_url);
+        AF_LOG(info, af::log_level_low, "Already queued: %s", out_url);
       }
 
-    } // end loop over dataset entries (TFileInfos)
-
-    //
-    // Save only if URLs were translated or added
-    //
+      // The entry is kept in queue until no dataset in flight needs it
+      opq.add_owner(out_url, dif.id, dif.n_files++);
 
-    if (count_changes > 0) {
-      bool save_ok = dsm.save_dataset();  // no toggle_suid here
-      if (save_ok) {
-        af::log::ok(af::log_level_high, "Dataset %s saved: %d entries", ds,
-          count_files);
-      }
-      else {
-        af::log::error(af::log_level_high,
-          "Dataset %s not saved: check permissions", ds);
-      }
-    }
-    else {
-      af::log::info(af::log_level_low, "Dataset %s not modified", ds);
-    }
+    } // end loop over dataset entries (TFileInfos)
 
+    // URLs are fixed again when saving, together with the results of the
+    // verification
     dsm.free_files();
+    pipe.n_files_in_flight += dif.n_files;
     count_ds++;
 
+    AF_LOG(info, af::log_level_low, "Dataset %s: %d entries, %u queued",
+      ds, count_files, dif.n_files);
+
   }  // end loop over datasets (TFileCollections)
 
-  dsm.free_datasets();
+  af::log::info(af::log_level_normal, "Datasets scanned: %u || In flight: %lu "
+    "(%lu files) | Waiting: %lu", count_ds,
+    (unsigned long)pipe.in_flight.size(), pipe.n_files_in_flight,
+    (unsigned long)(pipe.pending.size() - pipe.next_pending));
+
+}
+
+/** Returns the path of the file listing the URLs verified by the command with
+ *  the given id, in the temporary directory of the external commands.
+ */
+std::string get_url_list_path(unsigned int id) {
+  std::ostringstream path;
+  path << af::extCmd::get_temp_path() << "/urllist-" << id;
+  return path.str();
+}
+
+/** Starts a single command verifying all the given URLs, listed in a file
+ *  passed as $URLLIST. The entries get the given instance id, new for each
+ *  batch, which is the id of the command too. The list of URLs is emptied. Returns the
+ *  number of URLs whose verification started: all or none.
+ */
+unsigned int start_verify_batch(af::opQueue &opq, std::list<af::extCmd *> &cmdq,
+  std::set<af::extCmd *> &batch_cmds, std::vector<std::string> &urls,
+  unsigned int id, af::varmap_t &extcmd_vars, verifier_vars_t &vars) {
+
+  if (urls.empty()) return 0;
+
+  std::string list_path = get_url_list_path(id);
+  std::ofstream list_file(list_path.c_str());
+  for (std::vector<std::string>::const_iterator it=urls.begin();
+    it!=urls.end(); it++) {
+    list_file << *it << std::endl;
+  }
+  list_file.close();
+
+  if (!list_file) {
+    AF_LOG_RATE(error, af::log_level_high, AF_MAX_FAIL_MSGS_PER_SEC,
+      "Can not write the list of URLs to verify on %s", list_path.c_str());
+    unlink(list_path.c_str());
+    urls.clear();
+    return 0;
+  }
+
+  extcmd_vars.find("REDIRURL")->second = urls.front();
+  extcmd_vars.find("TREENAME")->second = "";
+  extcmd_vars.find("URLLIST")->second = list_path;
+
+  std::string url_cmd = af::regex::dollar_subst(vars.verify_cmd.c_str(),
+    extcmd_vars);
+
+  AF_LOG(info, af::log_level_debug, "Preparing operation command: %s",
+    url_cmd.c_str());
 
-  af::log::info(af::log_level_low, "Number of datasets scanned: %u",
-    count_ds);
+  af::extCmd *ext_op_cmd = new af::extCmd(url_cmd.c_str(), id);
+  int r = ext_op_cmd->run();
 
+  if (r != 0) {
+    AF_LOG_RATE(error, af::log_level_high, AF_MAX_FAIL_MSGS_PER_SEC,
+      "Error running external command, wrapper returned %d: check "
+      "permissions on %s. Command issued: %s",
+      r, af::extCmd::get_temp_path(), url_cmd.c_str());
+    delete ext_op_cmd;
+    unlink(list_path.c_str());
+    urls.clear();
+    return 0;
+  }
+
+  AF_LOG(ok, af::log_level_low, "Operation started on %lu files: %s... "
+    "(uiid=%u)", (unsigned long)urls.size(), urls.front().c_str(), id);
+
+  for (std::vector<std::string>::const_iterator it=urls.begin();
+    it!=urls.end(); it++) {
+    opq.set_instance_id(it->c_str(), id);
+    opq.set_status(it->c_str(), af::qstat_running);
+  }
+
+  // On timeout every URL of the batch fails: give each one the time of a
+  // single command, so that healthy files are not counted as failures
+  unsigned long timeout_secs = AF_BATCH_TIMEOUT_SECS_PER_URL * urls.size();
+  if (timeout_secs > AF_BATCH_TIMEOUT_SECS_MAX)
+    timeout_secs = AF_BATCH_TIMEOUT_SECS_MAX;
+  ext_op_cmd->set_timeout_secs(timeout_secs);
+
+  cmdq.push_back(ext_op_cmd);
+  batch_cmds.insert(ext_op_cmd);
+
+  unsigned int n_started = urls.size();
+  urls.clear();
+  return n_started;
 }
 
 /** Operations queue is processed: check if slots are freed, then insert
  *  elements from opq in free slots of cmdq. Handle successes and failures by
- *  syncing info between cmdq and opq
+ *  syncing info between cmdq and opq. Verifications can be grouped in batches
+ *  run by a single command (batch_cmds).
  */
 void process_opqueue(af::opQueue &opq, std::list<af::extCmd *> &cmdq,
-  verifier_vars_t &vars, verifier_options_t &opts) {
+  std::set<af::extCmd *> &batch_cmds, verifier_vars_t &vars,
+  verifier_options_t &opts) {
 
   const af::queueEntry *qent;
 
@@ -336,6 +490,7 @@ void process_opqueue(af::opQueue &opq, std::list<af::extCmd *> &cmdq,
   if (extcmd_vars.empty()) {
     extcmd_vars.insert( af::varpair_t("REDIRURL", "") );
     extcmd_vars.insert( af::varpair_t("TREENAME", "") );
+    extcmd_vars.insert( af::varpair_t("URLLIST", "") );
   }
 
   af::log::info(af::log_level_high, "*** Processing operations queue ***");
@@ -345,6 +500,8 @@ void process_opqueue(af::opQueue &opq, std::list<af::extCmd *> &cmdq,
   unsigned int sum_cmd_ok = 0;
   unsigned int sum_cmd_err = 0;
   unsigned int sum_cmd_started = 0;
+  af::ext_res_sum_t sum_cmd_res;
+  memset(&sum_cmd_res, 0, sizeof(sum_cmd_res));
 
   opq.set_max_failures((unsigned int)vars.max_failures);
 
@@ -352,10 +509,17 @@ void process_opqueue(af::opQueue &opq, std::list<af::extCmd *> &cmdq,
   // Query on "running" to update their status if needed
   //
 
+  af::scopedTimer timer_r(vars.phases->get("queue_running"));
+
+  // Commands are removed after the query, since batches finish many entries:
+  // a batch seen running is considered so until the end of the query
+  std::set<af::extCmd *> done_cmds;
+  std::set<af::extCmd *> running_cmds;
+
   opq.init_query_by_status(af::qstat_running);
   while ( qent = opq.next_query_by_status() ) {
 
-    af::log::info(af::log_level_debug, "Searching in command queue for uiid=%u",
+    AF_LOG(info, af::log_level_debug, "Searching in command queue for uiid=%u",
       qent->get_instance_id());
 
     // Check status in operations queue
@@ -364,11 +528,17 @@ void process_opqueue(af::opQueue &opq, std::list<af::extCmd *> &cmdq,
 
       if ( (*it)->get_id() == qent->get_instance_id() ) {
 
-        af::log::ok(af::log_level_debug, "Found uuid=%u in command queue "
+        AF_LOG(ok, af::log_level_debug, "Found uuid=%u in command queue "
           "(flags=0x%04x)", qent->get_instance_id(), qent->get_flags());
 
-        if ((*it)->is_running()) {
-          af::log::info(af::log_level_debug, "Still processing: %s (uiid=%u)",
+        bool is_batch = (batch_cmds.count(*it) > 0);
+
+        // Resources used are written right after the end of the command: if
+        // they are not there yet, the command is handled on a later loop
+        if ((done_cmds.count(*it) == 0) && ((running_cmds.count(*it) > 0) ||
+          ((*it)->is_running()) || (!(*it)->resources_ready()))) {
+          running_cmds.insert(*it);
+          AF_LOG(info, af::log_level_debug, "Still processing: %s (uiid=%u)",
             qent->get_main_url(), qent->get_instance_id());
           break;
         }
@@ -377,7 +547,22 @@ void process_opqueue(af::opQueue &opq, std::list<af::extCmd *> &cmdq,
 
         sum_cmd_finished++;
 
-        (*it)->get_output();
+        // Output and resources are read once per command
+        if (done_cmds.insert(*it).second) {
+
+          if (is_batch) (*it)->get_outputs();
+          else (*it)->get_output();
+
+          const af::ext_res_t &res = (*it)->add_resources(sum_cmd_res);
+          if ((res.valid) && (!is_batch)) {
+            opq.set_resources(qent->get_main_url(),
+              res.cpu_user_sec + res.cpu_sys_sec, res.max_rss_kib,
+              res.read_chars);
+          }
+
+        }
+
+        if (is_batch) (*it)->select_output(qent->get_main_url());
 
         if ( (*it)->is_ok() ) {
           
@@ -392,7 +577,7 @@ void process_opqueue(af::opQueue &opq, std::list<af::extCmd *> &cmdq,
           // mandatory for the external command, thus they might be NULL or 0!
           const char *tree_name = (*it)->get_field_text("Tree");
           const char *endp_url = (*it)->get_field_text("EndpointUrl");
-          unsigned int size_bytes = (*it)->get_field_uint("Size");
+          unsigned long long size_bytes = (*it)->get_field_ull("Size");
           unsigned int n_events = (*it)->get_field_uint("Events");
 
           opq.success(qent->get_main_url(), endp_url, tree_name, n_events,
@@ -431,11 +616,13 @@ void process_opqueue(af::opQueue &opq, std::list<af::extCmd *> &cmdq,
             // verification, that either the file is not staged or another error
             // occured
             if (staged) { 
-              af::log::error(af::log_level_high, "Failed: %s (reason: %s)",
+              AF_LOG_RATE(error, af::log_level_high, AF_MAX_FAIL_MSGS_PER_SEC,
+                "Failed: %s (reason: %s)",
                 qent->get_main_url(), (reason ? reason : "unknown"));
             }
             else {
-              af::log::warning(af::log_level_normal, "Not staged: %s",
+              AF_LOG_RATE(warning, af::log_level_normal,
+                AF_MAX_FAIL_MSGS_PER_SEC, "Not staged: %s",
                 qent->get_main_url());
             }
 
@@ -449,10 +636,6 @@ void process_opqueue(af::opQueue &opq, std::list<af::extCmd *> &cmdq,
 
         //(*it)->print_fields(true);
 
-        // Success or failure: remove it from command queue in either case
-        delete *it;
-        cmdq.erase(it);
-        
         break;
 
       }
@@ -462,20 +645,61 @@ void process_opqueue(af::opQueue &opq, std::list<af::extCmd *> &cmdq,
   }
   opq.free_query_by_status();
 
+  // Success or failure: remove finished commands from command queue
+  if (!done_cmds.empty()) {
+    std::list<af::extCmd *>::iterator it = cmdq.begin();
+    while (it != cmdq.end()) {
+      if (done_cmds.count(*it) == 0) {
+        it++;
+        continue;
+      }
+      if (batch_cmds.erase(*it) > 0)
+        unlink( get_url_list_path((*it)->get_id()).c_str() );
+      delete *it;
+      it = cmdq.erase(it);
+    }
+  }
+
+  timer_r.stop();
+
   //
   // Query on "queued", limited to the number of free processing slots
   //
 
+  af::scopedTimer timer_q(vars.phases->get("queue_queued"));
+
   int free_cmd_slots = vars.parallel_verifies - cmdq.size();
-  af::log::info(af::log_level_debug, "Operation slots free: %d",
+  AF_LOG(info, af::log_level_debug, "Operation slots free: %d",
     free_cmd_slots);
 
   if (free_cmd_slots > 0) {
 
-    opq.init_query_by_status(af::qstat_queue, free_cmd_slots);
+    // Verifications are run in batches if so configured, removals are not
+    long batch_size = vars.verify_batch;
+    std::vector<std::string> batch_urls;
+    unsigned int batch_id = 0;
+
+    opq.init_query_by_status(af::qstat_queue, free_cmd_slots * batch_size);
 
     while ( qent = opq.next_query_by_status() ) {
 
+      bool is_removal = ((opts.rm_corr) && (qent->get_flag(0)));
+
+      if ((batch_size > 1) && (!is_removal)) {
+        if (batch_urls.empty()) batch_id = opq.new_instance_id();
+        batch_urls.push_back(qent->get_main_url());
+        if ((long)batch_urls.size() >= batch_size) {
+          sum_cmd_started += start_verify_batch(opq, cmdq, batch_cmds,
+            batch_urls, batch_id, extcmd_vars, vars);
+          if (--free_cmd_slots <= 0) break;
+        }
+        continue;
+      }
+
+      // A slot is kept for the batch being filled
+      if (free_cmd_slots <= (batch_urls.empty() ? 0 : 1)) continue;
+      free_cmd_slots--;
+
       // Prepare command
 
       af::varmap_iter_t it;
@@ -492,7 +716,7 @@ void process_opqueue(af::opQueue &opq, std::list<af::extCmd *> &cmdq,
 
       std::string url_cmd;
 
-      if ((opts.rm_corr) && (qent->get_flag(0))) {
+      if (is_removal) {
         url_cmd = af::regex::dollar_subst(vars.erase_cmd.c_str(),
           extcmd_vars);
       }
@@ -501,7 +725,7 @@ void process_opqueue(af::opQueue &opq, std::list<af::extCmd *> &cmdq,
           extcmd_vars);
       }
 
-      af::log::info(af::log_level_debug, "Preparing operation command: %s",
+      AF_LOG(info, af::log_level_debug, "Preparing operation command: %s",
         url_cmd.c_str());
 
       // Launch command
@@ -512,7 +736,7 @@ void process_opqueue(af::opQueue &opq, std::list<af::extCmd *> &cmdq,
       if (r == 0) {
 
         // Command started successfully
-        af::log::ok(af::log_level_low, "Operation started: %s (uiid=%u)",
+        AF_LOG(ok, af::log_level_low, "Operation started: %s (uiid=%u)",
           qent->get_main_url(), qent->get_instance_id());
 
         sum_cmd_started++;
@@ -528,16 +752,27 @@ void process_opqueue(af::opQueue &opq, std::list<af::extCmd *> &cmdq,
 
       }
       else {
-        af::log::error(af::log_level_high, "Error running external command, "
-          "wrapper returned %d: check permissions on %s. Command issued: %s",
+        AF_LOG_RATE(error, af::log_level_high, AF_MAX_FAIL_MSGS_PER_SEC,
+          "Error running external command, wrapper returned %d: check "
+          "permissions on %s. Command issued: %s",
           r, af::extCmd::get_temp_path(), url_cmd.c_str());
       }
 
+      // No slot left, not even for a batch: stop filling it
+      if (free_cmd_slots <= 0) break;
+
     }
     opq.free_query_by_status();
 
+    if (free_cmd_slots > 0) {
+      sum_cmd_started += start_verify_batch(opq, cmdq, batch_cmds, batch_urls,
+        batch_id, extcmd_vars, vars);
+    }
+
   }
 
+  timer_q.stop();
+
   //
   // Summary
   //
@@ -555,252 +790,291 @@ void process_opqueue(af::opQueue &opq, std::list<af::extCmd *> &cmdq,
     sum_cmd_started, sum_cmd_finished, sum_cmd_ok, sum_cmd_err,
     (float)sum_cmd_finished/(float)vars.sleep_secs );
 
+  if (sum_cmd_res.n_cmds > 0) {
+    af::log::info(af::log_level_high, "Resources of finished operations: "
+      "CPU: %.2lf s | Max RSS: %lu KiB | Read: %llu bytes",
+      sum_cmd_res.cpu_sec, sum_cmd_res.max_rss_kib, sum_cmd_res.read_chars);
+  }
+
   //af::log::info(af::log_level_normal, "========== Begin Of Queue ==========");
   //opq.dump(true);
   //af::log::info(af::log_level_normal, "========== End Of Queue ==========");
 
 }
 
-/** Scan over all datasets handled by the dataset manager wrapper dsm to save
- *  back finished elements from opq
+/** Saves back on the given dataset the results of its finished files, taken
+ *  from opq without looking at the other files. The dataset is read again and
+ *  results are applied by URL, fixing URLs again as when enqueueing: changes
+ *  made to the dataset while its files were verified are kept. Queue entries
+ *  not owned by any other dataset in flight are removed from opq afterwards.
  */
-void process_datasets_save(af::opQueue &opq, af::dataSetList &dsm,
+void save_dataset(af::opQueue &opq, af::dataSetList &dsm, ds_in_flight_t &dif,
   verifier_vars_t &vars, verifier_options_t &opts) {
 
   const af::queueEntry *qent;
+  const char *ds = dif.name.c_str();
 
-  af::log::info(af::log_level_high,
-    "*** Saving entries back on datasets ***");
+  af::log::info(af::log_level_normal, "Saving dataset %s", ds);
 
-  const char *ds;
-  dsm.fetch_datasets();
-  unsigned int count_ds = 0;
+  af::scopedTimer timer_fetch(vars.phases->get("datasets_fetch"));
+  bool fetch_ok = dsm.fetch_files(ds, opts.filter);
+  timer_fetch.stop();
 
-  while (ds = dsm.next_dataset()) {
+  if (!fetch_ok) {
+    af::log::error(af::log_level_high, "Can not read dataset %s: results of "
+      "its verification are not saved", ds);
+    opq.remove_dataset(dif.id);
+    return;
+  }
 
-    af::log::info(af::log_level_normal, "Scanning dataset %s", ds);
+  int count_changes = 0;
+  int count_url_changes = 0;
+  int count_files = 0;
+  TFileInfo *fi;
 
-    TFileInfo *fi;
-    dsm.fetch_files(NULL, opts.filter);  // SsCc == every file
-    int count_changes = 0;
-    int count_files = 0;
+  while (fi = dsm.next_file()) {
 
-    while (fi = dsm.next_file()) {
+    count_files++;
 
-      // We count the retrieved files
-      count_files++;
+    const char *out_url = fix_entry_urls(dsm, fi, vars, ds, count_url_changes);
+    if (!out_url) continue;  // unsupported URL
+
+    // Only finished entries have results
+    qent = opq.get_cond_entry(out_url);
+    if ((!qent) || ((qent->get_status() != af::qstat_success) &&
+      (qent->get_status() != af::qstat_failed))) continue;
 
-      // Originating URL is the last one; redirector URL is the last but one
-      TUrl *orig_url = dsm.get_url(-1);
+    if ((opts.rm_corr) && (qent->get_flag(0))) {
 
-      if (!orig_url) continue;  // no URLs in entry (should not happen)
+      // Handle removal operation
 
-      const char *inp_url = orig_url->GetUrl();
-      const char *out_url = NULL;
+      if (qent->get_status() == af::qstat_success) {
+
+        // In this case, we requested removal because original file was
+        // corrupted, and removal succeeded. File must be marked as unstaged
+        // and corrupted.
+
+        fi->ResetBit(TFileInfo::kStaged);
+        fi->SetBit(TFileInfo::kCorrupted);
+
+        af::log::warning(af::log_level_normal, "File %s has been removed "
+          "since it was corrupted", out_url);
 
-      // Find the first matching regex for URL substitution
-      for (unsigned int i=0; i<vars.n_url_regexs; i++) {
-        out_url = vars.url_regexs[i]->subst(inp_url);
-        if (out_url) break;
       }
+      else if (qent->get_status() == af::qstat_failed) {
 
-      // If no regex is found, orig URL is unsupported: skip it
-      if (!out_url) continue;
+        af::log::error(af::log_level_normal, "File %s: removal requested, "
+          "but failed", out_url);
 
-      //
-      // At this point, we have redir URL on out_url
-      //
+      }
 
-      qent = opq.get_cond_entry(out_url);
+    }
+    else {
 
-      if ((opts.rm_corr) && (qent) && (qent->get_flag(0))) {
+      //
+      // Handle verification operation
+      //
 
-        // Handle removal operation
+      const char *endp_url = qent->get_endp_url();
 
-        if (qent->get_status() == af::qstat_success) {
+      if ((qent->get_status() == af::qstat_success) && (endp_url)) {
 
-          // In this case, we requested removal because original file was
-          // corrupted, and removal succeeded. File must be marked as unstaged
-          // and corrupted.
+        //
+        // OK reported --> file correctly staged; if we used extended
+        // verification, we can also update metadata.
+        //
 
-          fi->ResetBit(TFileInfo::kStaged);
-          fi->SetBit(TFileInfo::kCorrupted);
+        bool meta_upd = false;
 
-          af::log::warning(af::log_level_normal, "File %s has been removed "
-            "since it was corrupted", out_url);
+        if (!fi->AddUrl(qent->get_endp_url(), kTRUE)) {
+          AF_LOG(warning, af::log_level_debug, "In dataset %s, "
+            "endpoint URL %s is a duplicate", ds, endp_url);
+        }
 
+        // Update file size (only if meaningful)
+        if (qent->get_size_bytes() > 0) {
+          fi->SetSize(qent->get_size_bytes());
         }
-        else if (qent->get_status() == af::qstat_failed) {
 
-          af::log::error(af::log_level_normal, "File %s: removal requested, "
-            "but failed", out_url);
+        if ((qent->get_tree_name()) && (qent->get_n_events() > 0)) {
 
-        }
+          // CASE A: in this case we performed a successful deep verification,
+          // on a file that might have been either corrupted or not.
 
-      }
-      else if (qent) {
+          meta_upd = true;
 
-        //
-        // Handle verification operation
-        //
+          // All metadata is first removed...
+          TList *mdl = fi->GetMetaDataList();
+          if ((mdl) && (mdl->GetEntries() > 0)) fi->RemoveMetaData();
 
-        const char *endp_url = qent->get_endp_url();
+          // ...then new metadata is added
+          TFileInfoMeta *meta = new TFileInfoMeta(qent->get_tree_name());
+          meta->SetEntries(qent->get_n_events());
+          fi->AddMetaData(meta);
 
-        if ((qent->get_status() == af::qstat_success) && (endp_url)) {
+          // In this case only we are sure that the file is there and
+          // not corrupted!
+          fi->SetBit(TFileInfo::kStaged);
+          fi->ResetBit(TFileInfo::kCorrupted);
 
-          //
-          // OK reported --> file correctly staged; if we used extended
-          // verification, we can also update metadata.
-          //
+        }
+        else {
 
-          bool meta_upd = false;
+          // CASE B: neither "deep" check nor removal occured: trust
+          // preexistent corrupted bit (if told so). This is the "shallow"
+          // verification, identified by the presence of no metadata.
 
-          if (!fi->AddUrl(qent->get_endp_url(), kTRUE)) {
-            af::log::warning(af::log_level_debug, "In dataset %s, "
-              "endpoint URL %s is a duplicate", ds, endp_url);
+          if ((fi->TestBit(TFileInfo::kCorrupted)) &&
+            (opts.trust_corr_shallow)) {
+            // File is originally corrupted: mark it as not staged, even if it
+            // is, but only if told to trust originally corrupted bit on (C)
+            fi->ResetBit(TFileInfo::kStaged);  // sC
           }
-
-          // Update file size (only if meaningful)
-          if (qent->get_size_bytes() > 0) {
-            fi->SetSize(qent->get_size_bytes());
+          else {
+            // File is not corrupted: mark it as staged and uncorrupted
+            fi->SetBit(TFileInfo::kStaged);  // Sc
+            fi->ResetBit(TFileInfo::kCorrupted);
           }
 
-          if ((qent->get_tree_name()) && (qent->get_n_events() > 0)) {
+        }
+
+        AF_LOG(ok, af::log_level_low,
+          "File %s is staged as %s (metadata updated: %s, corrupted: %s)",
+          out_url, endp_url, (meta_upd ? "yes" : "no"),
+          (fi->TestBit(TFileInfo::kCorrupted) ? "yes" : "no"));
 
-            // CASE A: in this case we performed a successful deep verification,
-            // on a file that might have been either corrupted or not.
+        count_changes++;
 
-            meta_upd = true;
+      }  // end if success (verif.)
+      else if (qent->get_status() == af::qstat_failed) {
 
-            // All metadata is first removed...
-            TList *mdl = fi->GetMetaDataList();
-            if ((mdl) && (mdl->GetEntries() > 0)) fi->RemoveMetaData();
+        //
+        // FAIL reported --> file not staged (Reason: not_staged) or another
+        // error
+        //
 
-            // ...then new metadata is added
-            TFileInfoMeta *meta = new TFileInfoMeta(qent->get_tree_name());
-            meta->SetEntries(qent->get_n_events());
-            fi->AddMetaData(meta);
+        // File is always staged when FAIL occurs, except when Reason is
+        // not_staged: in this very case we change the staged and the
+        // corrupted bit, elsewhere we don't touch anything
+        if (!qent->is_staged()) {
 
-            // In this case only we are sure that the file is there and
-            // not corrupted!
-            fi->SetBit(TFileInfo::kStaged);
-            fi->ResetBit(TFileInfo::kCorrupted);
+          // Reason: not_staged
+          // Not Staged and Corrupted --> why?
+          // Because we have the Real Status (not staged) but we don't trigger
+          // restaging through daemon (corrupted)
+          fi->ResetBit( TFileInfo::kStaged );
+          fi->SetBit( TFileInfo::kCorrupted );
 
-          }
-          else {
+          af::log::warning(af::log_level_normal, "File %s is not staged: "
+            "marked as not staged and corrupted", out_url);
 
-            // CASE B: neither "deep" check nor removal occured: trust
-            // preexistent corrupted bit (if told so). This is the "shallow"
-            // verification, identified by the presence of no metadata.
+          count_changes++;
 
-            if ((fi->TestBit(TFileInfo::kCorrupted)) &&
-              (opts.trust_corr_shallow)) {
-              // File is originally corrupted: mark it as not staged, even if it
-              // is, but only if told to trust originally corrupted bit on (C)
-              fi->ResetBit(TFileInfo::kStaged);  // sC
-            }
-            else {
-              // File is not corrupted: mark it as staged and uncorrupted
-              fi->SetBit(TFileInfo::kStaged);  // Sc
-              fi->ResetBit(TFileInfo::kCorrupted);
-            }
+        }
+        else {
 
-          }
+          // File seems to be not staged and failed: mark as corrupted
+          fi->SetBit( TFileInfo::kStaged );
+          fi->SetBit( TFileInfo::kCorrupted );
 
-          af::log::ok(af::log_level_low,
-            "File %s is staged as %s (metadata updated: %s, corrupted: %s)",
-            out_url, endp_url, (meta_upd ? "yes" : "no"),
-            (fi->TestBit(TFileInfo::kCorrupted) ? "yes" : "no"));
+          AF_LOG_RATE(error, af::log_level_normal, AF_MAX_FAIL_MSGS_PER_SEC,
+            "File %s is staged, but verification failed: marked as "
+            "corrupted", out_url);
 
           count_changes++;
 
-        }  // end if success (verif.)
-        else if (qent->get_status() == af::qstat_failed) {
-
-          //
-          // FAIL reported --> file not staged (Reason: not_staged) or another
-          // error
-          //
+        }
 
-          // File is always staged when FAIL occurs, except when Reason is
-          // not_staged: in this very case we change the staged and the
-          // corrupted bit, elsewhere we don't touch anything
-          if (!qent->is_staged()) {
+      }  // end if failed
 
-            // Reason: not_staged
-            // Not Staged and Corrupted --> why?
-            // Because we have the Real Status (not staged) but we don't trigger
-            // restaging through daemon (corrupted)
-            fi->ResetBit( TFileInfo::kStaged );
-            fi->SetBit( TFileInfo::kCorrupted );
+    } // end if verification
 
-            af::log::warning(af::log_level_normal, "File %s is not staged: "
-              "marked as not staged and corrupted", out_url);
+  }  // end loop over dataset entries
 
-            count_changes++;
+  //
+  // Save only if needed: fixed URLs count as well
+  //
 
-          }
-          else {
+  if (count_changes + count_url_changes > 0) {
+    af::scopedTimer timer_save(vars.phases->get("datasets_save"));
+    bool save_ok = dsm.save_dataset();  // no toggle_suid here
+    timer_save.stop();
+    if (save_ok) {
+      af::log::ok(af::log_level_high,
+        "Dataset %s saved: %d entries, %d just updated", ds, count_files,
+        count_changes);
+      total_saved_back += count_changes;
+    }
+    else {
+      af::log::error(af::log_level_high,
+        "Dataset %s not saved: check permissions", ds);
+    }
+  }
+  else {
+    AF_LOG(info, af::log_level_low, "Dataset %s not modified", ds);
+  }
 
-            // File seems to be not staged and failed: mark as corrupted
-            fi->SetBit( TFileInfo::kStaged );
-            fi->SetBit( TFileInfo::kCorrupted );
+  dsm.free_files();
 
-            af::log::error(af::log_level_normal, "File %s is staged, but "
-              "verification failed: marked as corrupted", out_url);
+  //
+  // Clean up operations queue
+  //
 
-            count_changes++;
+  unsigned int n_removed = opq.remove_dataset(dif.id);
 
-          }
+  AF_LOG(ok, af::log_level_low,
+    "%u elements removed from the operations queue", n_removed);
 
-        }  // end if failed
+}
 
-      } // end if qent
+/** Saves back the datasets in flight whose files have all been verified (or
+ *  every dataset in flight if forced, e.g. when quitting): each dataset is
+ *  saved as soon as it is complete, without waiting for the others. When
+ *  failures are retried forever, files which failed at least once do not hold
+ *  their dataset: they are left untouched in it. Returns the number of datasets
+ *  saved.
+ */
+unsigned int process_datasets_save(af::opQueue &opq, af::dataSetList &dsm,
+  verifier_pipeline_t &pipe, verifier_vars_t &vars, verifier_options_t &opts,
+  bool force = false) {
 
-    }  // end loop over dataset entries (TFileInfos)
+  std::vector<unsigned int> ready_ids;  // sorted
+  if (!force) opq.get_ready_datasets(ready_ids, (vars.max_failures == 0));
+  unsigned int count_ds = 0;
 
-    //
-    // Save only if needed
-    //
+  std::list<ds_in_flight_t>::iterator it = pipe.in_flight.begin();
+  while (it != pipe.in_flight.end()) {
 
-    if (count_changes > 0) {
-      bool save_ok = dsm.save_dataset();  // no toggle_suid here
-      if (save_ok) {
-        af::log::ok(af::log_level_high,
-          "Dataset %s saved: %d entries, %d just updated", ds, count_files,
-          count_changes);
-        total_saved_back += count_changes;
-      }
-      else {
-        af::log::error(af::log_level_high,
-          "Dataset %s not saved: check permissions", ds);
-      }
+    if ((!force) &&
+      (!std::binary_search(ready_ids.begin(), ready_ids.end(), it->id))) {
+      it++;
+      continue;
     }
-    else {
-      af::log::info(af::log_level_low, "Dataset %s not modified", ds);
+
+    if (count_ds == 0) {
+      af::log::info(af::log_level_high,
+        "*** Saving entries back on datasets ***");
     }
 
-    dsm.free_files();
+    save_dataset(opq, dsm, *it, vars, opts);
+    pipe.n_files_in_flight -= it->n_files;
+    it = pipe.in_flight.erase(it);
     count_ds++;
 
-  }  // end loop over datasets
-
-  dsm.free_datasets();
-
-  af::log::info(af::log_level_normal, "Number of datasets processed: %u",
-    count_ds);
-
-  //
-  // Clean up operations queue
-  //
+  }
 
-  int n_flushed = opq.flush();
-  af::log::ok(af::log_level_high,
-    "%d elements removed from the operations queue", n_flushed);
+  if (count_ds > 0) {
+    af::log::info(af::log_level_normal, "Number of datasets processed: %u",
+      count_ds);
+  }
 
+  return count_ds;
 }
 
 /** Merge all datasets found into one big dataset named /merged/merged/merged.
+ *  Datasets are read one at a time, and only the first entry of every file
+ *  (identified by its originating URL) is copied: memory depends on the number
+ *  of unique files only.
  */
 void merge_datasets(af::dataSetList &dsm, verifier_vars_t &vars) {
 
@@ -811,6 +1085,8 @@ void merge_datasets(af::dataSetList &dsm, verifier_vars_t &vars) {
     "*** Merging all datasets to /merged/merged/merged ***");
 
   TFileCollection *merged_fc = new TFileCollection();
+  af::fingerprintSet merged_urls;
+  unsigned long count_files = 0;
 
   dsm.fetch_datasets();
   const char *ds;
@@ -818,7 +1094,13 @@ void merge_datasets(af::dataSetList &dsm, verifier_vars_t &vars) {
 
     if (dsm.fetch_files()) {
       af::log::info(af::log_level_low, "Merging dataset %s", ds);
-      merged_fc->Add( (TFileCollection *)dsm.get_fc() );
+      TFileInfo *fi;
+      while (fi = dsm.next_file()) {
+        count_files++;
+        TUrl *orig_url = dsm.get_url(-1);  // originating URL is the last one
+        if ((orig_url) && (!merged_urls.insert(orig_url->GetUrl()))) continue;
+        merged_fc->Add( new TFileInfo(*fi) );
+      }
     }
     else af::log::error(af::log_level_high, "Can not merge dataset %s", ds);
 
@@ -834,10 +1116,9 @@ void merge_datasets(af::dataSetList &dsm, verifier_vars_t &vars) {
   ds_dir += "/merged";
   mkdir(ds_dir.c_str(), S_IRWXU|S_IRWXG|S_IRWXO);
 
-  merged_fc->RemoveDuplicates();
   if (dsm.save_dataset(merged_fc, "/merged/merged/merged"))
     af::log::ok(af::log_level_high, "Merged dataset saved "
-      "(%lld unique entries)", merged_fc->GetNFiles());
+      "(%lld unique entries out of %lu)", merged_fc->GetNFiles(), count_files);
   else
     af::log::error(af::log_level_high,"Saving of merged dataset failed");
 
@@ -849,7 +1130,7 @@ void merge_datasets(af::dataSetList &dsm, verifier_vars_t &vars) {
 /** The main loop. The loop breaks when the external variable quit_requested is
  *  set to true.
  */
-void main_loop(af::config &config, verifier_options_t &opts) {
+void main_loop(af::config &config, verifier_options_t &opts, af::log &log) {
 
   // Resources monitoring
   af::resMon resmon;
@@ -857,6 +1138,10 @@ void main_loop(af::config &config, verifier_options_t &opts) {
   // Variables in configuration file
   verifier_vars_t vars;
 
+  // Timing of the phases of the loop
+  af::phaseStats phases;
+  vars.phases = &phases;
+
   // The dataset manager wrapper, used by process_datasets_*()
   af::dataSetList dsm;
   std::string dsm_url;
@@ -870,19 +1155,28 @@ void main_loop(af::config &config, verifier_options_t &opts) {
 
   // The staging queue, used by process_opqueue() only
   std::list<af::extCmd *> cmdq;
+  std::set<af::extCmd *> batch_cmds;  // commands verifying many URLs
+
+  // Datasets to verify, used by process_datasets_*()
+  verifier_pipeline_t pipe;
+  pipe.next_pending = 0;
+  pipe.n_files_in_flight = 0;
 
   // Bind directives to either variables or special callbacks
   config.bind_callback("xpd.datasetsrc", &config_callback_datasetsrc,
     dsm_cbk_args);
   config.bind_int("verifier.sleepsecs", &vars.sleep_secs, 30, 2, AF_INT_MAX);
-  config.bind_int("verifier.scandseveryloops", &vars.scan_ds_every_loops, 10, 1,
-    AF_INT_MAX);
+  config.bind_int("verifier.filesinflight", &vars.files_in_flight, 10000,
+    1, AF_INT_MAX);
   config.bind_int("verifier.parallelverifies", &vars.parallel_verifies,
     8, 1, AF_INT_MAX);
+  config.bind_int("verifier.verifybatch", &vars.verify_batch, 1, 1, 10000);
   config.bind_text("verifier.verifycmd", &vars.verify_cmd, "/bin/false");
   config.bind_text("verifier.erasecmd", &vars.erase_cmd, "/bin/false");
   config.bind_int("verifier.maxfailures", &vars.max_failures, 0, 0,
     1000);
+  config.bind_int("verifier.asynclog", &vars.log_ring_size, 0, 0,
+    AF_LOG_MAX_RING_SIZE);
 
   // Initializes regular expression objects for URL substitutions and their
   // respective callbacks
@@ -907,18 +1201,19 @@ void main_loop(af::config &config, verifier_options_t &opts) {
       i, direc_name.str().c_str());
   }
 
-  //
-  // Put files in queue, reading them from the datasets
-  //
-
   // Load configuration at first place
   config.update();
+  log.set_async((unsigned int)vars.log_ring_size, af::log_overflow_block);
 
-  // Put files in queue
-  process_datasets_enqueue(opq, dsm, vars, opts);
-
-  // The loop counter
-  long count_loops = -1;
+  // List of datasets: they are read one by one later on
+  {
+    const char *ds;
+    dsm.fetch_datasets();
+    while (ds = dsm.next_dataset()) pipe.pending.push_back(ds);
+    dsm.free_datasets();
+    af::log::info(af::log_level_high, "Datasets to verify: %lu",
+      (unsigned long)pipe.pending.size());
+  }
 
   // The actual loop
   while (!quit_requested) {
@@ -929,54 +1224,53 @@ void main_loop(af::config &config, verifier_options_t &opts) {
     // Check and load updates from the configuration file
     //
 
+    af::scopedTimer timer_config(phases.get("config"));
+
     if (config.update()) {
       af::log::info(af::log_level_high, "Config file modified");
+      log.set_async((unsigned int)vars.log_ring_size, af::log_overflow_block);
     }
     else af::log::info(af::log_level_low, "Config file unmodified");
 
+    timer_config.stop();
+
     //
-    // Loop counter: we do not use MOD operator to take into account config
-    // file modifications of directive dsmgrd.scandseveryloops
+    // Put files in queue, reading them from the next datasets
     //
 
-    count_loops++;
-    if (count_loops >= vars.scan_ds_every_loops) count_loops = 0;
-    af::log::info(af::log_level_debug, "Iteration: %ld/%ld",
-      count_loops, vars.scan_ds_every_loops);
+    {
+      af::scopedTimer timer_enq(phases.get("datasets_enqueue"));
+      process_datasets_enqueue(opq, dsm, pipe, vars, opts);
+    }
 
     //
     // Operations queue
     //
 
-    process_opqueue(opq, cmdq, vars, opts);
-
-    unsigned int n_queued, n_runn, n_success, n_fail, n_total;
-    opq.summary(n_queued, n_runn, n_success, n_fail);
+    process_opqueue(opq, cmdq, batch_cmds, vars, opts);
 
     //
-    // Process datasets (every X loops)
+    // Save back datasets whose files are all verified, and read the next ones
+    // right away in place of them
     //
 
-    // Either proper loop number or no more elements are running/waiting
-    if ((count_loops == 0) || (n_queued+n_runn == 0)) {
-      if (n_success+n_fail > 0) process_datasets_save(opq, dsm, vars, opts);
-    }
-    else {
-      int diff_loops = vars.scan_ds_every_loops - count_loops;
-      if (diff_loops == 1) {
-        af::log::info(af::log_level_high, "Not processing datasets now: they "
-          "will be processed in the next loop");
-      }
-      else {
-        af::log::info(af::log_level_high, "Not processing datasets now: "
-          "%d loops remaining before processing", diff_loops);
+    {
+      af::scopedTimer timer_ds(phases.get("datasets"));
+      unsigned int n_saved = process_datasets_save(opq, dsm, pipe, vars, opts);
+      timer_ds.stop();
+      if (n_saved > 0) {
+        af::scopedTimer timer_enq(phases.get("datasets_enqueue"));
+        process_datasets_enqueue(opq, dsm, pipe, vars, opts);
       }
     }
 
     //
-    // Report resources
+    // Report phase timings and resources
     //
 
+    phases.log_summary(af::log_level_normal);
+    phases.new_loop();
+
     af::res_timing_t &rtd = resmon.get_delta_timing();
     af::res_timing_t &rtc = resmon.get_cumul_timing();
     af::res_mem_t    &rm  = resmon.get_mem_usage();
@@ -999,16 +1293,14 @@ void main_loop(af::config &config, verifier_options_t &opts) {
     }
 
     //
-    // End of loop: do we still have something to do? Check queue...
+    // End of loop: do we still have something to do? Check datasets...
     //
 
-    opq.summary(n_queued, n_runn, n_success, n_fail);
-    n_total = n_queued + n_runn + n_success + n_fail;
-
-    if (n_total == 0) {
+    if ((pipe.in_flight.empty()) &&
+      (pipe.next_pending >= pipe.pending.size())) {
       af::log::ok(af::log_level_urgent,
         "Every operation has completed, let's quit");
-      quit_requested = true;
+      quit_requested = 1;
     }
     else if (!quit_requested) {
       af::log::info(af::log_level_high, "Sleeping %ld seconds",
@@ -1018,12 +1310,26 @@ void main_loop(af::config &config, verifier_options_t &opts) {
 
   }  // big while
 
+  if (quit_signal) {
+    af::log::warning(af::log_level_urgent, "Quit requested with signal %d",
+      (int)quit_signal);
+  }
+
   // Delete elements still in command queue
   for (std::list<af::extCmd *>::iterator it=cmdq.begin();
     it!=cmdq.end(); it++) {
+    if (batch_cmds.count(*it) > 0)
+      unlink( get_url_list_path((*it)->get_id()).c_str() );
     delete *it;
   }
 
+  // Save what has been verified so far on datasets still in flight
+  if (!pipe.in_flight.empty()) {
+    af::log::warning(af::log_level_urgent, "Saving %lu datasets whose "
+      "verification is incomplete", (unsigned long)pipe.in_flight.size());
+    process_datasets_save(opq, dsm, pipe, vars, opts, true);
+  }
+
   // Merge datasets
   if (opts.merge) merge_datasets(dsm, vars);
 
@@ -1238,7 +1544,7 @@ int main(int argc, char *argv[]) {
   signal(SIGTERM, signal_quit_callback);
   signal(SIGINT, signal_quit_callback);
 
-  main_loop(config, opts);
+  main_loop(config, opts, *global_log);
 
   return 0;
 